@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,34 +12,55 @@
 #include <sys/types.h>
 #include <libgen.h>
 #include <stdatomic.h>
-#include <poll.h>
 #include <getopt.h>
 #include <math.h>
+#include <time.h>
+#include <stdarg.h>
 
+#include "buffer_pool.h"
 #include "expandable_buffer.h"
+#include "metrics.h"
 #include "process_utils.h"
 #include "temp_files.h"
+#include "frame_ring.h"
+#include "temp_io.h"
+#include "png_framer.h"
+#include "frame_compare.h"
+#include "dirty_tiles.h"
+#include "upscale_cache.h"
+#include "video_segments.h"
+#include "media_probe.h"
+#include "resume_job.h"
+#include "batch_pipeline.h"
+#include "batch_sizer.h"
+#include "frame_queue.h"
+#include "progress_reactor.h"
+#include "upscaler_worker.h"
+#include "upscaler_backend.h"
+#include "cpu_resampler.h"
+#include "scale_planner.h"
+#include "upscale_daemon.h"
 
 static volatile sig_atomic_t stop_signalled = 0;
 static volatile sig_atomic_t ffmpeg_src_stopped = 0;
 
+// Each parallel segment is a whole copy of this program, tracked in the same process slots
+#define MAX_PARALLEL_SEGMENTS 64
+// ffmpeg source and results, then a noise and a scale waifu2x process per worker
+#define SESSION_PROCESS_COUNT (1 + MAX_RESULT_ENCODERS + 2 * MAX_UPSCALER_WORKERS)
 static struct {
 	union {
-		volatile _Atomic pid_t processes[6];
+		volatile _Atomic pid_t processes[SESSION_PROCESS_COUNT];
 		struct {
 			volatile _Atomic pid_t ffmpeg_src_process;
-		   	volatile _Atomic pid_t ffmpeg_rst_process;
-			volatile _Atomic pid_t waifu2x_process;
-
-			// TODO: Use these
-			volatile _Atomic pid_t ffmpeg_src_monitor_process;
-			volatile _Atomic pid_t ffmpeg_rst_monitor_process;
-			volatile _Atomic pid_t waifu2x_monitor_process;
+		   	volatile _Atomic pid_t ffmpeg_rst_processes[MAX_RESULT_ENCODERS];
+			volatile _Atomic pid_t waifu2x_processes[2 * MAX_UPSCALER_WORKERS];
 		};
 	};
 	temp_frame* temp_frames;
 	size_t temp_frame_count;
-} session_data = { .processes={0}, .temp_frames=NULL, .temp_frame_count=0};
+	temp_frame_store frame_store;
+} session_data = { .processes={0}, .temp_frames=NULL, .temp_frame_count=0, .frame_store = { .names = NULL }};
 void stop_program_from_signal(int sig){
 	/*if (sig == SIGCHLD){
 		int exit_status = 0;
@@ -54,7 +76,7 @@ void stop_program_from_signal(int sig){
 	if (sig == SIGINT) signal(SIGINT, SIG_IGN);
 	
 	int i;
-	for (i = 0; i < 6; i++){
+	for (i = 0; i < SESSION_PROCESS_COUNT; i++){
 		size_t process_to_kill = atomic_load(&session_data.processes[i]);
 		if (process_to_kill != 0)
 			kill(process_to_kill, SIGINT);
@@ -66,10 +88,13 @@ void stop_program_from_signal(int sig){
 void cleanup(){
 	if (session_data.temp_frames == NULL) return;
 	int i;
-	for (i = 0; i < session_data.temp_frame_count; i++)
-		free_temp_frame(&session_data.temp_frames[i]);
+	for (i = 0; i < session_data.temp_frame_count; i++){
+		// Slots a batch hasn't grown into yet are empty
+		if (session_data.temp_frames[i].file != NULL) free_temp_frame(&session_data.temp_frames[i]);
+	}
 	free(session_data.temp_frames);
 	session_data.temp_frames = NULL;
+	free_temp_frame_store(&session_data.frame_store);
 }
 
 // Use waifu2x to upscale 16 images per round
@@ -80,7 +105,8 @@ typedef struct {
 	unsigned int width;
 	unsigned int height;
 } source_file_data;
-void fill_source_file_data(char* filepath, source_file_data* output, size_t output_length){
+// Runs ffprobe for what probe_media_file couldn't read
+void run_ffprobe(char* filepath, media_probe* probe){
 	char* ffprobe_command[] = { "ffprobe",
 								"-v", "error", // Only log extra messages on error
 								"-select_streams", "v:0", // Print data on first video stream
@@ -90,28 +116,49 @@ void fill_source_file_data(char* filepath, source_file_data* output, size_t outp
 								NULL };
 	pipe_data ffprobe_output_pipe = create_pipe_data();
 	pid_t ffprobe_output_pid = run_command(ffprobe_command, NULL, NULL, &ffprobe_output_pipe, 0);
+	if (ffprobe_output_pid == -1) exit(1);
 	//pipe_data_close_write_to(&ffprobe_output_pipe);
 
-	float fps_nom, fps_denom = 1.0f;
+	probe->framerate_denominator = 1.0f;
 	FILE* ffprobe_output = fdopen(ffprobe_output_pipe.files.read_from, "r");
-	if (fscanf(ffprobe_output, "%u,%u,%f/%f", &output->width, &output->height, &fps_nom, &fps_denom) < 3){ // Allow 3 or 4
+	if (fscanf(ffprobe_output, "%u,%u,%f/%f", &probe->width, &probe->height, &probe->framerate_numerator, &probe->framerate_denominator) < 3){ // Allow 3 or 4
 		fprintf(stderr, "Error parsing ffprobe output\n");
 		exit(1);
 	}
-	output->framerate = fps_nom / fps_denom;
-	snprintf(output->framerate_str, MAX_FRAMERATE_CHARACTERS, "%f", output->framerate);
 	
 	fclose(ffprobe_output);
 	// This ends up closing the pipe?
+	waitpid(ffprobe_output_pid, NULL, 0);
+}
+// Probes the input's container ourselves if we can, or remembers what ffprobe said about it
+void fill_source_file_data(char* filepath, source_file_data* output, size_t output_length){
+	media_probe probe;
+	if (probe_cache_lookup(filepath, &probe) != 0){
+		if (probe_media_file(filepath, &probe) != 0) run_ffprobe(filepath, &probe);
+		probe_cache_store(filepath, &probe);
+	}
+	output->width = probe.width;
+	output->height = probe.height;
+	output->framerate = probe.framerate_numerator / probe.framerate_denominator;
+	snprintf(output->framerate_str, MAX_FRAMERATE_CHARACTERS, "%f", output->framerate);
 }
 
 #define DEFAULT_FRAMES_PER_UPSCALE_ROUND 256
+// Each of several result encoders gets this much of the video at a time, and starts it on a keyframe
+#define RESULT_ENCODER_CHUNK_SECONDS 2
+#define ENCODE_DIRECTORY_SUFFIX ".encode"
 
 static struct {
 	char* input_filepath;
 	char* output_filepath;
 	
-	size_t frames_per_upscale_round;
+	size_t frames_per_upscale_round; // The most frames per batch with --frame-count=auto
+	int auto_frame_count;
+	size_t upscaler_workers;
+	int backend;
+	int cpu_filter;
+	size_t cpu_threads; // 0 for one per CPU
+	int scale_quality;
 
 	int should_mute_ffmpeg_source;
 	int should_mute_waifu2x;
@@ -120,6 +167,35 @@ static struct {
 	char* waifu2x_folder;
 	char* waifu2x_file;
 	char* waifu2x_model;
+	char* waifu2x_worker_file;
+	int persistent_upscaler;
+	int raw_transport;
+	int skip_duplicates;
+	int duplicate_tolerance;
+	int dirty_tiles;
+	int check_crc;
+	int no_io_uring;
+	char* cache_directory;
+	uint64_t cache_size;
+	uint64_t max_memory; // 0 for no limit
+	char* metrics_filepath;
+	int metrics_prometheus;
+	unsigned int metrics_interval;
+	int resume;
+	size_t segments;
+	size_t result_encoders;
+	int has_time_range;
+	double time_range_start;
+	double time_range_end; // Negative to go to the end of the input
+	char* daemon_socket;
+	int daemon;
+	size_t daemon_jobs;
+	int daemon_submit;
+	int daemon_status;
+	int priority;
+	char daemon_request[64]; // A cancel or priority request, these don't need an input or output
+
+	int option_argument_count; // Where the input and output are in argv once getopt has sorted it
 
 	unsigned int target_width;
 	unsigned int target_height;
@@ -129,12 +205,45 @@ static struct {
 	.input_filepath = NULL,
 	.output_filepath = NULL,
 	.frames_per_upscale_round = DEFAULT_FRAMES_PER_UPSCALE_ROUND,
+	.auto_frame_count = 0,
+	.upscaler_workers = 1,
+	.backend = UPSCALER_BACKEND_WAIFU2X,
+	.cpu_filter = RESAMPLE_LANCZOS,
+	.cpu_threads = 0,
+	.scale_quality = SCALE_QUALITY_FULL,
 	.should_mute_ffmpeg_source = 1,
 	.should_mute_waifu2x = 0,
 	.should_mute_ffmpeg_result = 1,
 	.waifu2x_folder = "./waifu2x/",
 	.waifu2x_file = "waifu2x.lua",
 	.waifu2x_model = "models/photo",
+	.waifu2x_worker_file = NULL,
+	.persistent_upscaler = 0,
+	.raw_transport = 0,
+	.skip_duplicates = 0,
+	.duplicate_tolerance = 0,
+	.dirty_tiles = 0,
+	.check_crc = 0,
+	.no_io_uring = 0,
+	.cache_directory = NULL,
+	.cache_size = DEFAULT_UPSCALE_CACHE_SIZE,
+	.max_memory = 0,
+	.metrics_filepath = NULL,
+	.metrics_prometheus = -1, // Decided by the file's extension unless --metrics-format is given
+	.metrics_interval = DEFAULT_METRICS_INTERVAL,
+	.resume = 0,
+	.segments = 1,
+	.result_encoders = 1,
+	.daemon_socket = NULL,
+	.daemon = 0,
+	.daemon_jobs = DEFAULT_DAEMON_JOBS,
+	.daemon_submit = 0,
+	.daemon_status = 0,
+	.priority = 0,
+	.daemon_request = "",
+	.has_time_range = 0,
+	.time_range_start = 0.0,
+	.time_range_end = -1.0,
 	.dry_run = 0,
 
 	.target_width = 0,
@@ -142,25 +251,99 @@ static struct {
 };
 
 void print_help(FILE* file, int argc, char* argv[]){
-	fprintf(file, "Usage: %s [--frame-count=<FC>] [--waifu2x=<PATH>] [--waifu2x-model=<NAME>] [--target-size=<SIZE>,<SIZE>] [--] input-file output-file\n", argv[0]);
+	fprintf(file, "Usage: %s [--frame-count=<FC>] [--workers=<N>] [--backend=waifu2x|cpu] [--cpu-filter=lanczos|bicubic] [--cpu-threads=<N>] [--waifu2x=<PATH>] [--waifu2x-model=<NAME>] [--target-size=<SIZE>,<SIZE>] [--scale-quality=full|balanced|fast] [--persistent-upscaler] [--waifu2x-worker=<PATH>] [--raw-transport] [--skip-duplicates] [--duplicate-tolerance=<N>] [--dirty-tiles] [--check-crc] [--no-io-uring] [--cache-dir=<PATH>] [--cache-size=<SIZE>] [--max-memory=<SIZE>] [--metrics-file=<PATH>] [--metrics-format=json|prometheus] [--metrics-interval=<SECONDS>] [--resume] [--segments=<K>] [--encoders=<K>] [--time-range=<START>,<END>] [--daemon-socket=<PATH>] [--daemon] [--daemon-jobs=<N>] [--submit] [--priority=<N>] [--status] [--cancel=<ID>] [--set-priority=<ID>,<N>] [--] input-file output-file\n", argv[0]);
 	fprintf(file, "Options:\n\
  -h --help        Show this screen\n\
- --frame-count    Set the amount of frames that are concurrently processed. Default: %d\n\
+ --frame-count    Set the amount of frames upscaled per batch, or auto to adjust it while running up to the default. Default: %d\n\
+ --workers        Set the amount of waifu2x workers sharing each batch, implies --persistent-upscaler. Default: 1\n\
+ --backend        Upscale with waifu2x, or resample in this process on the CPU which implies --raw-transport. Default: waifu2x\n\
+ --cpu-filter     Set the filter the cpu backend and the resample after waifu2x scale with. Default: lanczos\n\
+ --cpu-threads    Set the amount of threads the cpu backend uses. Default: one per CPU\n\
  --waifu2x        Set the folder containing waifu2x.lua. waifu2x will be executed from here. Default: ./waifu2x/\n\
  --waifu2x-model  Set the model used by waifu2x to upscale images. Default: models/photo\n\
  --target-size    Set the resultant size of the video. By default the program upscales the video by 2x\n\
+ --scale-quality  Set how much the source may be shrunk before waifu2x and resampled up after it to save rounds, full does neither. Default: full\n\
+ --persistent-upscaler  Keep one waifu2x process per mode alive for the whole video instead of starting one per batch\n\
+ --waifu2x-worker Set the path of waifu2x_worker.lua used by --persistent-upscaler. Default: next to this program\n\
+ --raw-transport  Exchange uncompressed rgb24 frames with ffmpeg and the upscaler instead of PNGs, implies --persistent-upscaler\n\
+ --skip-duplicates      Don't upscale frames identical to the previous one, reuse the previous result instead\n\
+ --duplicate-tolerance  Also count frames as repeats if no channel differs by more than this, needs --raw-transport, implies --skip-duplicates. Default: 0\n\
+ --dirty-tiles    Only upscale the part of a frame that changed since the one before it and paste it over that one's result, implies --raw-transport\n\
+ --check-crc      Check the CRC of every PNG chunk coming from ffmpeg and stop on a corrupt frame\n\
+ --no-io-uring    Write and read temp frames with a few blocking calls each instead of a batch at a time through io_uring\n\
+ --cache-dir      Keep upscaled frames in this folder and reuse them for identical frames, even across runs\n\
+ --cache-size     Set the most disk space the cache may use, accepts K, M and G suffixes. Default: %lluG\n\
+ --max-memory     Set the most memory frame buffers may use, accepts K, M and G suffixes. Lowers --frame-count to fit. Default: no limit\n\
+ --metrics-file   Write counters and latency histograms for each stage to this file while running\n\
+ --metrics-format Write the metrics as json or as a Prometheus textfile. Default: prometheus for .prom files, json otherwise\n\
+ --metrics-interval     Set how often the metrics are written in seconds. Default: %d\n\
+ --resume         Encode in segments kept in <output-file>.resume/ and continue from the last finished batch if it exists\n\
+ --segments       Split the input at keyframes into this many parts, upscale them all at once and join them. Default: 1\n\
+ --encoders       Split encoding between this many result ffmpegs taking turns at %d second chunks, which are joined at the end. Default: 1\n\
+ --time-range     Only upscale the video between these times in seconds, leave END empty to go to the end. The output has no audio\n\
+ --daemon-socket  Borrow the warm workers of the daemon listening here instead of starting our own, implies --persistent-upscaler\n\
+ --daemon         Listen on --daemon-socket for jobs and keep --workers waifu2x workers per mode alive between them, needs no input or output\n\
+ --daemon-jobs    Set how many jobs the daemon runs at once, their frames share its workers. Default: %d\n\
+ --submit         Queue the input and output with the rest of these options on the daemon at --daemon-socket, it writes <output-file>.log\n\
+ --priority       Set the priority of a submitted job, higher ones start first. Default: 0\n\
+ --status         List the daemon's jobs\n\
+ --cancel         Cancel one of the daemon's jobs by ID\n\
+ --set-priority   Change the priority of one of the daemon's queued jobs\n\
  -d --dry-run     Do a dry run without running anything\n",
-			DEFAULT_FRAMES_PER_UPSCALE_ROUND);
+			DEFAULT_FRAMES_PER_UPSCALE_ROUND, DEFAULT_UPSCALE_CACHE_SIZE >> 30, DEFAULT_METRICS_INTERVAL, RESULT_ENCODER_CHUNK_SECONDS, DEFAULT_DAEMON_JOBS);
+}
+// Reads a byte count with an optional K, M or G suffix
+// returns 1 if it isn't one
+int parse_size(const char* text, uint64_t* size){
+	unsigned long long value;
+	char suffix = '\0';
+	int fields = sscanf(text, "%llu%c", &value, &suffix);
+	int shift = (suffix == 'K') ? 10 : (suffix == 'M') ? 20 : (suffix == 'G') ? 30 : (suffix == '\0') ? 0 : -1;
+	if (fields < 1 || shift < 0 || value == 0) return 1;
+	*size = (uint64_t)value << shift;
+	return 0;
 }
 void get_options(int argc, char* argv[]){
 	static char* short_options = "hd";
 	static struct option long_options[] = {
 		{ "frame-count", required_argument, NULL, 'f' },
+		{ "workers", required_argument, NULL, 'j' },
+		{ "backend", required_argument, NULL, 'b' },
+		{ "cpu-filter", required_argument, NULL, 'l' },
+		{ "cpu-threads", required_argument, NULL, 'T' },
 		{ "waifu2x", required_argument, NULL, 'w' },
 		{ "waifu2x-model", required_argument, NULL, 'm' },
 		{ "help", no_argument, NULL, 'h' },
 		{ "dry-run", no_argument, &options.dry_run, 1 },
 		{ "target-size", required_argument, NULL, 's' },
+		{ "scale-quality", required_argument, NULL, 'q' },
+		{ "persistent-upscaler", no_argument, &options.persistent_upscaler, 1 },
+		{ "waifu2x-worker", required_argument, NULL, 'W' },
+		{ "raw-transport", no_argument, &options.raw_transport, 1 },
+		{ "skip-duplicates", no_argument, &options.skip_duplicates, 1 },
+		{ "dirty-tiles", no_argument, &options.dirty_tiles, 1 },
+		{ "duplicate-tolerance", required_argument, NULL, 't' },
+		{ "check-crc", no_argument, &options.check_crc, 1 },
+		{ "no-io-uring", no_argument, &options.no_io_uring, 1 },
+		{ "cache-dir", required_argument, NULL, 'c' },
+		{ "cache-size", required_argument, NULL, 'C' },
+		{ "max-memory", required_argument, NULL, 'M' },
+		{ "metrics-file", required_argument, NULL, 'e' },
+		{ "metrics-format", required_argument, NULL, 'E' },
+		{ "metrics-interval", required_argument, NULL, 'i' },
+		{ "resume", no_argument, &options.resume, 1 },
+		{ "segments", required_argument, NULL, 'k' },
+		{ "encoders", required_argument, NULL, 'K' },
+		{ "time-range", required_argument, NULL, 'r' },
+		{ "daemon-socket", required_argument, NULL, 'S' },
+		{ "daemon", no_argument, &options.daemon, 1 },
+		{ "daemon-jobs", required_argument, NULL, 'J' },
+		{ "submit", no_argument, &options.daemon_submit, 1 },
+		{ "priority", required_argument, NULL, 'p' },
+		{ "status", no_argument, &options.daemon_status, 1 },
+		{ "cancel", required_argument, NULL, 'x' },
+		{ "set-priority", required_argument, NULL, 'P' },
+		{ 0, 0, 0, 0 }
 	};
 	int option_index = 0;
 
@@ -173,21 +356,185 @@ void get_options(int argc, char* argv[]){
 			print_help(stdout, argc, argv);
 			exit(0);
 		case 'f':
-			if (sscanf(optarg, "%zu", &options.frames_per_upscale_round) != 1){
+			options.auto_frame_count = (strcmp(optarg, "auto") == 0);
+			if (options.auto_frame_count){
+				options.frames_per_upscale_round = DEFAULT_FRAMES_PER_UPSCALE_ROUND;
+			}else if (sscanf(optarg, "%zu", &options.frames_per_upscale_round) != 1 || options.frames_per_upscale_round == 0){
 				fprintf(stderr, "Invalid value for --frame-count: '%s'\n", optarg);
 				print_help(stderr, argc, argv);
 				exit(1);
 			}	
 			break;
+		case 'j':
+			if (sscanf(optarg, "%zu", &options.upscaler_workers) != 1
+				|| options.upscaler_workers == 0 || options.upscaler_workers > MAX_UPSCALER_WORKERS){
+				fprintf(stderr, "Invalid value for --workers: '%s', must be between 1 and %d\n", optarg, MAX_UPSCALER_WORKERS);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'b':
+			if (strcmp(optarg, "waifu2x") != 0 && strcmp(optarg, "cpu") != 0){
+				fprintf(stderr, "Invalid value for --backend: '%s', must be waifu2x or cpu\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			options.backend = (strcmp(optarg, "cpu") == 0) ? UPSCALER_BACKEND_CPU : UPSCALER_BACKEND_WAIFU2X;
+			break;
+		case 'l':
+			if (strcmp(optarg, "lanczos") != 0 && strcmp(optarg, "bicubic") != 0){
+				fprintf(stderr, "Invalid value for --cpu-filter: '%s', must be lanczos or bicubic\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			options.cpu_filter = (strcmp(optarg, "bicubic") == 0) ? RESAMPLE_BICUBIC : RESAMPLE_LANCZOS;
+			break;
+		case 'q':
+			for (options.scale_quality = SCALE_QUALITY_FAST; options.scale_quality >= 0; options.scale_quality--){
+				if (strcmp(optarg, scale_quality_names[options.scale_quality]) == 0) break;
+			}
+			if (options.scale_quality < 0){
+				fprintf(stderr, "Invalid value for --scale-quality: '%s', must be full, balanced or fast\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'T':
+			if (sscanf(optarg, "%zu", &options.cpu_threads) != 1
+				|| options.cpu_threads == 0 || options.cpu_threads > MAX_CPU_THREADS){
+				fprintf(stderr, "Invalid value for --cpu-threads: '%s', must be between 1 and %d\n", optarg, MAX_CPU_THREADS);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
 		case 'w':
 			options.waifu2x_folder = optarg;
 			break;
 		case 'm':
 			options.waifu2x_model = optarg;
 			break;
+		case 'W':
+			options.waifu2x_worker_file = optarg;
+			break;
+		case 't':
+			if (sscanf(optarg, "%d", &options.duplicate_tolerance) != 1
+				|| options.duplicate_tolerance < 0 || options.duplicate_tolerance > 255){
+				fprintf(stderr, "Invalid value for --duplicate-tolerance: '%s', must be between 0 and 255\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			options.skip_duplicates = 1;
+			break;
+		case 'c':
+			options.cache_directory = optarg;
+			break;
+		case 'k':
+			if (sscanf(optarg, "%zu", &options.segments) != 1
+				|| options.segments == 0 || options.segments > MAX_PARALLEL_SEGMENTS){
+				fprintf(stderr, "Invalid value for --segments: '%s', must be between 1 and %d\n", optarg, MAX_PARALLEL_SEGMENTS);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'K':
+			if (sscanf(optarg, "%zu", &options.result_encoders) != 1
+				|| options.result_encoders == 0 || options.result_encoders > MAX_RESULT_ENCODERS){
+				fprintf(stderr, "Invalid value for --encoders: '%s', must be between 1 and %d\n", optarg, MAX_RESULT_ENCODERS);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'r':
+		{
+			int fields = sscanf(optarg, "%lf,%lf", &options.time_range_start, &options.time_range_end);
+			if (fields < 1 || options.time_range_start < 0.0 || (fields == 2 && options.time_range_end <= options.time_range_start)){
+				fprintf(stderr, "Invalid value for --time-range: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			if (fields == 1) options.time_range_end = -1.0;
+			options.has_time_range = 1;
+			break;
+		}
+		case 'C':
+			if (parse_size(optarg, &options.cache_size) != 0){
+				fprintf(stderr, "Invalid value for --cache-size: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'e':
+			options.metrics_filepath = optarg;
+			break;
+		case 'E':
+			if (strcmp(optarg, "json") != 0 && strcmp(optarg, "prometheus") != 0){
+				fprintf(stderr, "Invalid value for --metrics-format: '%s', must be json or prometheus\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			options.metrics_prometheus = (strcmp(optarg, "prometheus") == 0);
+			break;
+		case 'i':
+			if (sscanf(optarg, "%u", &options.metrics_interval) != 1 || options.metrics_interval == 0){
+				fprintf(stderr, "Invalid value for --metrics-interval: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'M':
+			if (parse_size(optarg, &options.max_memory) != 0){
+				fprintf(stderr, "Invalid value for --max-memory: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 0:
+			// Flag options set by getopt itself
+			break;
 		case 'd':
 			options.dry_run = 1;
 			break;
+		case 'S':
+			options.daemon_socket = optarg;
+			break;
+		case 'J':
+			if (sscanf(optarg, "%zu", &options.daemon_jobs) != 1 || options.daemon_jobs == 0){
+				fprintf(stderr, "Invalid value for --daemon-jobs: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'p':
+			if (sscanf(optarg, "%d", &options.priority) != 1){
+				fprintf(stderr, "Invalid value for --priority: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			break;
+		case 'x':
+		{
+			size_t id;
+			if (sscanf(optarg, "%zu", &id) != 1){
+				fprintf(stderr, "Invalid value for --cancel: '%s'\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			snprintf(options.daemon_request, sizeof(options.daemon_request), "cancel\t%zu", id);
+			break;
+		}
+		case 'P':
+		{
+			size_t id;
+			int priority;
+			char sep;
+			if (sscanf(optarg, "%zu%c%d", &id, &sep, &priority) != 3){
+				fprintf(stderr, "Invalid value for --set-priority: '%s', must be <ID>,<N>\n", optarg);
+				print_help(stderr, argc, argv);
+				exit(1);
+			}
+			snprintf(options.daemon_request, sizeof(options.daemon_request), "priority\t%zu\t%d", id, priority);
+			break;
+		}
 		case 's':
 		{
 			char sep;
@@ -207,6 +554,18 @@ void get_options(int argc, char* argv[]){
 			break;
 		}
 	}
+	options.option_argument_count = optind;
+	if (options.metrics_prometheus == -1){
+		const char* extension = (options.metrics_filepath != NULL) ? strrchr(options.metrics_filepath, '.') : NULL;
+		options.metrics_prometheus = (extension != NULL && strcmp(extension, ".prom") == 0);
+	}
+	if (options.daemon_status) snprintf(options.daemon_request, sizeof(options.daemon_request), "status");
+	if ((options.daemon || options.daemon_submit || options.daemon_request[0] != '\0') && options.daemon_socket == NULL){
+		fprintf(stderr, "--daemon, --submit, --status, --cancel and --set-priority need --daemon-socket\n");
+		exit(1);
+	}
+	// Talking to the daemon or being it doesn't take a video
+	if (options.daemon || options.daemon_request[0] != '\0') return;
 	if (argc - optind < 2){
 		fprintf(stderr, "Not enough arguments for input/output!\n");
 		print_help(stderr, argc, argv);
@@ -221,8 +580,248 @@ void get_options(int argc, char* argv[]){
 	}
 }
 
+// The worker script is installed next to the executable
+char* find_default_waifu2x_worker_file(){
+	char executable_path[PATH_MAX] = {'\0'};
+	if (readlink("/proc/self/exe", executable_path, PATH_MAX - 1) == -1){
+		fprintf(stderr, "Couldn't find the program location, use --waifu2x-worker\n");
+		exit(1);
+	}
+	const char* executable_dirname = dirname(executable_path);
+	const size_t total_length = strlen(executable_dirname) + 1 + strlen(WAIFU2X_WORKER_FILE) + 1;
+	char* worker_file = calloc(total_length, sizeof(char));
+	snprintf(worker_file, total_length, "%s/%s", executable_dirname, WAIFU2X_WORKER_FILE);
+	return worker_file;
+}
+
+// Runs the listed frames through one round of the backend, showing its progress
+// returns 1 if it failed
+int upscale_frames(upscaler_backend* backend, temp_frame* frames, const size_t* frame_indices, size_t frame_count, size_t round, progress_reactor* reactor){
+	if (backend->submit_batch(backend, reactor, frames, frame_indices, frame_count, round) != 0) return 1;
+	upscaler_progress progress = { .completed_frames = 0 };
+	int finished = 0;
+	while (!finished && stop_signalled == 0){
+		finished = backend->poll_completions(backend, reactor, &progress);
+		fprintf(stderr, "\rCurrent batch has converted %zu/%zu frames at %s/frame, currently encoded: %u",
+				progress.completed_frames, progress.total_frames, progress.rate, reactor->encoded_frames);
+	}
+	fprintf(stderr, "\n");
+	return backend->finish_batch(backend, reactor);
+}
+
+#define SEGMENTS_DIRECTORY_SUFFIX ".segments"
+// Runs a copy of this program on each keyframe aligned part of the input at once, then joins their results
+// returns the exit status for the program
+int upscale_segments_in_parallel(char* argv[]){
+	double split_points[MAX_PARALLEL_SEGMENTS];
+	const size_t segment_count = find_keyframe_split_points(options.input_filepath, options.segments, split_points) + 1;
+	char* directory = create_video_segment_directory(options.output_filepath, SEGMENTS_DIRECTORY_SUFFIX);
+	const char* extension = video_segment_extension(options.output_filepath);
+	fprintf(stderr, "Upscaling %zu segments in parallel\n", segment_count);
+
+	// The copies get our options with their part of the video added on the end
+	char time_range[64];
+	char max_memory[64];
+	char metrics_file[PATH_MAX + 64];
+	char segment_filename[PATH_MAX];
+	char** segment_command = calloc(options.option_argument_count + 8, sizeof(char*));
+	size_t argument_count = 0;
+	segment_command[argument_count++] = "/proc/self/exe";
+	int i;
+	for (i = 1; i < options.option_argument_count; i++){
+		if (strcmp(argv[i], "--") == 0) continue;
+		segment_command[argument_count++] = argv[i];
+	}
+	segment_command[argument_count++] = "--segments=1";
+	if (options.max_memory != 0){
+		// The copies share the budget, a later option overrides the one passed on
+		snprintf(max_memory, sizeof(max_memory), "--max-memory=%llu", (unsigned long long)(options.max_memory / segment_count));
+		segment_command[argument_count++] = max_memory;
+	}
+	// Each copy writes its own metrics, with the segment before the extension
+	const char* metrics_extension = "";
+	if (options.metrics_filepath != NULL){
+		const char* dot = strrchr(options.metrics_filepath, '.');
+		if (dot != NULL && strchr(dot, '/') == NULL) metrics_extension = dot;
+		segment_command[argument_count++] = metrics_file;
+	}
+	segment_command[argument_count++] = time_range;
+	segment_command[argument_count++] = "--";
+	segment_command[argument_count++] = options.input_filepath;
+	segment_command[argument_count++] = segment_filename;
+	segment_command[argument_count] = NULL;
+
+	struct sigaction sigint_action = {0};
+	sigemptyset(&sigint_action.sa_mask);
+	sigint_action.sa_flags = SA_RESTART;
+	sigint_action.sa_handler = stop_program_from_signal;
+	sigaction(SIGINT, &sigint_action, NULL);
+
+	pid_t segment_pids[MAX_PARALLEL_SEGMENTS];
+	size_t segment;
+	for (segment = 0; segment < segment_count; segment++){
+		const double start = (segment == 0) ? 0.0 : split_points[segment - 1];
+		if (segment == segment_count - 1){
+			snprintf(time_range, sizeof(time_range), "--time-range=%f", start);
+		}else{
+			snprintf(time_range, sizeof(time_range), "--time-range=%f,%f", start, split_points[segment]);
+		}
+		video_segment_filename(directory, segment, extension, segment_filename);
+		if (options.metrics_filepath != NULL){
+			snprintf(metrics_file, sizeof(metrics_file), "--metrics-file=%.*s.segment%zu%s",
+					 (int)(strlen(options.metrics_filepath) - strlen(metrics_extension)), options.metrics_filepath, segment, metrics_extension);
+		}
+		segment_pids[segment] = run_command(segment_command, NULL, NULL, NULL, NULL);
+		if (segment_pids[segment] != -1) atomic_store(&session_data.processes[segment], segment_pids[segment]);
+	}
+	free(segment_command);
+
+	int failed = 0;
+	for (segment = 0; segment < segment_count; segment++){
+		int exit_status = 0;
+		if (segment_pids[segment] == -1){
+			failed = 1;
+			continue;
+		}
+		while (waitpid(segment_pids[segment], &exit_status, 0) == -1 && errno == EINTR);
+		atomic_store(&session_data.processes[segment], 0);
+		if (!WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0){
+			fprintf(stderr, "Segment %zu failed\n", segment);
+			failed = 1;
+		}
+	}
+	errno = 0;
+	// Keep the finished segments around if something went wrong
+	if (!failed && !stop_signalled){
+		failed = concat_video_segments(directory, extension, segment_count, options.input_filepath, options.output_filepath);
+		if (!failed) remove_video_segment_directory(directory);
+	}
+	free(directory);
+	return (failed || stop_signalled) ? 1 : 0;
+}
+
+// Options meant for talking to the daemon rather than for the job itself
+// returns how many arguments the option takes up, 0 if it's not one of them
+int daemon_client_option_length(const char* argument){
+	const char* client_options[] = { "--daemon-socket", "--submit", "--priority" };
+	size_t i;
+	for (i = 0; i < sizeof(client_options) / sizeof(client_options[0]); i++){
+		const size_t length = strlen(client_options[i]);
+		if (strncmp(argument, client_options[i], length) != 0) continue;
+		if (argument[length] == '=' || strcmp(client_options[i], "--submit") == 0) return 1;
+		if (argument[length] == '\0') return 2;
+	}
+	return 0;
+}
+
+// Queues the input and output on the daemon with every option that isn't about the daemon
+int submit_to_daemon(int argc, char* argv[]){
+	char working_directory[PATH_MAX];
+	char input_filepath[PATH_MAX];
+	char output_filepath[PATH_MAX * 2];
+	if (getcwd(working_directory, sizeof(working_directory)) == NULL || realpath(options.input_filepath, input_filepath) == NULL){
+		fprintf(stderr, "Couldn't find %s: %s\n", options.input_filepath, strerror(errno));
+		return 1;
+	}
+	// The output doesn't exist yet
+	if (options.output_filepath[0] == '/'){
+		snprintf(output_filepath, sizeof(output_filepath), "%s", options.output_filepath);
+	}else{
+		snprintf(output_filepath, sizeof(output_filepath), "%s/%s", working_directory, options.output_filepath);
+	}
+
+	size_t request_length = 64 + strlen(working_directory) + strlen(input_filepath) + strlen(output_filepath);
+	int i;
+	for (i = 1; i < options.option_argument_count; i++) request_length += strlen(argv[i]) + 1;
+	char* request = calloc(request_length, sizeof(char));
+	int written = snprintf(request, request_length, "submit\t%d\t%s\t%s\t%s", options.priority, working_directory, input_filepath, output_filepath);
+	size_t field_count = 5;
+	for (i = 1; i < options.option_argument_count; i++){
+		const int length = daemon_client_option_length(argv[i]);
+		if (length > 0){
+			i += length - 1;
+			continue;
+		}
+		if (strcmp(argv[i], "--") == 0) continue;
+		written += snprintf(request + written, request_length - written, "\t%s", argv[i]);
+		field_count++;
+	}
+	// The request is one line of tab separated fields, so only the separators can be tabs
+	size_t tab_count = 0;
+	const char* c;
+	for (c = request; *c != '\0'; c++) tab_count += (*c == '\t');
+	if (strchr(request, '\n') != NULL || tab_count != field_count - 1){
+		fprintf(stderr, "Paths and options sent to the daemon can't have tabs or newlines in them\n");
+		free(request);
+		return 1;
+	}
+	const int failed = send_daemon_request(options.daemon_socket, request);
+	free(request);
+	return failed;
+}
+
 int main(int argc, char* argv[]){
 	get_options(argc, argv);
+	if (options.daemon_request[0] != '\0') return send_daemon_request(options.daemon_socket, options.daemon_request);
+	if (options.daemon_submit) return submit_to_daemon(argc, argv);
+	// The daemon's workers stay alive between frames
+	if (options.daemon_socket != NULL) options.persistent_upscaler = 1;
+	// waifu2x.lua reads its whole list up front, so only persistent workers can share a batch
+	if (options.upscaler_workers > 1) options.persistent_upscaler = 1;
+	// The cpu backend works on the decoded pixels, and so does finding what changed
+	if (options.backend == UPSCALER_BACKEND_CPU || options.dirty_tiles) options.raw_transport = 1;
+	// Only the worker can write PPMs back out
+	if (options.raw_transport && options.backend == UPSCALER_BACKEND_WAIFU2X) options.persistent_upscaler = 1;
+	if (options.cpu_threads == 0){
+		const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+		options.cpu_threads = (cpu_count < 1) ? 1 : (cpu_count > MAX_CPU_THREADS) ? MAX_CPU_THREADS : cpu_count;
+	}
+	if (options.duplicate_tolerance > 0 && !options.raw_transport){
+		fprintf(stderr, "--duplicate-tolerance compares pixels, so it needs --raw-transport\n");
+		exit(1);
+	}
+	if (options.dirty_tiles && options.backend == UPSCALER_BACKEND_CPU){
+		fprintf(stderr, "--dirty-tiles only works with the waifu2x backend\n");
+		exit(1);
+	}
+	if (options.resume && (options.segments > 1 || options.has_time_range)){
+		fprintf(stderr, "--resume can't be used with --segments or --time-range\n");
+		exit(1);
+	}
+	// Resumed jobs already encode in segments, one per batch
+	if (options.resume && options.result_encoders > 1){
+		fprintf(stderr, "--resume can't be used with --encoders\n");
+		exit(1);
+	}
+	if (options.segments > 1 && options.has_time_range){
+		fprintf(stderr, "--segments can't be used with --time-range\n");
+		exit(1);
+	}
+	// Resumed jobs are split at batch boundaries, so the batch size can't change
+	if (options.resume && options.auto_frame_count){
+		fprintf(stderr, "--resume needs a fixed --frame-count\n");
+		exit(1);
+	}
+	// With a daemon its workers are used, and it finds its own worker file
+	if ((options.daemon || (options.backend == UPSCALER_BACKEND_WAIFU2X && options.persistent_upscaler && options.daemon_socket == NULL))
+		&& options.waifu2x_worker_file == NULL){
+		options.waifu2x_worker_file = find_default_waifu2x_worker_file();
+	}
+	// One pool of workers per waifu2x mode, started before the pipeline threads exist, or kept by the daemon
+	char* waifu2x_noise_worker_command[] = { "th", options.waifu2x_worker_file,
+											 "-force_cudnn", "1",
+											 "-model_dir", options.waifu2x_model,
+											 "-m", "noise_scale", "-noise_level", "1",
+											 NULL };
+	char* waifu2x_scale_worker_command[] = { "th", options.waifu2x_worker_file,
+											 "-force_cudnn", "1",
+											 "-model_dir", options.waifu2x_model,
+											 "-m", "scale",
+											 NULL };
+	if (options.daemon){
+		return run_upscale_daemon(options.daemon_socket, waifu2x_noise_worker_command, waifu2x_scale_worker_command, options.waifu2x_folder,
+								  options.waifu2x_model, options.upscaler_workers, options.daemon_jobs);
+	}
 	
 	/* 
 	   Get the framerate of the video
@@ -248,36 +847,147 @@ int main(int argc, char* argv[]){
 		options.target_height = source_data.height * 2;
 	}
 
-	size_t upscale_rounds_from_width = (size_t)ceil(options.target_width * 0.5f / source_data.width);
-	size_t upscale_rounds_from_height = (size_t)ceil(options.target_height * 0.5f / source_data.height);
-	size_t upscale_rounds = (upscale_rounds_from_width > upscale_rounds_from_height) ? upscale_rounds_from_width : upscale_rounds_from_height;  
+	// The cpu backend goes straight to the target size, waifu2x takes the cheapest way the quality allows
+	scale_plan scale_plans[SCALE_PLAN_MAX_ROUNDS + 1];
+	size_t scale_plan_count;
+	const int cpu_backend = (options.backend == UPSCALER_BACKEND_CPU);
+	const size_t chosen_scale_plan = plan_scale(source_data.width, source_data.height, options.target_width, options.target_height, options.scale_quality,
+												cpu_backend ? 0 : 1, cpu_backend ? 0 : SCALE_PLAN_MAX_ROUNDS, scale_plans, &scale_plan_count);
+	const scale_plan plan = scale_plans[chosen_scale_plan];
+	size_t upscale_rounds = plan.rounds;
+	// Size of the frames coming out of the last round, each round doubles the size
+	const unsigned int upscaled_width = plan.upscaled_width;
+	const unsigned int upscaled_height = plan.upscaled_height;
+	// Raw frames are resampled to the target size here when the resampler can manage it, ffmpeg's scale filter does the rest
+	const int resample_in_process = options.raw_transport && scale_plan_resamples(&plan)
+		&& resampler_can_scale(options.cpu_filter, upscaled_width, options.target_width) && resampler_can_scale(options.cpu_filter, upscaled_height, options.target_height);
+	// The cpu backend has nothing else to go the whole way, and its kernel only stretches so far
+	if (cpu_backend && scale_plan_resamples(&plan) && !resample_in_process){
+		fprintf(stderr, "--backend=cpu can shrink frames at most %dx with %s, %ux%u is too small for %ux%u\n",
+				RESAMPLE_MAX_TAPS / 2 / resample_filter_radius(options.cpu_filter), resample_filter_names[options.cpu_filter],
+				options.target_width, options.target_height, upscaled_width, upscaled_height);
+		exit(1);
+	}
+	const unsigned int result_width = resample_in_process ? options.target_width : upscaled_width;
+	const unsigned int result_height = resample_in_process ? options.target_height : upscaled_height;
+	// Upscaled tiles are pasted straight into the last round's output
+	if (options.dirty_tiles && (scale_plan_shrinks_source(&plan) || scale_plan_resamples(&plan))){
+		fprintf(stderr, "--dirty-tiles needs a --target-size the rounds reach exactly, %ux%u doubled each round with nothing shrunk or resampled\n",
+				source_data.width, source_data.height);
+		exit(1);
+	}
+
+	// Every frame in flight ends up holding an upscaled frame, raw sources also hold a slot in the ring
+	// PNGs are assumed to be no bigger than the raw pixels
+	const uint64_t largest_frame_pixels = ((uint64_t)upscaled_width * upscaled_height > (uint64_t)result_width * result_height)
+		? (uint64_t)upscaled_width * upscaled_height : (uint64_t)result_width * result_height;
+	const uint64_t frame_memory = buffer_pool_block_size(largest_frame_pixels * 3 + INITIAL_FRAME_BUFFER_SIZE)
+		+ (options.raw_transport ? (uint64_t)plan.input_width * plan.input_height * 3 : 0);
+	if (options.max_memory != 0){
+		// The encoder also keeps a copy of the last frame it sent
+		const uint64_t frames_that_fit = options.max_memory / frame_memory;
+		const uint64_t frames_per_round_that_fit = (frames_that_fit > 1) ? (frames_that_fit - 1) / PIPELINE_BATCH_COUNT : 0;
+		if (frames_per_round_that_fit == 0){
+			fprintf(stderr, "--max-memory=%llu is too small, a %ux%u frame needs about %llu bytes and %d need to be in flight\n",
+					(unsigned long long)options.max_memory, result_width, result_height, (unsigned long long)frame_memory, PIPELINE_BATCH_COUNT + 1);
+			exit(1);
+		}
+		if (frames_per_round_that_fit < options.frames_per_upscale_round){
+			fprintf(stderr, "Lowering --frame-count from %zu to %llu to fit in --max-memory\n",
+					options.frames_per_upscale_round, (unsigned long long)frames_per_round_that_fit);
+			options.frames_per_upscale_round = frames_per_round_that_fit;
+		}
+		buffer_pool_set_budget(options.max_memory);
+	}
 
 	if (options.dry_run){
+		char backend_description[64];
+		if (options.backend == UPSCALER_BACKEND_CPU){
+			snprintf(backend_description, sizeof(backend_description), "cpu, %s on %zu threads", resample_filter_names[options.cpu_filter], options.cpu_threads);
+		}else{
+			snprintf(backend_description, sizeof(backend_description), "waifu2x");
+		}
+		// Nothing runs, so only the predictions can be shown, the actual cost is printed at the end of a real run
+		char scale_plan_descriptions[(SCALE_PLAN_MAX_ROUNDS + 1) * 160] = "";
+		size_t i, written = 0;
+		for (i = 0; i < scale_plan_count; i++){
+			char description[128];
+			describe_scale_plan(&scale_plans[i], description, sizeof(description));
+			written += snprintf(scale_plan_descriptions + written, sizeof(scale_plan_descriptions) - written, "\n %c %s: %.3f Mpx per frame",
+								(i == chosen_scale_plan) ? '*' : ' ', description, scale_plans[i].cost);
+		}
 		fprintf(stdout, "Dry Run:\n\
 Input: %s\n\
 Output: %s\n\n\
-Frames per upscale batch: %zu\n\
+Frames per upscale batch: %s%zu\n\
+Upscaler Backend: %s\n\
+Upscaler workers: %zu\n\
 Waifu2x folder: %s\n\
 Waifu2x file: %s\n\
 Waifu2x model: %s\n\
 Source Framerate: %f\n\
 Source Size: %ux%u\n\
 Target Size: %ux%u\n\
-Total Upscale Rounds: %zu\n",
+Total Upscale Rounds: %zu\n\
+Scale Quality: %s\n\
+Scale Plans:%s\n\
+Final Resample: %s\n\
+Persistent Upscaler: %s\n\
+Transport: %s\n\
+Skip Duplicates: %s (tolerance %d)\n\
+Dirty Tiles: %s\n\
+Check CRC: %s\n\
+Temp File I/O: %s\n\
+Cache: %s (%llu bytes)\n\
+Frame Memory: %llu bytes per frame, %llu bytes in flight (limit %llu)\n\
+Metrics: %s (%s every %us)\n\
+Resume: %s\n\
+Segments: %zu\n\
+Result Encoders: %zu\n\
+Time Range: %f to %f\n",
 				options.input_filepath,
 				options.output_filepath,
-				options.frames_per_upscale_round,
+				options.auto_frame_count ? "auto, up to " : "", options.frames_per_upscale_round,
+				backend_description,
+				options.upscaler_workers,
 				options.waifu2x_folder,
 				options.waifu2x_file,
 				options.waifu2x_model,
 				source_data.framerate,
 				source_data.width, source_data.height,
 				options.target_width, options.target_height,
-				upscale_rounds
+				upscale_rounds,
+				scale_quality_names[options.scale_quality],
+				scale_plan_descriptions,
+				!scale_plan_resamples(&plan) ? "none" : (resample_in_process || cpu_backend) ? resample_filter_names[options.cpu_filter] : "ffmpeg",
+				options.persistent_upscaler ? options.waifu2x_worker_file : "no",
+				options.raw_transport ? "rawvideo rgb24" : "png",
+				options.skip_duplicates ? "yes" : "no", options.duplicate_tolerance,
+				options.dirty_tiles ? "yes" : "no",
+				options.check_crc ? "yes" : "no",
+				options.no_io_uring ? "blocking" : "io_uring where available",
+				options.cache_directory ? options.cache_directory : "none", (unsigned long long)options.cache_size,
+				(unsigned long long)frame_memory, (unsigned long long)(frame_memory * (options.frames_per_upscale_round * PIPELINE_BATCH_COUNT + 1)),
+				(unsigned long long)options.max_memory,
+				options.metrics_filepath ? options.metrics_filepath : "none", options.metrics_prometheus ? "prometheus" : "json", options.metrics_interval,
+				options.resume ? "yes" : "no",
+				options.segments,
+				options.result_encoders,
+				options.time_range_start, options.time_range_end
 			);
 		exit(0);
 	}
 
+	if (options.segments > 1) return upscale_segments_in_parallel(argv);
+
+	resume_job job;
+	size_t start_frame = 0;
+	if (options.resume){
+		init_resume_job(&job, options.output_filepath, options.frames_per_upscale_round, options.target_width, options.target_height, source_data.framerate);
+		start_frame = resume_job_start_frame(&job);
+		if (start_frame > 0) fprintf(stderr, "Resuming from frame %zu\n", start_frame);
+	}
+
 	int dev_null_read = open("/dev/null", O_RDONLY);
 	int dev_null_write = open("/dev/null", O_WRONLY);
 	if (errno){
@@ -294,20 +1004,43 @@ Total Upscale Rounds: %zu\n",
 
 	// Use a filter to make sure ffmpeg outputs a frame for every (1/fps) second, uniformly
 	// Use the framerate of the original video
-	const char* ffmpeg_filter_command_format = "fps=%s";
+	// When resuming, drop the frames that were already committed so frame numbers stay the same
+	// ffmpeg also shrinks the frames if the scale plan wants them smaller
+	char ffmpeg_shrink_filter[64] = "";
+	if (scale_plan_shrinks_source(&plan)) snprintf(ffmpeg_shrink_filter, sizeof(ffmpeg_shrink_filter), ",scale=%u:%u", plan.input_width, plan.input_height);
+	const char* ffmpeg_filter_command_format = (start_frame > 0) ? "fps=%s%s,trim=start_frame=%zu,setpts=PTS-STARTPTS" : "fps=%s%s";
 	const size_t ffmpeg_filter_command_length =
 		strlen(ffmpeg_filter_command_format) +
-		strlen(source_data.framerate_str) + 1;
+		strlen(source_data.framerate_str) + strlen(ffmpeg_shrink_filter) + 20 + 1;
 	char* ffmpeg_filter_command = calloc(ffmpeg_filter_command_length, sizeof(char));
-	snprintf(ffmpeg_filter_command, ffmpeg_filter_command_length, ffmpeg_filter_command_format, source_data.framerate_str);
-	char* ffmpeg_source_command[] = { "ffmpeg", "-y",
-									  "-i", options.input_filepath,
-									  "-vf", ffmpeg_filter_command,
-									  "-hide_banner", "-loglevel", "panic", "-nostats", // Logging bits
-									  "-vcodec", "png", "-f", "image2pipe", "-",
-									  NULL };
+	snprintf(ffmpeg_filter_command, ffmpeg_filter_command_length, ffmpeg_filter_command_format, source_data.framerate_str, ffmpeg_shrink_filter, start_frame);
+	// Seeking on the input keeps the decoder from having to go through everything before the range
+	char time_range_start[32];
+	char time_range_duration[32];
+	char* ffmpeg_source_command_start[] = { "ffmpeg", "-y", "-ss", time_range_start, "-t", time_range_duration, NULL };
+	if (!options.has_time_range){
+		ffmpeg_source_command_start[2] = NULL;
+	}else{
+		snprintf(time_range_start, sizeof(time_range_start), "%f", options.time_range_start);
+		snprintf(time_range_duration, sizeof(time_range_duration), "%f", options.time_range_end - options.time_range_start);
+		if (options.time_range_end < 0.0) ffmpeg_source_command_start[4] = NULL;
+	}
+	char* ffmpeg_source_command_end[] = { "-i", options.input_filepath,
+										  "-vf", ffmpeg_filter_command,
+										  "-hide_banner", "-loglevel", "panic", "-nostats", // Logging bits
+										  "-vcodec", "png", "-f", "image2pipe", "-",
+										  NULL };
+	char* ffmpeg_source_raw_command_end[] = { "-i", options.input_filepath,
+											  "-vf", ffmpeg_filter_command,
+											  "-hide_banner", "-loglevel", "panic", "-nostats", // Logging bits
+											  "-f", "rawvideo", "-pix_fmt", "rgb24", "-",
+											  NULL };
+	char** ffmpeg_source_command = join_commands(ffmpeg_source_command_start, options.raw_transport ? ffmpeg_source_raw_command_end : ffmpeg_source_command_end);
 	pid_t ffmpeg_source_pid = run_command(ffmpeg_source_command, NULL, &ffmpeg_source_input_pipe, &ffmpeg_source_output_pipe, NULL);
+	// Nothing else is running yet, so it's fine to give up here
+	if (ffmpeg_source_pid == -1) exit(1);
 	atomic_store(&session_data.ffmpeg_src_process, ffmpeg_source_pid);
+	free(ffmpeg_source_command);
 	free(ffmpeg_filter_command);
 	
 	dup2(dev_null_read, ffmpeg_source_input_pipe.files.write_to); // Send /dev/null to the input so that it doesn't use the terminal
@@ -322,11 +1055,8 @@ Total Upscale Rounds: %zu\n",
 	}
 	
 	/*
-	  Set up the ffmpeg result daemon
+	  Set up the ffmpeg result daemons
 	*/
-	pipe_data ffmpeg_result_input_pipe = create_pipe_data();
-	//pipe_data ffmpeg_result_output_pipe = create_pipe_data();
-	pipe_data ffmpeg_result_progress_pipe = create_pipe_data();
 
 	char* ffmpeg_scale_filter_format = "scale=%u:%u";
 	const size_t ffmpeg_scale_filter_length = strlen(ffmpeg_scale_filter_format)
@@ -336,30 +1066,89 @@ Total Upscale Rounds: %zu\n",
 	char* ffmpeg_scale_filter = calloc(ffmpeg_scale_filter_length, sizeof(char));
 	snprintf(ffmpeg_scale_filter, ffmpeg_scale_filter_length, ffmpeg_scale_filter_format,
 			 options.target_width, options.target_height);
-	char* ffmpeg_result_command[] = { "ffmpeg", "-y",
-									  "-hide_banner", "-loglevel", "panic", "-progress", "/dev/stderr", "-nostats", // Logging bits
-									  "-i", options.input_filepath,
-									  "-r", source_data.framerate_str,
-									  "-vcodec", "png", "-f", "image2pipe", "-i", "-",
-									  "-max_muxing_queue_size", "9999", // Fixes a bug with ffmpeg
-									  "-map", "1:v:0", "-map", "0:a:0",
-									  "-vf", ffmpeg_scale_filter,
-									  options.output_filepath,
-									  NULL };
-	pid_t ffmpeg_result_pid = run_command(ffmpeg_result_command, NULL, &ffmpeg_result_input_pipe, NULL, &ffmpeg_result_progress_pipe);
-	atomic_store(&session_data.ffmpeg_rst_process, ffmpeg_result_pid);
+	char* ffmpeg_result_command_start[] = { "ffmpeg", "-y",
+											"-hide_banner", "-loglevel", "panic", "-progress", "/dev/stderr", "-nostats", // Logging bits
+											"-i", options.input_filepath,
+											"-r", source_data.framerate_str,
+											"-vcodec", "png", "-f", "image2pipe", "-i", "-",
+											"-max_muxing_queue_size", "9999", // Fixes a bug with ffmpeg
+											"-map", "1:v:0",
+											"-vf", ffmpeg_scale_filter,
+											NULL };
+	char ffmpeg_raw_size[32];
+	snprintf(ffmpeg_raw_size, sizeof(ffmpeg_raw_size), "%ux%u", result_width, result_height);
+	char* ffmpeg_result_raw_command_start[] = { "ffmpeg", "-y",
+												"-hide_banner", "-loglevel", "panic", "-progress", "/dev/stderr", "-nostats", // Logging bits
+												"-i", options.input_filepath,
+												"-r", source_data.framerate_str,
+												"-f", "rawvideo", "-pix_fmt", "rgb24", "-s", ffmpeg_raw_size, "-i", "-",
+												"-max_muxing_queue_size", "9999", // Fixes a bug with ffmpeg
+												"-map", "1:v:0",
+												"-vf", ffmpeg_scale_filter,
+												NULL };
+	char* ffmpeg_result_command_end[] = { "-map", "0:a:0", options.output_filepath, NULL };
+	// A time range is a part of a bigger job, the audio is added when the parts are joined
+	char* ffmpeg_result_video_only_command_end[] = { options.output_filepath, NULL };
+	// Resumable jobs get one video only segment per batch, cut on a forced keyframe, the audio is added when they're joined
+	char ffmpeg_keyframe_expression[64];
+	char ffmpeg_segment_time[32];
+	char ffmpeg_segment_time_delta[32];
+	char ffmpeg_segment_start_number[32];
+	char ffmpeg_segment_list[PATH_MAX];
+	char ffmpeg_segment_pattern[PATH_MAX];
+	char* ffmpeg_result_segment_command_end[] = { "-force_key_frames", ffmpeg_keyframe_expression,
+												  "-f", "segment", "-segment_time", ffmpeg_segment_time, "-segment_time_delta", ffmpeg_segment_time_delta,
+												  "-segment_start_number", ffmpeg_segment_start_number, "-reset_timestamps", "1",
+												  "-segment_list", ffmpeg_segment_list, "-segment_list_type", "csv",
+												  ffmpeg_segment_pattern,
+												  NULL };
+	// Several encoders each cut what they get into chunks on forced keyframes, the chunks are joined in order once they're all done
+	char* ffmpeg_result_encoder_command_end[] = { "-force_key_frames", ffmpeg_keyframe_expression,
+												  "-f", "segment", "-segment_time", ffmpeg_segment_time, "-segment_time_delta", ffmpeg_segment_time_delta,
+												  "-segment_start_number", "0", "-reset_timestamps", "1",
+												  ffmpeg_segment_pattern,
+												  NULL };
+	size_t encoder_chunk_frames = (size_t)lround(RESULT_ENCODER_CHUNK_SECONDS * source_data.framerate);
+	if (encoder_chunk_frames == 0) encoder_chunk_frames = 1;
+	char* encode_directory = NULL;
+	const char* encode_extension = video_segment_extension(options.output_filepath);
+	if (options.result_encoders > 1){
+		encode_directory = create_video_segment_directory(options.output_filepath, ENCODE_DIRECTORY_SUFFIX);
+		snprintf(ffmpeg_keyframe_expression, sizeof(ffmpeg_keyframe_expression), "expr:gte(n,n_forced*%zu)", encoder_chunk_frames);
+		snprintf(ffmpeg_segment_time, sizeof(ffmpeg_segment_time), "%f", encoder_chunk_frames / source_data.framerate);
+		snprintf(ffmpeg_segment_time_delta, sizeof(ffmpeg_segment_time_delta), "%f", 0.5f / source_data.framerate);
+	}else if (options.resume){
+		snprintf(ffmpeg_keyframe_expression, sizeof(ffmpeg_keyframe_expression), "expr:gte(n,n_forced*%zu)", options.frames_per_upscale_round);
+		snprintf(ffmpeg_segment_time, sizeof(ffmpeg_segment_time), "%f", options.frames_per_upscale_round / source_data.framerate);
+		snprintf(ffmpeg_segment_time_delta, sizeof(ffmpeg_segment_time_delta), "%f", 0.5f / source_data.framerate);
+		snprintf(ffmpeg_segment_start_number, sizeof(ffmpeg_segment_start_number), "%zu", job.committed_segments);
+		resume_job_filename(&job, RESUME_SEGMENT_LIST_FILE, ffmpeg_segment_list);
+		snprintf(ffmpeg_segment_pattern, PATH_MAX, "%s/" VIDEO_SEGMENT_PREFIX "%%05d%s", job.directory, job.segment_extension);
+	}
+	char** ffmpeg_result_command = join_commands(options.raw_transport ? ffmpeg_result_raw_command_start : ffmpeg_result_command_start,
+												 (options.result_encoders > 1) ? ffmpeg_result_encoder_command_end
+												 : options.resume ? ffmpeg_result_segment_command_end
+												 : options.has_time_range ? ffmpeg_result_video_only_command_end : ffmpeg_result_command_end);
+
+	// ffmpeg's progress is read by the event loop, which needs to be set up before any threads start
+	progress_reactor reactor;
+	init_progress_reactor(&reactor);
+	pipe_data ffmpeg_result_input_pipes[MAX_RESULT_ENCODERS];
+	FILE* ffmpeg_result_inputs[MAX_RESULT_ENCODERS];
+	size_t encoder;
+	for (encoder = 0; encoder < options.result_encoders; encoder++){
+		ffmpeg_result_input_pipes[encoder] = create_pipe_data();
+		pipe_data ffmpeg_result_progress_pipe = create_pipe_data();
+		if (encode_directory != NULL) video_encoder_segment_pattern(encode_directory, encoder, encode_extension, ffmpeg_segment_pattern);
+		pid_t ffmpeg_result_pid = run_command(ffmpeg_result_command, NULL, &ffmpeg_result_input_pipes[encoder], NULL, &ffmpeg_result_progress_pipe);
+		if (ffmpeg_result_pid == -1) exit(1);
+		atomic_store(&session_data.ffmpeg_rst_processes[encoder], ffmpeg_result_pid);
+		ffmpeg_result_inputs[encoder] = fdopen(ffmpeg_result_input_pipes[encoder].files.write_to, "w"); // Open the input as a pipe so we can put images in it
+		progress_reactor_watch_encoder(&reactor, ffmpeg_result_progress_pipe.files.read_from, ffmpeg_result_pid);
+	}
+	free(ffmpeg_result_command);
 	free(ffmpeg_scale_filter);
 	
-	FILE *ffmpeg_result_input = fdopen(ffmpeg_result_input_pipe.files.write_to, "w"); // Open the input as a pipe so we can put images in it
-	//pipe_data_close_read_from(&ffmpeg_result_input_pipe); // We shouldn't be able to read from the input
-	//pipe_data_close_write_to(&ffmpeg_result_output_pipe); // We shouldn't be able to write to the output
-	//dup2(dev_null_write, ffmpeg_result_output_pipe.files.read_from); // Send the output to /dev/null because we don't care about it
-
-	char* ffmpeg_grep_filter_command[] = { "sed", "-n", "-r", "s/frame=([0-9]+)/\\1/p", "-", NULL};
-	pipe_data ffmpeg_result_framecount_pipe = create_pipe_data();
-	pid_t ffmpeg_result_progress_pid = run_command(ffmpeg_grep_filter_command, NULL, &ffmpeg_result_progress_pipe, &ffmpeg_result_framecount_pipe, NULL);
-	FILE* ffmpeg_result_framecount_file = fdopen(ffmpeg_result_framecount_pipe.files.read_from, "r");
-	
 	if (errno){
 		fprintf(stderr, "post ffmpeg res err: %s\n", strerror(errno));
 		errno = 0;
@@ -367,7 +1156,9 @@ Total Upscale Rounds: %zu\n",
 	
 	// Set upu the interrupt handles
 	
-	struct sigaction sigint_action;
+	struct sigaction sigint_action = {0};
+	sigemptyset(&sigint_action.sa_mask);
+	sigint_action.sa_flags = SA_RESTART;
 	sigint_action.sa_handler = stop_program_from_signal;
 	sigaction(SIGINT, &sigint_action, NULL);
 	sigaction(SIGPIPE, &sigint_action, NULL);
@@ -377,13 +1168,23 @@ Total Upscale Rounds: %zu\n",
 	// Set up the temp files AFTER the interrupt handler is set
 	// If someone Ctrl-C's before this, we'll die right away
 	// If someone Ctrl-C's after this, we'll get rid of the tempfiles properly
-	session_data.temp_frame_count = options.frames_per_upscale_round;
+	// Slots get their temp files and buffers as frames are decoded into them
+	batch_sizer sizer;
+	init_batch_sizer(&sizer, options.frames_per_upscale_round);
+	const size_t starting_frames_per_batch = options.auto_frame_count ? sizer.size : options.frames_per_upscale_round;
+	session_data.temp_frame_count = options.frames_per_upscale_round * PIPELINE_BATCH_COUNT;
 	session_data.temp_frames = calloc(session_data.temp_frame_count, sizeof(temp_frame));
-	{
-		int i;
-		for (i = 0; i < session_data.temp_frame_count; i++) session_data.temp_frames[i] = create_temp_frame();
-	}
+	init_temp_frame_store(&session_data.frame_store, session_data.temp_frame_count, options.raw_transport ? ".ppm" : ".png");
 	atexit(cleanup);
+
+	// rawvideo frames go straight into fixed size slots, one for every temp frame
+	frame_ring source_ring = { .slots = NULL };
+	png_framer source_framer = { .carry = { .pointer = NULL } };
+	if (options.raw_transport){
+		init_frame_ring(&source_ring, (size_t)plan.input_width * plan.input_height * 3, session_data.temp_frame_count);
+	}else{
+		init_png_framer(&source_framer, fileno(ffmpeg_source_output), options.check_crc);
+	}
 	
     // waifu2x doesn't like using stdout
 	char* waifu2x_noise_command[] = { "th", options.waifu2x_file,
@@ -391,188 +1192,249 @@ Total Upscale Rounds: %zu\n",
 									  "-model_dir", options.waifu2x_model,
 									  "-m", "noise_scale", "-noise_level", "1",
 									  "-l", "/dev/stdin",
-									  "-o", session_data.temp_frames[0].generic_output_filename, // TODO: Only do one calculation for generic_output_filename
+									  "-o", session_data.frame_store.generic_output_filename,
 									  NULL };
 	char* waifu2x_scale_only_command[] = { "th", options.waifu2x_file,
 										   "-force_cudnn", "1",
 										   "-model_dir", options.waifu2x_model,
 										   "-m", "scale",
 										   "-l", "/dev/stdin",
-										   "-o", session_data.temp_frames[0].generic_output_filename, // TODO: Only do one calculation for generic_output_filename
+										   "-o", session_data.frame_store.generic_output_filename,
 										   NULL };
-	char* waifu2x_result_process_command[] = { "stdbuf", "-oL", "bash", "-c",
-											   // These don't have commas, they will be concatanated
-											   "sed -u \""
-											   "s/[^[:print:]\\n]//g;"
-											   "s/.*Step: //g"
-											   "\"",
-											   NULL	};
+	// Only the final result is cached, a hit skips every round
+	// Frames resampled here are cached at the target size, which the format records
+	char cache_format[64];
+	snprintf(cache_format, sizeof(cache_format), "%s", options.raw_transport ? ".ppm" : ".png");
+	if (resample_in_process || cpu_backend)
+		snprintf(cache_format, sizeof(cache_format), ".ppm@%s:%ux%u", resample_filter_names[options.cpu_filter], result_width, result_height);
+	upscaler_backend backend;
+	upscaler_backend final_resample = { .state = NULL };
+	if (cpu_backend){
+		// The whole way in one go
+		backend = create_cpu_backend(options.cpu_filter, options.cpu_threads, plan.input_width, plan.input_height, result_width, result_height, 0,
+									 upscale_cache_settings_hash(resample_filter_names[options.cpu_filter], "cpu", 0, upscale_rounds, cache_format), &stop_signalled);
+	}else{
+		backend = create_waifu2x_backend(waifu2x_noise_command, waifu2x_scale_only_command, waifu2x_noise_worker_command, waifu2x_scale_worker_command,
+										 options.waifu2x_folder, options.persistent_upscaler, options.daemon_socket, options.upscaler_workers, options.frames_per_upscale_round, upscale_rounds,
+										 options.raw_transport, plan.input_width, plan.input_height,
+										 !options.no_io_uring, source_ring.slots, source_ring.mapping_size,
+										 upscale_cache_settings_hash(options.waifu2x_model, (upscale_rounds == 1) ? "noise_scale" : "scale", 1, upscale_rounds - 1, cache_format),
+										 session_data.waifu2x_processes, &stop_signalled);
+		if (resample_in_process){
+			final_resample = create_cpu_backend(options.cpu_filter, options.cpu_threads, upscaled_width, upscaled_height, result_width, result_height, 1,
+												backend.settings_hash, &stop_signalled);
+		}
+	}
+	// What the plan actually cost, to compare with its prediction at the end
+	size_t planned_frames = 0;
+	double planned_seconds = 0.0;
+	int exit_status = 0;
+
 	if (errno){
 		fprintf(stderr, "prelooperr: %s\n", strerror(errno));
 		errno = 0;
 	}
-	int current_frame = 0;
-	size_t last_output_frame_size = 0;
+	batch_pipeline pipeline;
+	init_batch_pipeline(&pipeline, session_data.temp_frames, &session_data.frame_store, options.frames_per_upscale_round, ffmpeg_source_output,
+						ffmpeg_result_inputs, options.result_encoders, encoder_chunk_frames, options.raw_transport ? &source_ring : NULL, options.raw_transport ? NULL : &source_framer, &stop_signalled);
+	pipeline.skip_duplicates = options.skip_duplicates;
+	pipeline.duplicate_tolerance = options.duplicate_tolerance;
+	pipeline.dirty_tiles = options.dirty_tiles;
+	pipeline.source_width = plan.input_width;
+	pipeline.source_height = plan.input_height;
+	pipeline.hash_frames = options.cache_directory != NULL;
+	atomic_store(&pipeline.frames_per_batch, starting_frames_per_batch);
+	if (options.metrics_filepath != NULL) start_metrics_writer(options.metrics_filepath, options.metrics_prometheus, options.metrics_interval);
+	batch_pipeline_start(&pipeline);
+
+	upscale_cache cache = { .entries = NULL };
+	if (options.cache_directory != NULL) init_upscale_cache(&cache, options.cache_directory, options.cache_size);
+
+	size_t* frames_to_upscale = calloc(options.frames_per_upscale_round, sizeof(size_t));
+	// Frames this round that weren't found in the cache
+	size_t* frames_missing_cache = calloc(options.frames_per_upscale_round, sizeof(size_t));
+	// Where partial frames are put together, swapped with their buffers
+	expandable_buffer composite_scratch = create_expandable_buffer(INITIAL_FRAME_BUFFER_SIZE);
+
 	while(stop_signalled == 0){
 		int frame_input_index;
 		int frame_output_index;
 
-		for (frame_input_index = 0;
-			 frame_input_index < session_data.temp_frame_count;
-			 frame_input_index++){
-			temp_frame* frame = &session_data.temp_frames[frame_input_index];
-			// Read the PNG from ffmpeg
-			if (expandable_buffer_read_png_in(&frame->buffer, ffmpeg_source_output) != 0){
-				break;
-			}
-		}
-		// This will only trigger if the ffmpeg input connection has been closed and all files have been read
-		if (frame_input_index == 0){
-			fprintf(stderr, "No more data from ffmpeg, stopping...\n");
-			break;
-		}
+		frame_batch* batch = batch_queue_pop(&pipeline.decoded_batches);
+		if (batch == NULL) break;
+		const double upscale_start_time = monotonic_seconds();
 		if (errno){
 			fprintf(stderr, "err: %s\n", strerror(errno));
 			errno = 0;
 		}
-		int total_frames_this_round = frame_input_index;
+		temp_frame* batch_frames = batch->frames;
+		int total_frames_this_round = batch->frame_count;
+
+		// Repeated frames are left out, the encoder sends the frame they repeat instead
+		size_t total_frames_to_upscale = 0;
+		for (frame_input_index = 0; frame_input_index < total_frames_this_round; frame_input_index++){
+			if (!batch_frames[frame_input_index].repeats_previous)
+				frames_to_upscale[total_frames_to_upscale++] = frame_input_index;
+		}
 		
-		size_t upscale_round;
-		for (upscale_round = 0; upscale_round < upscale_rounds; upscale_round++){
-			for (frame_input_index = 0; frame_input_index < total_frames_this_round; frame_input_index++){
-				temp_frame* frame = &session_data.temp_frames[frame_input_index];
-                // Write the buffers' data out
-				FILE* output_file = fopen(frame->file->absolute_filename, "wb");
-				expandable_buffer_write_to_file(&frame->buffer, output_file);
-				fflush(output_file);
-				fclose(output_file);
-			}
-			
-			// Wait for waifu2x
-			pipe_data waifu2x_input_pipe = create_pipe_data();
-			FILE* waifu2x_input_file = fdopen(waifu2x_input_pipe.files.write_to, "wb");
-			for (frame_output_index = 0; frame_output_index < total_frames_this_round; frame_output_index++){
-				temp_frame* frame = &session_data.temp_frames[frame_output_index];
-				
-				char* str = frame->file->absolute_filename;
-				fwrite(str, sizeof(*str), strlen(str), waifu2x_input_file);
-				fputc('\n', waifu2x_input_file);	
-			}
-			fflush(waifu2x_input_file);
-			fclose(waifu2x_input_file);	
-			if (errno){
-				fprintf(stderr, "prewaif err: %s\n", strerror(errno));
-				exit(errno);
-				errno = 0;
+		size_t total_frames_missing_cache = 0;
+		for (frame_input_index = 0; frame_input_index < total_frames_to_upscale; frame_input_index++){
+			temp_frame* frame = &batch_frames[frames_to_upscale[frame_input_index]];
+			if (options.cache_directory == NULL || upscale_cache_read(&cache, frame->content_hash, frame->content_size, backend.settings_hash, &frame->buffer) != 0){
+				frames_missing_cache[total_frames_missing_cache++] = frames_to_upscale[frame_input_index];
+			}else{
+				// The whole frame was found, so there's nothing to paste
+				frame->partial = 0;
+				metrics_count(METRIC_CACHE_HITS, 1);
 			}
+		}
 
-			pipe_data waifu2x_progress_pipe = create_pipe_data();
-			pipe_data waifu2x_crbuffered_progress_pipe = create_pipe_data();
-			pipe_data waifu2x_formatted_progress_pipe = create_pipe_data();
-
-			char** waifu2x_command = (upscale_round == 0) ? waifu2x_noise_command : waifu2x_scale_only_command;
-			pid_t waifu2x_pid = run_command(waifu2x_command, options.waifu2x_folder, &waifu2x_input_pipe, &waifu2x_progress_pipe, NULL);
-			atomic_store(&session_data.waifu2x_process, waifu2x_pid);
-			//pipe_data_close_read_from(&waifu2x_input_pipe);
-
-			pid_t waifu2x_carriage_return_pid = fork_to_function(&fix_carriage_return_passthrough, NULL, NULL, &waifu2x_progress_pipe, &waifu2x_crbuffered_progress_pipe, NULL);
-			pid_t waifu2x_process_result_pid = run_command(waifu2x_result_process_command, NULL, &waifu2x_crbuffered_progress_pipe, &waifu2x_formatted_progress_pipe, NULL);
-			
-			// If this is Ctrl-C'd, this program closes because of a bad pipe
-			// Soln. handle SIGPIPE like SIGINT etc.
-			//waitid(P_PID, waifu2x_pid, NULL, WSTOPPED|WEXITED);
-			char* output_line = NULL;
-			size_t line_length = 100;
-			FILE* waifu2x_formatted_progress_file = fdopen(waifu2x_formatted_progress_pipe.files.read_from, "r");
-
-			char w2_step_string[100] = { '\0' };
-			unsigned int w2_upscaled_file_count = 0;
-			unsigned int w2_total_file_count = 0;
-			static unsigned int encoded_frame_count = 0;
-			unsigned int w2_ended = 0;
-			while(1){
-				int poll_positive = 1;
-				while (poll_positive && !w2_ended){
-					int poll_result = poll(&(struct pollfd){ .fd = waifu2x_formatted_progress_pipe.files.read_from, .events = POLLIN }, 1, 0);
-					switch(poll_result){
-					case 1:
-						if (getline(&output_line, &line_length, waifu2x_formatted_progress_file) != -1){
-							sscanf(output_line, "%s %u/%u", w2_step_string, &w2_upscaled_file_count, &w2_total_file_count);
-						}else{
-							w2_ended = 1;
-						}
-						break;
-					case -1:
-						w2_ended = 1;
-						break;
-					default:
-						poll_positive = 0;
-					}
-				}
-				while (poll(&(struct pollfd){ .fd = ffmpeg_result_framecount_pipe.files.read_from, .events = POLLIN }, 1, 0)==1){
-					if (getline(&output_line, &line_length, ffmpeg_result_framecount_file) != -1){
-						sscanf(output_line, "%u", &encoded_frame_count);
-					}
+		size_t upscale_round;
+		for (upscale_round = 0; upscale_round < backend.rounds && total_frames_missing_cache > 0; upscale_round++){
+			const double round_start_time = monotonic_seconds();
+			if (upscale_frames(&backend, batch_frames, frames_missing_cache, total_frames_missing_cache, upscale_round, &reactor) != 0){
+				// Workers die when we're interrupted, only complain if they failed by themselves
+				if (stop_signalled == 0){
+					fprintf(stderr, "Upscaling failed, stopping...\n");
+					stop_program_from_signal(SIGTERM);
+					exit_status = 1;
 				}
-
-				fprintf(stderr, "\rCurrent batch has converted %u/%u frames at %s/frame, currently encoded: %u", w2_upscaled_file_count, w2_total_file_count, w2_step_string, encoded_frame_count);
-				if (w2_upscaled_file_count == w2_total_file_count && w2_total_file_count != 0) break;
-				if (stop_signalled != 0) break;
-				if (w2_ended != 0) break;
+				break;
 			}
-			fprintf(stderr, "\n");
-			
-			kill(waifu2x_carriage_return_pid, SIGKILL);
-			kill(waifu2x_process_result_pid, SIGKILL);
-			//pipe_data_close(&waifu2x_process.input_pipe);
-			//fprintf(stderr, "Done waiting\n");
-			if (errno){
-				fprintf(stderr, "postwaif err: %s\n", strerror(errno));
-				exit(errno);
+			const double round_seconds = monotonic_seconds() - round_start_time;
+			metrics_count(METRIC_UPSCALE_ROUNDS, 1);
+			metrics_observe(HISTOGRAM_UPSCALER_ROUND, round_seconds);
+			metrics_observe(HISTOGRAM_UPSCALER_ROUND_PER_FRAME, round_seconds / total_frames_missing_cache);
+			if (upscale_round == backend.rounds - 1 && stop_signalled == 0) metrics_count(METRIC_FRAMES_UPSCALED, total_frames_missing_cache);
+			planned_seconds += round_seconds;
+		}
+		// The rest of the way to the target size
+		if (final_resample.state != NULL && total_frames_missing_cache > 0 && stop_signalled == 0 && exit_status == 0){
+			const double resample_start_time = monotonic_seconds();
+			if (upscale_frames(&final_resample, batch_frames, frames_missing_cache, total_frames_missing_cache, 0, &reactor) != 0 && stop_signalled == 0){
+				fprintf(stderr, "Resampling failed, stopping...\n");
+				stop_program_from_signal(SIGTERM);
+				exit_status = 1;
 			}
-		
-			for (frame_output_index = 0; frame_output_index < total_frames_this_round; frame_output_index++){
-				if (stop_signalled != 0) break;
-				
-				temp_frame* frame = &session_data.temp_frames[frame_output_index];
-				FILE* output_file = fopen(frame->output_filename, "rb");
-				if (output_file == NULL || expandable_buffer_read_png_in(&frame->buffer, output_file) != 0){
-					fprintf(stderr, "err: %s\n", strerror(errno));
-					fprintf(stderr, "Error reading PNG from %s...\n", frame->output_filename);
-					exit(errno || 1);
-				}
-				fclose(output_file);
+			planned_seconds += monotonic_seconds() - resample_start_time;
+		}
+		// Each partial frame goes over the one before it, which is already whole by then
+		for (frame_output_index = 0; frame_output_index < total_frames_to_upscale && options.dirty_tiles; frame_output_index++){
+			if (stop_signalled != 0 || exit_status != 0) break;
+			temp_frame* frame = &batch_frames[frames_to_upscale[frame_output_index]];
+			if (!frame->partial) continue;
+			const expandable_buffer* reference = &batch_frames[frames_to_upscale[frame_output_index - 1]].buffer;
+			if (composite_dirty_tiles(frame, reference, &composite_scratch, result_width, result_height, 1 << upscale_rounds) != 0){
+				fprintf(stderr, "%s isn't the %ux%u crop it should be\n", frame->output_filename, frame->crop.width << upscale_rounds, frame->crop.height << upscale_rounds);
+				stop_program_from_signal(SIGTERM);
+				exit_status = 1;
+				break;
 			}
-			if (errno){
-				fprintf(stderr, "postout err: %s\n", strerror(errno));
-				exit(errno);
+		}
+		if (stop_signalled == 0 && exit_status == 0) planned_frames += total_frames_missing_cache;
+		for (frame_output_index = 0; frame_output_index < total_frames_missing_cache && options.cache_directory != NULL; frame_output_index++){
+			if (stop_signalled != 0 || exit_status != 0) break;
+			temp_frame* frame = &batch_frames[frames_missing_cache[frame_output_index]];
+			// Pasted together from more than one frame, so not what upscaling this one would give
+			if (frame->partial) continue;
+			upscale_cache_write(&cache, frame->content_hash, frame->content_size, backend.settings_hash, &frame->buffer);
+		}
+
+		// Only the pixels after the last round's PPM header go to ffmpeg
+		if (options.raw_transport && stop_signalled == 0 && exit_status == 0){
+			for (frame_output_index = 0; frame_output_index < total_frames_to_upscale; frame_output_index++){
+				temp_frame* frame = &batch_frames[frames_to_upscale[frame_output_index]];
+				frame->result_offset = ppm_pixel_offset(&frame->buffer, result_width, result_height);
+				if (frame->result_offset == 0){
+					fprintf(stderr, "%s isn't a %ux%u PPM\n", frame->output_filename, result_width, result_height);
+					stop_program_from_signal(SIGTERM);
+					exit_status = 1;
+					break;
+				}
 			}
 		}
+		// The stop below closes the pipeline, so the threads are joined before anything is freed
+		if (exit_status != 0) break;
 
-		for (frame_output_index = 0; frame_output_index < total_frames_this_round; frame_output_index++){
-			if (stop_signalled != 0) break;
-				
-			temp_frame* frame = &session_data.temp_frames[frame_output_index];
-			expandable_buffer_write_to_pipe(&frame->buffer, ffmpeg_result_input);
+		if (options.auto_frame_count){
+			const double upscale_seconds = monotonic_seconds() - upscale_start_time;
+			if (batch_sizer_update(&sizer, batch->frame_count, upscale_seconds, batch->decode_seconds_per_frame, batch->encode_seconds_per_frame)){
+				fprintf(stderr, "\nBatch size is now %zu frames (upscaling %.1fms/frame, decoding %.1fms/frame, encoding %.1fms/frame)\n", sizer.size,
+						upscale_seconds * 1000 / batch->frame_count, batch->decode_seconds_per_frame * 1000, batch->encode_seconds_per_frame * 1000);
+				atomic_store(&pipeline.frames_per_batch, sizer.size);
+			}
 		}
-		fflush(ffmpeg_result_input);
+
+		// Hand the batch to the encoder thread and start on the next one
+		if (batch_queue_push(&pipeline.upscaled_batches, batch) != 0) break;
 		
 		if (stop_signalled != 0) fprintf(stderr, "got sigint\n");
 	}
 
-	if (stop_signalled) exit(0);
+	// Let the encoder drain whatever has already been upscaled
+	batch_queue_close(&pipeline.upscaled_batches);
+	if (stop_signalled) batch_pipeline_close(&pipeline);
+	batch_pipeline_join(&pipeline);
+	stop_metrics_writer();
+	if (options.skip_duplicates){
+		fprintf(stderr, "Skipped upscaling %zu repeated frames\n", pipeline.duplicate_frames);
+	}
+	if (options.dirty_tiles && pipeline.partial_frames > 0){
+		fprintf(stderr, "Upscaled only the changed tiles of %zu frames, %.1f%% of their pixels\n", pipeline.partial_frames,
+				100.0 * pipeline.partial_pixels / ((double)pipeline.partial_frames * plan.input_width * plan.input_height));
+	}
+	if (source_framer.broken && !stop_signalled){
+		fprintf(stderr, "Stopped at a broken frame from ffmpeg, the output is incomplete\n");
+		exit_status = 1;
+	}
+	fprintf(stderr, "Peak frame buffer memory: %llu bytes\n", (unsigned long long)buffer_pool_peak_in_use());
+	if (planned_frames > 0){
+		fprintf(stderr, "Scale plan: predicted %.3f Mpx per frame, took %.1fms per frame (%.1fms per predicted Mpx)\n",
+				plan.cost, planned_seconds * 1000 / planned_frames, plan.cost > 0.0 ? planned_seconds * 1000 / planned_frames / plan.cost : 0.0);
+	}
+	const size_t encoded_frames = pipeline.encoded_frames;
+	free_batch_pipeline(&pipeline);
+	free_frame_ring(&source_ring);
+	free_png_framer(&source_framer);
+	free(frames_to_upscale);
+	free(frames_missing_cache);
+	free_expandable_buffer(&composite_scratch);
+	if (options.cache_directory != NULL){
+		upscale_cache_save(&cache);
+		fprintf(stderr, "Upscale cache: %zu hits, %zu misses\n", cache.hits, cache.misses);
+		free_upscale_cache(&cache);
+	}
 
-	
-	kill(ffmpeg_result_progress_pid, SIGKILL);
-	
-	// Wait for the FFMpeg result process to finish
-	fflush(ffmpeg_result_input);
-    fclose(ffmpeg_result_input);
-	if (waitid(P_PID, ffmpeg_result_pid, NULL, WSTOPPED|WEXITED) != 0){
-		fprintf(stderr, "Error waiting for PID %d %s\n", ffmpeg_result_pid, strerror(errno));
+	if (stop_signalled) exit(exit_status);
+
+	free_upscaler_backend(&backend);
+	free_upscaler_backend(&final_resample);
+
+	// Wait for the FFMpeg result processes to finish, their progress has to keep being read or they could block on it
+	for (encoder = 0; encoder < options.result_encoders; encoder++){
+		fflush(ffmpeg_result_inputs[encoder]);
+		fclose(ffmpeg_result_inputs[encoder]);
+	}
+	const int encoder_status = progress_reactor_wait_for_encoders(&reactor);
+	for (encoder = 0; encoder < options.result_encoders; encoder++){
+		atomic_store(&session_data.ffmpeg_rst_processes[encoder], 0);
+		pipe_data_close(&ffmpeg_result_input_pipes[encoder]);
+	}
+	free_progress_reactor(&reactor);
+
+	if (encode_directory != NULL){
+		const size_t chunk_count = (encoded_frames + encoder_chunk_frames - 1) / encoder_chunk_frames;
+		if (encoder_status != 0){
+			fprintf(stderr, "A result encoder failed, its chunks are left in %s\n", encode_directory);
+			exit_status = 1;
+		}else if (concat_encoder_segments(encode_directory, encode_extension, options.result_encoders, chunk_count,
+										  options.has_time_range ? NULL : options.input_filepath, options.output_filepath) != 0){
+			exit_status = 1;
+		}else{
+			remove_video_segment_directory(encode_directory);
+		}
+		free(encode_directory);
 	}
-	pipe_data_close(&ffmpeg_result_input_pipe);
-	//pipe_data_close(&ffmpeg_result_output_pipe);
 
 	/*
 	  Close FFMpeg source process
@@ -586,5 +1448,11 @@ Total Upscale Rounds: %zu\n",
 	pipe_data_close(&ffmpeg_source_input_pipe);
 	pipe_data_close(&ffmpeg_source_output_pipe);
 
+	if (options.resume){
+		if (finish_resume_job(&job, options.input_filepath, options.output_filepath) != 0) exit_status = 1;
+		free_resume_job(&job);
+	}
+
 	cleanup();
+	return exit_status;
 }
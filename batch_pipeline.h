@@ -0,0 +1,513 @@
+#include <pthread.h>
+
+// Amount of temp frame sets in flight at once:
+// one being decoded, one being upscaled, one being encoded
+#define PIPELINE_BATCH_COUNT 3
+#define MAX_RESULT_ENCODERS 16
+
+typedef struct {
+	temp_frame* frames;
+	size_t frame_capacity;
+	size_t frames_provisioned; // Frames past this have no temp files or buffers yet
+	size_t first_slot; // Of the temp frame store
+	size_t frame_count;
+	size_t batch_index;
+	size_t first_frame; // Where the batch starts in the output
+
+	// Set by the encoder thread, the frame before the batch when it starts on a repeated frame
+	expandable_buffer carried_frame;
+	// Under the pipeline's release_mutex
+	int encoding;
+	size_t encoders_left; // Result encoders still writing the batch
+	double encode_start_time; // When the first of them started on it
+
+	// Time per frame of the last trip through the decoder and encoder, not counting time spent waiting for a batch
+	double decode_seconds_per_frame;
+	double encode_seconds_per_frame;
+} frame_batch;
+
+double monotonic_seconds(){
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Bounded FIFO used to hand batches between the pipeline stages
+typedef struct {
+	frame_batch** items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} batch_queue;
+
+void init_batch_queue(batch_queue* queue, size_t capacity){
+	queue->items = calloc(capacity, sizeof(frame_batch*));
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->closed = 0;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+}
+void free_batch_queue(batch_queue* queue){
+	free(queue->items);
+	queue->items = NULL;
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+// Blocks until there is space in the queue
+// returns 1 if the queue was closed and the batch wasn't added
+int batch_queue_push(batch_queue* queue, frame_batch* batch){
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == queue->capacity && !queue->closed)
+		pthread_cond_wait(&queue->not_full, &queue->mutex);
+	if (queue->closed){
+		pthread_mutex_unlock(&queue->mutex);
+		return 1;
+	}
+	queue->items[(queue->head + queue->count) % queue->capacity] = batch;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
+	return 0;
+}
+
+// Blocks until a batch is available
+// returns NULL once the queue has been closed and emptied
+frame_batch* batch_queue_pop(batch_queue* queue){
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == 0 && !queue->closed)
+		pthread_cond_wait(&queue->not_empty, &queue->mutex);
+	frame_batch* batch = NULL;
+	if (queue->count > 0){
+		batch = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	return batch;
+}
+
+// Wakes up everything waiting on the queue,
+// batches already in the queue can still be popped
+void batch_queue_close(batch_queue* queue){
+	pthread_mutex_lock(&queue->mutex);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+struct batch_pipeline;
+// A result ffmpeg's input, and the thread writing the frames that are its to it
+typedef struct {
+	struct batch_pipeline* pipeline;
+	size_t index;
+	FILE* input;
+	batch_queue batches;
+	pthread_t thread;
+} result_encoder;
+
+/*
+  Batches flow free -> decoded -> upscaled -> free,
+  so batch N+1 can be decoded and batch N-1 encoded while batch N is upscaled.
+  With more than one result encoder the output is cut into chunks of chunk_frames,
+  and the encoders take turns at them, every encoder sees every batch but only writes its own chunks.
+*/
+typedef struct batch_pipeline {
+	frame_batch batches[PIPELINE_BATCH_COUNT];
+	batch_queue free_batches;
+	batch_queue decoded_batches;
+	batch_queue upscaled_batches;
+
+	FILE* source;
+	result_encoder encoders[MAX_RESULT_ENCODERS];
+	size_t encoder_count;
+	size_t chunk_frames;
+	frame_ring* ring; // NULL unless ffmpeg is sending rawvideo
+	png_framer* framer; // NULL when ffmpeg is sending rawvideo
+	volatile sig_atomic_t* stop_signalled;
+
+	// Frames the decoder puts in each batch, can be changed while running
+	_Atomic size_t frames_per_batch;
+	temp_frame_store* frame_store; // Passed to create_temp_frame when a batch grows
+
+	// Held frame detection, only touched by the decoder
+	int hash_frames;
+	int skip_duplicates;
+	int duplicate_tolerance; // Largest per channel difference still counted as the same frame, rawvideo only
+	size_t duplicate_frames;
+	int has_previous_frame;
+	uint64_t previous_hash;
+	size_t previous_size;
+	BYTE* previous_pixels; // Our own copy, the frame's slot goes back to the ring once its batch is encoded
+
+	// Dirty tile detection, rawvideo only and also only touched by the decoder
+	int dirty_tiles;
+	unsigned int source_width;
+	unsigned int source_height;
+	const BYTE* dirty_reference; // The last frame of this batch that will be upscaled, NULL at the start of a batch
+	size_t partial_frames;
+	uint64_t partial_pixels; // Pixels in the crops of those frames
+
+	// Copy of the last frame the encoder thread handed out, for batches that start on a repeated frame
+	expandable_buffer last_encoded_frame;
+	size_t encoded_frames;
+
+	// Batches are freed in the order they were decoded, the ring gives back its oldest slots first
+	pthread_mutex_t release_mutex;
+	size_t next_release;
+
+	pthread_t decoder_thread;
+	pthread_t encoder_thread;
+} batch_pipeline;
+
+void init_batch_pipeline(batch_pipeline* pipeline, temp_frame* frames, temp_frame_store* frame_store, size_t frames_per_batch, FILE* source, FILE** results, size_t result_count, size_t chunk_frames,
+						 frame_ring* ring, png_framer* framer, volatile sig_atomic_t* stop_signalled){
+	init_batch_queue(&pipeline->free_batches, PIPELINE_BATCH_COUNT);
+	init_batch_queue(&pipeline->decoded_batches, PIPELINE_BATCH_COUNT);
+	init_batch_queue(&pipeline->upscaled_batches, PIPELINE_BATCH_COUNT);
+
+	int i;
+	for (i = 0; i < PIPELINE_BATCH_COUNT; i++){
+		frame_batch* batch = &pipeline->batches[i];
+		batch->frames = frames + (i * frames_per_batch);
+		batch->frame_capacity = frames_per_batch;
+		batch->first_slot = i * frames_per_batch;
+		batch->frames_provisioned = 0;
+		while (batch->frames_provisioned < frames_per_batch && batch->frames[batch->frames_provisioned].file != NULL)
+			batch->frames_provisioned++;
+		batch->frame_count = 0;
+		batch->batch_index = 0;
+		batch->first_frame = 0;
+		batch->carried_frame = create_expandable_buffer(INITIAL_FRAME_BUFFER_SIZE);
+		batch->encoding = 0;
+		batch->encoders_left = 0;
+		batch->decode_seconds_per_frame = 0.0;
+		batch->encode_seconds_per_frame = 0.0;
+		batch_queue_push(&pipeline->free_batches, batch);
+	}
+
+	pipeline->source = source;
+	size_t encoder;
+	for (encoder = 0; encoder < result_count; encoder++){
+		pipeline->encoders[encoder].pipeline = pipeline;
+		pipeline->encoders[encoder].index = encoder;
+		pipeline->encoders[encoder].input = results[encoder];
+		init_batch_queue(&pipeline->encoders[encoder].batches, PIPELINE_BATCH_COUNT);
+	}
+	pipeline->encoder_count = result_count;
+	pipeline->chunk_frames = chunk_frames;
+	pipeline->ring = ring;
+	pipeline->framer = framer;
+	pipeline->stop_signalled = stop_signalled;
+	atomic_store(&pipeline->frames_per_batch, frames_per_batch);
+	pipeline->frame_store = frame_store;
+
+	pipeline->hash_frames = 0;
+	pipeline->skip_duplicates = 0;
+	pipeline->duplicate_tolerance = 0;
+	pipeline->duplicate_frames = 0;
+	pipeline->has_previous_frame = 0;
+	pipeline->previous_pixels = NULL;
+	pipeline->dirty_tiles = 0;
+	pipeline->source_width = 0;
+	pipeline->source_height = 0;
+	pipeline->dirty_reference = NULL;
+	pipeline->partial_frames = 0;
+	pipeline->partial_pixels = 0;
+	pipeline->last_encoded_frame = create_expandable_buffer(INITIAL_FRAME_BUFFER_SIZE);
+	pipeline->encoded_frames = 0;
+	pthread_mutex_init(&pipeline->release_mutex, NULL);
+	pipeline->next_release = 0;
+}
+
+void batch_pipeline_close(batch_pipeline* pipeline){
+	batch_queue_close(&pipeline->free_batches);
+	batch_queue_close(&pipeline->decoded_batches);
+	batch_queue_close(&pipeline->upscaled_batches);
+	if (pipeline->ring != NULL) frame_ring_close(pipeline->ring);
+}
+
+void hash_frame(batch_pipeline* pipeline, temp_frame* frame){
+	BYTE* data = (pipeline->ring == NULL) ? frame->buffer.pointer : frame->source_pixels;
+	frame->content_size = (pipeline->ring == NULL) ? frame->buffer.size : pipeline->ring->slot_size;
+	frame->content_hash = hash_frame_data(data, frame->content_size);
+}
+
+// Marks the frame if it's the same as the one decoded before it
+void detect_repeated_frame(batch_pipeline* pipeline, temp_frame* frame){
+	BYTE* data = (pipeline->ring == NULL) ? frame->buffer.pointer : frame->source_pixels;
+	size_t size = frame->content_size;
+
+	frame->repeats_previous = 0;
+	if (pipeline->has_previous_frame){
+		if (frame->content_hash == pipeline->previous_hash && size == pipeline->previous_size){
+			frame->repeats_previous = 1;
+		}else if (pipeline->duplicate_tolerance > 0 && pipeline->ring != NULL){
+			frame->repeats_previous = frame_data_within_tolerance(data, pipeline->previous_pixels, size, pipeline->duplicate_tolerance);
+		}
+	}
+	if (frame->repeats_previous){
+		pipeline->duplicate_frames++;
+		metrics_count(METRIC_REPEATED_FRAMES, 1);
+		// Keep comparing against the frame that will actually be upscaled
+		return;
+	}
+	pipeline->has_previous_frame = 1;
+	pipeline->previous_hash = frame->content_hash;
+	pipeline->previous_size = size;
+	if (pipeline->duplicate_tolerance > 0 && pipeline->ring != NULL){
+		// A run of repeats can outlast the reference's batch, and so its slot
+		if (pipeline->previous_pixels == NULL) pipeline->previous_pixels = malloc(pipeline->ring->slot_size);
+		memcpy(pipeline->previous_pixels, frame->source_pixels, size);
+	}
+}
+
+// Marks the frame as partial if only a small part of it changed since the frame before it in this batch
+void detect_dirty_tiles(batch_pipeline* pipeline, temp_frame* frame){
+	frame->partial = 0;
+	const BYTE* reference = pipeline->dirty_reference;
+	if (reference == NULL){
+		pipeline->dirty_reference = frame->source_pixels;
+		return;
+	}
+	if (!find_dirty_tiles(frame->source_pixels, reference, pipeline->source_width, pipeline->source_height, pipeline->duplicate_tolerance, &frame->changed)){
+		// Nothing to upscale at all, the reference stays as it is
+		frame->repeats_previous = 1;
+		pipeline->duplicate_frames++;
+		metrics_count(METRIC_REPEATED_FRAMES, 1);
+		return;
+	}
+	pipeline->dirty_reference = frame->source_pixels;
+	frame->crop = pad_dirty_tiles(&frame->changed, pipeline->source_width, pipeline->source_height);
+	const uint64_t crop_pixels = (uint64_t)frame->crop.width * frame->crop.height;
+	if (crop_pixels > DIRTY_TILE_MAX_AREA * pipeline->source_width * pipeline->source_height) return;
+	frame->partial = 1;
+	pipeline->partial_frames++;
+	pipeline->partial_pixels += crop_pixels;
+	metrics_count(METRIC_PARTIAL_FRAMES, 1);
+}
+
+// Reads the next frame from ffmpeg into the temp frame
+// returns 1 if there are no more frames
+int decode_frame(batch_pipeline* pipeline, temp_frame* frame){
+	const double read_start_time = monotonic_seconds();
+	if (pipeline->ring == NULL){
+		// Read the PNG from ffmpeg
+		if (png_framer_read_in(pipeline->framer, &frame->buffer) != 0) return 1;
+	}else{
+		frame->source_pixels = frame_ring_acquire(pipeline->ring);
+		if (frame->source_pixels == NULL) return 1;
+		if (frame_ring_read_frame_in(pipeline->ring, frame->source_pixels, pipeline->source) != 0){
+			frame_ring_cancel_last(pipeline->ring);
+			frame->source_pixels = NULL;
+			return 1;
+		}
+	}
+	metrics_observe(HISTOGRAM_SOURCE_READ, monotonic_seconds() - read_start_time);
+
+	metrics_count(METRIC_FRAMES_DECODED, 1);
+	metrics_count(METRIC_SOURCE_BYTES, (pipeline->ring == NULL) ? frame->buffer.size : pipeline->ring->slot_size);
+	frame->repeats_previous = 0;
+	frame->partial = 0;
+	if (pipeline->hash_frames || pipeline->skip_duplicates) hash_frame(pipeline, frame);
+	if (pipeline->skip_duplicates) detect_repeated_frame(pipeline, frame);
+	if (pipeline->dirty_tiles && !frame->repeats_previous) detect_dirty_tiles(pipeline, frame);
+	return 0;
+}
+
+// Makes the batch hold frame_count frames, creating or freeing temp frames as needed
+void frame_batch_provision(frame_batch* batch, size_t frame_count, temp_frame_store* frame_store){
+	while (batch->frames_provisioned < frame_count){
+		batch->frames[batch->frames_provisioned] = create_temp_frame(frame_store, batch->first_slot + batch->frames_provisioned);
+		batch->frames_provisioned++;
+	}
+	while (batch->frames_provisioned > frame_count){
+		temp_frame* frame = &batch->frames[--batch->frames_provisioned];
+		free_temp_frame(frame);
+		memset(frame, 0, sizeof(temp_frame));
+	}
+}
+
+void* decode_batches(void* arg){
+	batch_pipeline* pipeline = (batch_pipeline*)arg;
+	size_t batch_index = 0;
+	while(*pipeline->stop_signalled == 0){
+		frame_batch* batch = batch_queue_pop(&pipeline->free_batches);
+		if (batch == NULL) break;
+
+		size_t frames_per_batch = atomic_load(&pipeline->frames_per_batch);
+		if (frames_per_batch > batch->frame_capacity) frames_per_batch = batch->frame_capacity;
+		// Slots are only filled in as frames arrive, but a smaller batch size gives back the ones past it straight away
+		if (batch->frames_provisioned > frames_per_batch) frame_batch_provision(batch, frames_per_batch, pipeline->frame_store);
+		const double start_time = monotonic_seconds();
+		pipeline->dirty_reference = NULL;
+
+		size_t frame_index;
+		for (frame_index = 0; frame_index < frames_per_batch; frame_index++){
+			if (frame_index == batch->frames_provisioned) frame_batch_provision(batch, frame_index + 1, pipeline->frame_store);
+			if (decode_frame(pipeline, &batch->frames[frame_index]) != 0){
+				break;
+			}
+		}
+		// This will only trigger if the ffmpeg input connection has been closed and all files have been read
+		if (frame_index == 0){
+			fprintf(stderr, "No more data from ffmpeg, stopping...\n");
+			break;
+		}
+		batch->frame_count = frame_index;
+		batch->batch_index = batch_index++;
+		batch->decode_seconds_per_frame = (monotonic_seconds() - start_time) / frame_index;
+		if (batch_queue_push(&pipeline->decoded_batches, batch) != 0) break;
+		// A partial batch means the source has run out
+		if (frame_index < frames_per_batch) break;
+	}
+	batch_queue_close(&pipeline->decoded_batches);
+	return NULL;
+}
+
+// Hands finished batches back to the decoder, oldest first, stopping at one that's still being written
+// Must hold release_mutex
+void release_encoded_batches(batch_pipeline* pipeline){
+	int released = 1;
+	while (released){
+		released = 0;
+		int i;
+		for (i = 0; i < PIPELINE_BATCH_COUNT; i++){
+			frame_batch* batch = &pipeline->batches[i];
+			if (!batch->encoding || batch->encoders_left != 0 || batch->batch_index != pipeline->next_release) continue;
+			if (pipeline->ring != NULL) frame_ring_release(pipeline->ring, batch->frame_count);
+			batch->encode_seconds_per_frame = (monotonic_seconds() - batch->encode_start_time) / batch->frame_count;
+			batch->encoding = 0;
+			pipeline->next_release++;
+			batch_queue_push(&pipeline->free_batches, batch);
+			released = 1;
+		}
+	}
+}
+
+// Sends the frames of each batch that fall in this encoder's chunks to its ffmpeg
+void* write_result_frames(void* arg){
+	result_encoder* encoder = (result_encoder*)arg;
+	batch_pipeline* pipeline = encoder->pipeline;
+	while(1){
+		frame_batch* batch = batch_queue_pop(&encoder->batches);
+		if (batch == NULL) break;
+
+		const double start_time = monotonic_seconds();
+		size_t frame_index;
+		for (frame_index = 0; frame_index < batch->frame_count; frame_index++){
+			if (*pipeline->stop_signalled != 0) break;
+			if (((batch->first_frame + frame_index) / pipeline->chunk_frames) % pipeline->encoder_count != encoder->index) continue;
+			temp_frame* frame = &batch->frames[frame_index];
+			const double write_start_time = monotonic_seconds();
+			write_to_pipe(frame->encode_data, frame->encode_size, encoder->input);
+			const double write_seconds = monotonic_seconds() - write_start_time;
+			metrics_observe(HISTOGRAM_ENCODER_WRITE, write_seconds);
+			if (write_seconds > METRICS_STALL_SECONDS) metrics_count(METRIC_ENCODER_STALLS, 1);
+			metrics_count(METRIC_FRAMES_ENCODED, 1);
+			metrics_count(METRIC_RESULT_BYTES, frame->encode_size);
+		}
+		fflush(encoder->input);
+
+		pthread_mutex_lock(&pipeline->release_mutex);
+		if (batch->encode_start_time == 0.0 || start_time < batch->encode_start_time) batch->encode_start_time = start_time;
+		batch->encoders_left--;
+		if (batch->encoders_left == 0) release_encoded_batches(pipeline);
+		pthread_mutex_unlock(&pipeline->release_mutex);
+	}
+	return NULL;
+}
+
+// Works out what each frame of a batch sends, then passes the batch to every result encoder
+void* encode_batches(void* arg){
+	batch_pipeline* pipeline = (batch_pipeline*)arg;
+	expandable_buffer* last_encoded_frame = &pipeline->last_encoded_frame;
+	size_t encoder;
+	while(1){
+		frame_batch* batch = batch_queue_pop(&pipeline->upscaled_batches);
+		if (batch == NULL) break;
+
+		const BYTE* previous_data = NULL;
+		size_t previous_size = 0;
+		size_t frame_index;
+		for (frame_index = 0; frame_index < batch->frame_count; frame_index++){
+			temp_frame* frame = &batch->frames[frame_index];
+			// Repeated frames weren't upscaled, send the last frame again instead
+			if (!frame->repeats_previous){
+				previous_data = frame->buffer.pointer + frame->result_offset;
+				previous_size = frame->buffer.size - frame->result_offset;
+			}else if (previous_data == NULL){
+				// The last batch's buffers get reused by the decoder while this one is still being written
+				expandable_buffer_clear(&batch->carried_frame);
+				memcpy(expandable_buffer_increase_size(&batch->carried_frame, last_encoded_frame->size), last_encoded_frame->pointer, last_encoded_frame->size);
+				previous_data = batch->carried_frame.pointer;
+				previous_size = batch->carried_frame.size;
+			}
+			frame->encode_data = previous_data;
+			frame->encode_size = previous_size;
+		}
+		if (previous_data != batch->carried_frame.pointer){
+			expandable_buffer_clear(last_encoded_frame);
+			memcpy(expandable_buffer_increase_size(last_encoded_frame, previous_size), previous_data, previous_size);
+		}
+		batch->first_frame = pipeline->encoded_frames;
+		pipeline->encoded_frames += batch->frame_count;
+
+		pthread_mutex_lock(&pipeline->release_mutex);
+		batch->encoding = 1;
+		batch->encoders_left = pipeline->encoder_count;
+		batch->encode_start_time = 0.0;
+		pthread_mutex_unlock(&pipeline->release_mutex);
+		// Only this thread closes the encoders' queues, and they have room for every batch
+		for (encoder = 0; encoder < pipeline->encoder_count; encoder++) batch_queue_push(&pipeline->encoders[encoder].batches, batch);
+	}
+	for (encoder = 0; encoder < pipeline->encoder_count; encoder++){
+		batch_queue_close(&pipeline->encoders[encoder].batches);
+		pthread_join(pipeline->encoders[encoder].thread, NULL);
+	}
+	return NULL;
+}
+
+void batch_pipeline_start(batch_pipeline* pipeline){
+	size_t encoder;
+	for (encoder = 0; encoder < pipeline->encoder_count; encoder++){
+		if (pthread_create(&pipeline->encoders[encoder].thread, NULL, write_result_frames, &pipeline->encoders[encoder]) != 0){
+			fprintf(stderr, "Failed to start pipeline threads\n");
+			exit(1);
+		}
+	}
+	if (pthread_create(&pipeline->decoder_thread, NULL, decode_batches, pipeline) != 0
+		|| pthread_create(&pipeline->encoder_thread, NULL, encode_batches, pipeline) != 0){
+		fprintf(stderr, "Failed to start pipeline threads\n");
+		exit(1);
+	}
+}
+
+// Waits for the decoder and encoders to drain
+void batch_pipeline_join(batch_pipeline* pipeline){
+	pthread_join(pipeline->decoder_thread, NULL);
+	pthread_join(pipeline->encoder_thread, NULL);
+}
+
+void free_batch_pipeline(batch_pipeline* pipeline){
+	int i;
+	for (i = 0; i < PIPELINE_BATCH_COUNT; i++) free_expandable_buffer(&pipeline->batches[i].carried_frame);
+	size_t encoder;
+	for (encoder = 0; encoder < pipeline->encoder_count; encoder++) free_batch_queue(&pipeline->encoders[encoder].batches);
+	pthread_mutex_destroy(&pipeline->release_mutex);
+	free_expandable_buffer(&pipeline->last_encoded_frame);
+	free(pipeline->previous_pixels);
+	free_batch_queue(&pipeline->free_batches);
+	free_batch_queue(&pipeline->decoded_batches);
+	free_batch_queue(&pipeline->upscaled_batches);
+}
@@ -0,0 +1,60 @@
+#define BATCH_SIZER_MINIMUM 4
+#define BATCH_SIZER_STARTING_SIZE 16
+#define BATCH_SIZER_REQUIRED_GAIN 0.9 // A bigger batch has to upscale at least 10% faster per frame to be kept
+#define BATCH_SIZER_SETTLE_BATCHES 16 // Batches to wait before trying a bigger size again
+
+/*
+  Picks the batch size for --frame-count=auto.
+  Each batch has a fixed startup cost in the upscaler, so the batch doubles while that still makes frames noticeably cheaper.
+  Once it stops paying off the size drops back to the last one that did, and every so often a bigger one is tried again.
+  If decoding or encoding is slower than upscaling a bigger batch can't help, so it shrinks to keep latency and memory down.
+*/
+typedef struct {
+	size_t minimum;
+	size_t maximum;
+	size_t size;
+
+	size_t measured_size; // 0 when there's nothing to compare against
+	double measured_seconds_per_frame;
+	size_t settled_batches;
+} batch_sizer;
+
+void init_batch_sizer(batch_sizer* sizer, size_t maximum){
+	sizer->maximum = maximum;
+	sizer->minimum = (maximum < BATCH_SIZER_MINIMUM) ? maximum : BATCH_SIZER_MINIMUM;
+	sizer->size = (maximum < BATCH_SIZER_STARTING_SIZE) ? maximum : BATCH_SIZER_STARTING_SIZE;
+	sizer->measured_size = 0;
+	sizer->measured_seconds_per_frame = 0.0;
+	sizer->settled_batches = 0;
+}
+
+// Feeds in the timings of a batch of frame_count frames
+// returns 1 if the size has changed
+int batch_sizer_update(batch_sizer* sizer, size_t frame_count, double upscale_seconds, double decode_seconds_per_frame, double encode_seconds_per_frame){
+	// Batches of the old size are still coming through, and the last batch is usually short
+	if (frame_count != sizer->size || frame_count == 0) return 0;
+
+	const size_t old_size = sizer->size;
+	const double seconds_per_frame = upscale_seconds / frame_count;
+	const double other_stage_seconds_per_frame = (decode_seconds_per_frame > encode_seconds_per_frame) ? decode_seconds_per_frame : encode_seconds_per_frame;
+
+	if (other_stage_seconds_per_frame > seconds_per_frame){
+		sizer->size = (sizer->size / 2 < sizer->minimum) ? sizer->minimum : sizer->size / 2;
+		sizer->measured_size = 0;
+		sizer->settled_batches = 0;
+	}else if (sizer->measured_size == 0
+			  || (sizer->size > sizer->measured_size && seconds_per_frame < sizer->measured_seconds_per_frame * BATCH_SIZER_REQUIRED_GAIN)){
+		sizer->measured_size = sizer->size;
+		sizer->measured_seconds_per_frame = seconds_per_frame;
+		sizer->size = (sizer->size * 2 > sizer->maximum) ? sizer->maximum : sizer->size * 2;
+	}else if (sizer->size > sizer->measured_size){
+		sizer->size = sizer->measured_size;
+		sizer->settled_batches = BATCH_SIZER_SETTLE_BATCHES;
+	}else if (sizer->settled_batches > 0){
+		sizer->settled_batches--;
+	}else{
+		// Things may have changed since, measure again from here
+		sizer->measured_size = 0;
+	}
+	return sizer->size != old_size;
+}
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <libgen.h>
+#include <limits.h>
+
+/*
+  Stand-ins for ffmpeg, ffprobe and waifu2x's th used by make bench, picked by the name they're run as.
+  They do as little as they can so the time measured is spent in anime_upscaler:
+  ffmpeg makes up BENCH_FRAMES frames of BENCH_WIDTHxBENCH_HEIGHT and counts the frames it gets back,
+  and th scales frames 2x with nearest neighbour, or just copies PNGs with BENCH_UPSCALER=copy.
+  PNGs are written with stored deflate blocks, which is also the only kind th can read back.
+*/
+
+typedef uint8_t BYTE;
+
+#define STORED_BLOCK_MAX 65535
+#define FRAMERATE "24/1"
+
+static const BYTE PNG_HEADER[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+static uint32_t crc_table[8][256]; // Slice by 8
+
+unsigned int env_or(const char* name, unsigned int fallback){
+	const char* value = getenv(name);
+	return (value != NULL && atoi(value) > 0) ? (unsigned int)atoi(value) : fallback;
+}
+const char* find_argument(int argc, char* argv[], const char* name){
+	int i;
+	for (i = 1; i < argc - 1; i++){
+		if (strcmp(argv[i], name) == 0) return argv[i + 1];
+	}
+	return NULL;
+}
+
+void init_crc_table(){
+	uint32_t i, bit;
+	for (i = 0; i < 256; i++){
+		uint32_t c = i;
+		for (bit = 0; bit < 8; bit++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++){
+		for (bit = 1; bit < 8; bit++) crc_table[bit][i] = crc_table[0][crc_table[bit - 1][i] & 0xff] ^ (crc_table[bit - 1][i] >> 8);
+	}
+}
+uint32_t update_crc(uint32_t crc, const BYTE* data, size_t size){
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8){
+		const uint32_t low = crc ^ (data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | ((uint32_t)data[i + 3] << 24));
+		crc = crc_table[7][low & 0xff] ^ crc_table[6][(low >> 8) & 0xff] ^ crc_table[5][(low >> 16) & 0xff] ^ crc_table[4][low >> 24]
+			^ crc_table[3][data[i + 4]] ^ crc_table[2][data[i + 5]] ^ crc_table[1][data[i + 6]] ^ crc_table[0][data[i + 7]];
+	}
+	for (; i < size; i++) crc = crc_table[0][(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+void put_u32(BYTE* out, uint32_t value){
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+uint32_t get_u32(const BYTE* in){
+	return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+void write_chunk(FILE* out, const char* name, const BYTE* data, uint32_t size){
+	BYTE header[8];
+	put_u32(header, size);
+	memcpy(header + 4, name, 4);
+	BYTE crc[4];
+	put_u32(crc, update_crc(update_crc(0xffffffff, header + 4, 4), data, size) ^ 0xffffffff);
+	fwrite(header, 1, 8, out);
+	if (size != 0) fwrite(data, 1, size, out);
+	fwrite(crc, 1, 4, out);
+}
+
+// Writes packed rgb24 as a PNG, the zlib stream is all stored blocks so there's nothing to compress
+void write_png(FILE* out, unsigned int width, unsigned int height, const BYTE* rgb){
+	const size_t row_size = (size_t)width * 3;
+	const size_t raw_size = (row_size + 1) * height;
+	BYTE* raw = malloc(raw_size);
+	unsigned int y;
+	for (y = 0; y < height; y++){
+		raw[y * (row_size + 1)] = 0; // Filter type none
+		memcpy(raw + y * (row_size + 1) + 1, rgb + y * row_size, row_size);
+	}
+
+	const size_t block_count = (raw_size + STORED_BLOCK_MAX - 1) / STORED_BLOCK_MAX;
+	BYTE* idat = malloc(2 + block_count * 5 + raw_size + 4);
+	size_t idat_size = 0;
+	idat[idat_size++] = 0x78;
+	idat[idat_size++] = 0x01;
+	uint64_t adler_a = 1, adler_b = 0;
+	size_t raw_position;
+	for (raw_position = 0; raw_position < raw_size; raw_position += STORED_BLOCK_MAX){
+		const size_t block_size = (raw_size - raw_position < STORED_BLOCK_MAX) ? raw_size - raw_position : STORED_BLOCK_MAX;
+		BYTE* header = idat + idat_size;
+		header[0] = (raw_position + block_size == raw_size) ? 1 : 0;
+		header[1] = block_size & 0xff;
+		header[2] = block_size >> 8;
+		header[3] = ~block_size & 0xff;
+		header[4] = (~block_size >> 8) & 0xff;
+		memcpy(idat + idat_size + 5, raw + raw_position, block_size);
+		idat_size += 5 + block_size;
+		// The sums over one block can't overflow 64 bits, so the modulo is only taken once per block
+		size_t i;
+		for (i = 0; i < block_size; i++){
+			adler_a += raw[raw_position + i];
+			adler_b += adler_a;
+		}
+		adler_a %= 65521;
+		adler_b %= 65521;
+	}
+	put_u32(idat + idat_size, (uint32_t)((adler_b << 16) | adler_a));
+	idat_size += 4;
+
+	BYTE ihdr[13];
+	put_u32(ihdr, width);
+	put_u32(ihdr + 4, height);
+	ihdr[8] = 8; // Bit depth
+	ihdr[9] = 2; // rgb
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	fwrite(PNG_HEADER, 1, sizeof(PNG_HEADER), out);
+	write_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+	write_chunk(out, "IDAT", idat, idat_size);
+	write_chunk(out, "IEND", NULL, 0);
+	free(idat);
+	free(raw);
+}
+
+// Reads one PNG from the stream, keeping the IDAT data if idat isn't NULL
+// returns 1 at the end of the stream or on an error
+int read_png(FILE* in, unsigned int* width, unsigned int* height, BYTE** idat, size_t* idat_size){
+	BYTE header[8];
+	if (fread(header, 1, sizeof(header), in) != sizeof(header)) return 1;
+	if (memcmp(header, PNG_HEADER, sizeof(PNG_HEADER)) != 0) return 1;
+	static BYTE* chunk = NULL;
+	static size_t chunk_capacity = 0;
+	if (idat != NULL) *idat_size = 0;
+	while (1){
+		if (fread(header, 1, 8, in) != 8) return 1;
+		const uint32_t size = get_u32(header);
+		if (size + 4 > chunk_capacity){
+			chunk_capacity = size + 4;
+			chunk = realloc(chunk, chunk_capacity);
+		}
+		if (fread(chunk, 1, size + 4, in) != size + 4) return 1;
+		if (memcmp(header + 4, "IHDR", 4) == 0){
+			*width = get_u32(chunk);
+			*height = get_u32(chunk + 4);
+		}else if (memcmp(header + 4, "IDAT", 4) == 0 && idat != NULL){
+			*idat = realloc(*idat, *idat_size + size);
+			memcpy(*idat + *idat_size, chunk, size);
+			*idat_size += size;
+		}else if (memcmp(header + 4, "IEND", 4) == 0){
+			return 0;
+		}
+	}
+}
+
+// Unpacks a zlib stream of stored blocks and filter type 0 rows into packed rgb24
+// returns NULL if the PNG is in any other form
+BYTE* unpack_png(const BYTE* idat, size_t idat_size, unsigned int width, unsigned int height){
+	const size_t row_size = (size_t)width * 3;
+	const size_t raw_size = (row_size + 1) * height;
+	BYTE* raw = malloc(raw_size);
+	size_t position = 2;
+	size_t raw_position = 0;
+	int final_block = 0;
+	while (!final_block && position + 5 <= idat_size){
+		final_block = idat[position] & 1;
+		if ((idat[position] >> 1) != 0) break; // Compressed
+		const size_t block_size = idat[position + 1] | (idat[position + 2] << 8);
+		position += 5;
+		if (position + block_size > idat_size || raw_position + block_size > raw_size) break;
+		memcpy(raw + raw_position, idat + position, block_size);
+		raw_position += block_size;
+		position += block_size;
+	}
+	BYTE* rgb = NULL;
+	if (final_block && raw_position == raw_size){
+		rgb = malloc(row_size * height);
+		unsigned int y;
+		for (y = 0; y < height && rgb != NULL; y++){
+			if (raw[y * (row_size + 1)] != 0){
+				free(rgb);
+				rgb = NULL;
+			}else{
+				memcpy(rgb + y * row_size, raw + y * (row_size + 1) + 1, row_size);
+			}
+		}
+	}
+	free(raw);
+	return rgb;
+}
+
+// Nearest neighbour 2x
+BYTE* scale_rgb(const BYTE* rgb, unsigned int width, unsigned int height){
+	const size_t row_size = (size_t)width * 3;
+	BYTE* scaled = malloc(row_size * 4 * height);
+	unsigned int x, y;
+	for (y = 0; y < height; y++){
+		const BYTE* source_row = rgb + y * row_size;
+		BYTE* row = scaled + (size_t)y * 2 * row_size * 2;
+		for (x = 0; x < width; x++){
+			memcpy(row + x * 6, source_row + x * 3, 3);
+			memcpy(row + x * 6 + 3, source_row + x * 3, 3);
+		}
+		memcpy(row + row_size * 2, row, row_size * 2);
+	}
+	return scaled;
+}
+
+int copy_file(const char* input_filename, const char* output_filename){
+	FILE* in = fopen(input_filename, "rb");
+	FILE* out = fopen(output_filename, "wb");
+	int failed = (in == NULL || out == NULL);
+	static BYTE data[1 << 16];
+	size_t total_read;
+	while (!failed && (total_read = fread(data, 1, sizeof(data), in)) > 0) failed = fwrite(data, 1, total_read, out) != total_read;
+	if (in != NULL) fclose(in);
+	if (out != NULL && fclose(out) != 0) failed = 1;
+	return failed;
+}
+
+// returns 1 if unsuccessful
+int upscale_file(const char* input_filename, const char* output_filename, int copy){
+	FILE* in = fopen(input_filename, "rb");
+	if (in == NULL) return 1;
+	unsigned int width = 0, height = 0, max_value;
+	BYTE* rgb = NULL;
+	int ppm = 0;
+	if (fscanf(in, "P6 %u %u %u", &width, &height, &max_value) == 3 && fgetc(in) != EOF){
+		ppm = 1;
+		rgb = malloc((size_t)width * height * 3);
+		if (fread(rgb, 1, (size_t)width * height * 3, in) != (size_t)width * height * 3){
+			free(rgb);
+			rgb = NULL;
+		}
+	}else if (copy){
+		// The result ffmpeg doesn't look at the sizes of PNGs, so a copy is the cheapest upscaler there is
+		fclose(in);
+		return copy_file(input_filename, output_filename);
+	}else{
+		rewind(in);
+		BYTE* idat = NULL;
+		size_t idat_size = 0;
+		if (read_png(in, &width, &height, &idat, &idat_size) == 0) rgb = unpack_png(idat, idat_size, width, height);
+		free(idat);
+	}
+	fclose(in);
+	if (rgb == NULL){
+		fprintf(stderr, "bench th: can't read %s\n", input_filename);
+		return 1;
+	}
+
+	BYTE* scaled = scale_rgb(rgb, width, height);
+	FILE* out = fopen(output_filename, "wb");
+	int failed = (out == NULL);
+	if (!failed && ppm){
+		fprintf(out, "P6\n%u %u\n255\n", width * 2, height * 2);
+		fwrite(scaled, 1, (size_t)width * height * 12, out);
+	}else if (!failed){
+		write_png(out, width * 2, height * 2, scaled);
+	}
+	if (out != NULL && fclose(out) != 0) failed = 1;
+	free(scaled);
+	free(rgb);
+	return failed;
+}
+
+// A moving gradient, so no two frames are the same
+void fill_frame(BYTE* rgb, unsigned int width, unsigned int height, unsigned int frame){
+	unsigned int x, y;
+	for (y = 0; y < height; y++){
+		BYTE* row = rgb + (size_t)y * width * 3;
+		for (x = 0; x < width; x++){
+			row[x * 3] = x + frame;
+			row[x * 3 + 1] = y + frame * 3;
+			row[x * 3 + 2] = (x ^ y) + frame * 7;
+		}
+	}
+}
+
+int run_ffprobe(){
+	printf("%u,%u," FRAMERATE "\n", env_or("BENCH_WIDTH", 1280), env_or("BENCH_HEIGHT", 720));
+	return 0;
+}
+
+int run_ffmpeg(int argc, char* argv[]){
+	const unsigned int width = env_or("BENCH_WIDTH", 1280);
+	const unsigned int height = env_or("BENCH_HEIGHT", 720);
+	const unsigned int frame_count = env_or("BENCH_FRAMES", 48);
+	int raw = 0;
+	int i;
+	for (i = 1; i < argc; i++){
+		if (strcmp(argv[i], "rawvideo") == 0) raw = 1;
+	}
+	const char* input = NULL;
+	for (i = 1; i < argc - 1; i++){
+		if (strcmp(argv[i], "-i") == 0) input = argv[i + 1];
+	}
+
+	if (input != NULL && strcmp(input, "-") != 0){
+		// The source, the output is the last argument
+		BYTE* rgb = malloc((size_t)width * height * 3);
+		unsigned int frame;
+		for (frame = 0; frame < frame_count; frame++){
+			fill_frame(rgb, width, height, frame);
+			if (raw){
+				fwrite(rgb, 1, (size_t)width * height * 3, stdout);
+			}else{
+				write_png(stdout, width, height, rgb);
+			}
+			if (ferror(stdout)) break;
+		}
+		free(rgb);
+		return 0;
+	}
+
+	// The result, frames come in on stdin and -progress goes to stderr
+	size_t raw_frame_size = 0;
+	const char* raw_size = find_argument(argc, argv, "-s");
+	if (raw){
+		unsigned int raw_width, raw_height;
+		if (raw_size == NULL || sscanf(raw_size, "%ux%u", &raw_width, &raw_height) != 2) return 1;
+		raw_frame_size = (size_t)raw_width * raw_height * 3;
+	}
+	BYTE* frame_data = raw ? malloc(raw_frame_size) : NULL;
+	unsigned int frames = 0, frame_width = 0, frame_height = 0;
+	while (raw ? fread(frame_data, 1, raw_frame_size, stdin) == raw_frame_size : read_png(stdin, &frame_width, &frame_height, NULL, NULL) == 0){
+		frames++;
+		fprintf(stderr, "frame=%u\nprogress=continue\n", frames);
+	}
+	fprintf(stderr, "frame=%u\nprogress=end\n", frames);
+	free(frame_data);
+
+	FILE* out = fopen(argv[argc - 1], "w");
+	if (out == NULL) return 1;
+	fprintf(out, "%u frames\n", frames);
+	return fclose(out) != 0;
+}
+
+int run_th(int argc, char* argv[]){
+	const char* upscaler = getenv("BENCH_UPSCALER");
+	const int copy = upscaler != NULL && strcmp(upscaler, "copy") == 0;
+	const char* list_filepath = find_argument(argc, argv, "-l");
+	const char* output_pattern = find_argument(argc, argv, "-o");
+	char line[2 * PATH_MAX + 2];
+
+	if (list_filepath == NULL){
+		// A persistent worker, answers each "<input>\t<output>" line
+		while (fgets(line, sizeof(line), stdin) != NULL){
+			line[strcspn(line, "\n")] = '\0';
+			char* output_filename = strchr(line, '\t');
+			if (output_filename == NULL) continue;
+			*output_filename++ = '\0';
+			printf("%s\t%s\n", upscale_file(line, output_filename, copy) ? "err" : "ok", line);
+			fflush(stdout);
+		}
+		return 0;
+	}
+	if (output_pattern == NULL) return 1;
+
+	// Like waifu2x.lua, the whole list is read before starting
+	FILE* list = fopen(list_filepath, "r");
+	if (list == NULL) return 1;
+	char** input_filenames = NULL;
+	size_t input_count = 0;
+	while (fgets(line, sizeof(line), list) != NULL){
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '\0') continue;
+		input_filenames = realloc(input_filenames, (input_count + 1) * sizeof(char*));
+		input_filenames[input_count++] = strdup(line);
+	}
+	fclose(list);
+	size_t i;
+	for (i = 0; i < input_count; i++){
+		char output_filename[PATH_MAX + 64];
+		char* input_copy = strdup(input_filenames[i]);
+		snprintf(output_filename, sizeof(output_filename), output_pattern, basename(input_copy));
+		free(input_copy);
+		if (upscale_file(input_filenames[i], output_filename, copy)) return 1;
+		printf(" [====>....] ETA: 0ms | Step: 0ms %zu/%zu \r", i + 1, input_count);
+		fflush(stdout);
+		free(input_filenames[i]);
+	}
+	printf("\n");
+	free(input_filenames);
+	return 0;
+}
+
+int main(int argc, char* argv[]){
+	signal(SIGPIPE, SIG_IGN);
+	init_crc_table();
+	const char* name = basename(argv[0]);
+	if (strcmp(name, "ffmpeg") == 0) return run_ffmpeg(argc, argv);
+	if (strcmp(name, "ffprobe") == 0) return run_ffprobe();
+	if (strcmp(name, "th") == 0) return run_th(argc, argv);
+	fprintf(stderr, "Run this as ffmpeg, ffprobe or th\n");
+	return 1;
+}
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+
+#include "../buffer_pool.h"
+#include "../expandable_buffer.h"
+#include "../png_framer.h"
+
+/*
+  Microbenchmarks for the buffer and PNG framing functions every frame goes through.
+  Frames cycle through sizes from 720p to 4K, and the PNGs are split into IDAT chunks of a few sizes like encoders do.
+  Built with malloc and memcpy wrapped by the linker, so the allocations and the bytes moved by our code are counted too,
+  the copies made inside stdio aren't.
+*/
+
+#define MICRO_BENCH_DEFAULT_SECONDS 0.5
+#define PNG_COMPRESSION_RATIO 0.4 // Roughly what anime frames compress to
+
+typedef struct {
+	const char* name;
+	unsigned int width, height;
+} frame_size;
+// The order frames arrive in, so buffers have to grow and shrink like they would between scenes
+static const frame_size frame_sizes[] = {
+	{ "720p", 1280, 720 }, { "1080p", 1920, 1080 }, { "4K", 3840, 2160 }, { "1440p", 2560, 1440 },
+	{ "1080p", 1920, 1080 }, { "720p", 1280, 720 }, { "4K", 3840, 2160 }, { "1080p", 1920, 1080 },
+};
+#define FRAME_SIZE_COUNT (sizeof(frame_sizes) / sizeof(frame_sizes[0]))
+static const size_t idat_chunk_sizes[] = { 8 << 10, 64 << 10, 0 }; // 0 puts all the data in one chunk
+
+static _Atomic uint64_t allocation_count = 0;
+static _Atomic uint64_t bytes_moved = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* pointer, size_t size);
+void* __real_memcpy(void* destination, const void* source, size_t size);
+void* __real_memmove(void* destination, const void* source, size_t size);
+void* __wrap_malloc(size_t size){
+	atomic_fetch_add(&allocation_count, 1);
+	return __real_malloc(size);
+}
+void* __wrap_calloc(size_t count, size_t size){
+	atomic_fetch_add(&allocation_count, 1);
+	return __real_calloc(count, size);
+}
+void* __wrap_realloc(void* pointer, size_t size){
+	atomic_fetch_add(&allocation_count, 1);
+	return __real_realloc(pointer, size);
+}
+void* __wrap_memcpy(void* destination, const void* source, size_t size){
+	atomic_fetch_add(&bytes_moved, size);
+	return __real_memcpy(destination, source, size);
+}
+void* __wrap_memmove(void* destination, const void* source, size_t size){
+	atomic_fetch_add(&bytes_moved, size);
+	return __real_memmove(destination, source, size);
+}
+
+double monotonic_seconds(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+size_t png_data_size(const frame_size* size){
+	return (size_t)(size->width * size->height * 3 * PNG_COMPRESSION_RATIO);
+}
+
+void put_big_endian_32(BYTE* out, uint32_t value){
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+void append_chunk(expandable_buffer* buffer, const char* name, size_t data_size){
+	BYTE* chunk = expandable_buffer_increase_size(buffer, PNG_CHUNK_OVERHEAD + data_size);
+	put_big_endian_32(chunk, data_size);
+	memcpy(chunk + 4, name, 4);
+	size_t i;
+	for (i = 0; i < data_size; i++) chunk[8 + i] = i * 31;
+	put_big_endian_32(chunk + 8 + data_size, crc32_of(chunk + 4, 4 + data_size));
+}
+// Appends a PNG shaped frame, only the framing is real
+void append_png(expandable_buffer* buffer, const frame_size* size, size_t idat_chunk_size){
+	memcpy(expandable_buffer_increase_size(buffer, PNG_SIGNATURE_SIZE), PNG_SIGNATURE, PNG_SIGNATURE_SIZE);
+	append_chunk(buffer, "IHDR", 13);
+	size_t data_left = png_data_size(size);
+	while (data_left > 0){
+		const size_t chunk_size = (idat_chunk_size == 0 || data_left < idat_chunk_size) ? data_left : idat_chunk_size;
+		append_chunk(buffer, "IDAT", chunk_size);
+		data_left -= chunk_size;
+	}
+	append_chunk(buffer, "IEND", 0);
+}
+
+typedef struct {
+	const char* name;
+	size_t idat_chunk_size;
+	int memfd; // Every frame in frame_sizes one after the other
+	FILE* file;
+	expandable_buffer buffer;
+	png_framer framer;
+	FILE* output;
+	int drain_fd;
+	pthread_t drain_thread;
+} bench_state;
+
+// Runs one op on frame index, returns the bytes it read or wrote
+typedef size_t (*bench_op)(bench_state* state, size_t index);
+
+size_t increase_size_op(bench_state* state, size_t index){
+	// Grows the buffer the way expandable_buffer_read_png_in does, without reading anything
+	const size_t chunk_size = state->idat_chunk_size ? state->idat_chunk_size : png_data_size(&frame_sizes[index]);
+	size_t data_left = png_data_size(&frame_sizes[index]);
+	expandable_buffer_clear(&state->buffer);
+	expandable_buffer_increase_size(&state->buffer, PNG_SIGNATURE_SIZE);
+	while (data_left > 0){
+		const size_t size = (data_left < chunk_size) ? data_left : chunk_size;
+		expandable_buffer_increase_size(&state->buffer, 4);
+		expandable_buffer_increase_size(&state->buffer, 4);
+		expandable_buffer_increase_size(&state->buffer, size);
+		expandable_buffer_increase_size(&state->buffer, 4);
+		data_left -= size;
+	}
+	return 0; // Nothing is touched
+}
+size_t increase_size_fresh_op(bench_state* state, size_t index){
+	// Like increase_size_op, but for a buffer made just for this frame
+	bench_state fresh = *state;
+	fresh.buffer = create_expandable_buffer(PNG_FRAMER_READ_SIZE);
+	increase_size_op(&fresh, index);
+	free_expandable_buffer(&fresh.buffer);
+	return 0;
+}
+size_t read_png_in_op(bench_state* state, size_t index){
+	if (index == 0) rewind(state->file);
+	if (expandable_buffer_read_png_in(&state->buffer, state->file) != 0){
+		fprintf(stderr, "Failed to read frame %zu\n", index);
+		exit(1);
+	}
+	return state->buffer.size;
+}
+size_t png_framer_read_in_op(bench_state* state, size_t index){
+	if (index == 0){
+		lseek(state->memfd, 0, SEEK_SET);
+		state->framer.end_of_stream = 0;
+		expandable_buffer_clear(&state->framer.carry);
+	}
+	if (png_framer_read_in(&state->framer, &state->buffer) != 0){
+		fprintf(stderr, "Failed to frame frame %zu\n", index);
+		exit(1);
+	}
+	return state->buffer.size;
+}
+// The last two use the frame left in the buffer by setup
+size_t write_to_file_op(bench_state* state, size_t index){
+	state->buffer.size = png_data_size(&frame_sizes[index]);
+	if (expandable_buffer_write_to_file(&state->buffer, state->output) != 0) exit(1);
+	return state->buffer.size;
+}
+size_t write_to_pipe_op(bench_state* state, size_t index){
+	state->buffer.size = png_data_size(&frame_sizes[index]);
+	expandable_buffer_write_to_pipe(&state->buffer, state->output);
+	return state->buffer.size;
+}
+
+void* drain_pipe(void* arg){
+	bench_state* state = arg;
+	static BYTE discarded[1 << 20];
+	while (read(state->drain_fd, discarded, sizeof(discarded)) > 0);
+	return NULL;
+}
+
+void setup_stream(bench_state* state){
+	expandable_buffer stream = create_expandable_buffer(0);
+	size_t i;
+	for (i = 0; i < FRAME_SIZE_COUNT; i++) append_png(&stream, &frame_sizes[i], state->idat_chunk_size);
+	state->memfd = memfd_create("micro_bench", 0);
+	if (state->memfd == -1 || write(state->memfd, stream.pointer, stream.size) != stream.size){
+		fprintf(stderr, "Failed to make the test stream: %s\n", strerror(errno));
+		exit(1);
+	}
+	free_expandable_buffer(&stream);
+	state->file = fdopen(dup(state->memfd), "r");
+	init_png_framer(&state->framer, state->memfd, 0);
+}
+void setup_output_file(bench_state* state){
+	char filename[] = "/dev/shm/anime-upscaler-micro-bench-XXXXXX";
+	int fd = mkstemp(filename);
+	if (fd == -1){
+		fprintf(stderr, "Failed to make a temp file: %s\n", strerror(errno));
+		exit(1);
+	}
+	unlink(filename);
+	state->output = fdopen(fd, "w+");
+}
+void setup_output_pipe(bench_state* state){
+	int fds[2];
+	if (pipe(fds) != 0){
+		fprintf(stderr, "Failed to make a pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (fcntl(fds[1], F_SETPIPE_SZ, PNG_FRAMER_PIPE_SIZE) == -1) errno = 0;
+	state->drain_fd = fds[0];
+	state->output = fdopen(fds[1], "w");
+	pthread_create(&state->drain_thread, NULL, drain_pipe, state);
+}
+
+void run_bench(const char* name, size_t idat_chunk_size, bench_op op, double seconds){
+	bench_state state = { .name = name, .idat_chunk_size = idat_chunk_size, .memfd = -1, .drain_fd = -1 };
+	state.buffer = create_expandable_buffer(0);
+	if (op == read_png_in_op || op == png_framer_read_in_op) setup_stream(&state);
+	if (op == write_to_file_op) setup_output_file(&state);
+	if (op == write_to_pipe_op) setup_output_pipe(&state);
+	if (op == write_to_file_op || op == write_to_pipe_op){
+		// One frame's worth of data, each op writes as much of it as its frame needs
+		size_t largest = 0, i;
+		for (i = 0; i < FRAME_SIZE_COUNT; i++) if (png_data_size(&frame_sizes[i]) > largest) largest = png_data_size(&frame_sizes[i]);
+		memset(expandable_buffer_increase_size(&state.buffer, largest), 0x5a, largest);
+	}
+
+	// One pass first, so the timed ones see buffers that have already grown
+	size_t i;
+	for (i = 0; i < FRAME_SIZE_COUNT; i++) op(&state, i);
+
+	atomic_store(&allocation_count, 0);
+	atomic_store(&bytes_moved, 0);
+	uint64_t ops = 0, bytes = 0;
+	const double start = monotonic_seconds();
+	double elapsed;
+	do {
+		for (i = 0; i < FRAME_SIZE_COUNT; i++) bytes += op(&state, i);
+		ops += FRAME_SIZE_COUNT;
+		elapsed = monotonic_seconds() - start;
+	} while (elapsed < seconds);
+	const uint64_t allocations = atomic_load(&allocation_count);
+	const uint64_t moved = atomic_load(&bytes_moved);
+
+	char label[64];
+	if (idat_chunk_size == 0){
+		snprintf(label, sizeof(label), "%s", name);
+	}else{
+		snprintf(label, sizeof(label), "%s/%zuK", name, idat_chunk_size >> 10);
+	}
+	char throughput[32] = "-";
+	if (bytes != 0) snprintf(throughput, sizeof(throughput), "%.1f", bytes / elapsed / 1e6);
+	printf("%-32s %8llu %12.0f %10s %12.3f %14.0f\n", label, (unsigned long long)ops, elapsed * 1e9 / ops, throughput,
+		   (double)allocations / ops, (double)moved / ops);
+
+	if (state.output != NULL) fclose(state.output);
+	if (state.drain_fd != -1){
+		pthread_join(state.drain_thread, NULL);
+		close(state.drain_fd);
+	}
+	if (state.memfd != -1){
+		free_png_framer(&state.framer);
+		fclose(state.file);
+		close(state.memfd);
+	}
+	free_expandable_buffer(&state.buffer);
+}
+
+int main(int argc, char* argv[]){
+	const char* seconds_text = getenv("MICRO_BENCH_SECONDS");
+	const double seconds = (seconds_text != NULL && atof(seconds_text) > 0) ? atof(seconds_text) : MICRO_BENCH_DEFAULT_SECONDS;
+	init_crc32_table();
+
+	printf("Frame sizes:");
+	size_t i;
+	for (i = 0; i < FRAME_SIZE_COUNT; i++) printf(" %s", frame_sizes[i].name);
+	printf(", PNGs are %.0f%% of rgb24\n", PNG_COMPRESSION_RATIO * 100);
+	printf("%-32s %8s %12s %10s %12s %14s\n", "benchmark", "ops", "ns/op", "MB/s", "allocs/op", "moved B/op");
+	for (i = 0; i < sizeof(idat_chunk_sizes) / sizeof(idat_chunk_sizes[0]); i++){
+		run_bench("increase_size", idat_chunk_sizes[i], increase_size_op, seconds);
+		run_bench("increase_size_fresh", idat_chunk_sizes[i], increase_size_fresh_op, seconds);
+	}
+	for (i = 0; i < sizeof(idat_chunk_sizes) / sizeof(idat_chunk_sizes[0]); i++){
+		run_bench("read_png_in", idat_chunk_sizes[i], read_png_in_op, seconds);
+		run_bench("png_framer_read_in", idat_chunk_sizes[i], png_framer_read_in_op, seconds);
+	}
+	run_bench("write_to_file", 0, write_to_file_op, seconds);
+	run_bench("write_to_pipe", 0, write_to_pipe_op, seconds);
+	return 0;
+}
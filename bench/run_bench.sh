@@ -0,0 +1,62 @@
+#!/bin/bash
+# Runs anime_upscaler end to end against the stub ffmpeg and upscaler in bench_stub.c
+# and reports throughput and the time spent in each stage, read from --metrics-file.
+# BENCH_SIZES, BENCH_FRAMES, BENCH_MODES and BENCH_UPSCALER (nearest or copy) choose what's run.
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+UPSCALER="$BENCH_DIR/../anime_upscaler"
+SIZES=${BENCH_SIZES:-"640x360 1280x720 1920x1080"}
+MODES=${BENCH_MODES:-"png persistent raw cpu"}
+export BENCH_FRAMES=${BENCH_FRAMES:-48}
+export BENCH_UPSCALER=${BENCH_UPSCALER:-nearest}
+
+[ -x "$UPSCALER" ] && [ -x "$BENCH_DIR/bench_stub" ] || {
+	echo "Build anime_upscaler and bench/bench_stub first, make bench does both"
+	exit 1
+}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+mkdir "$WORK_DIR/bin"
+for stub in ffmpeg ffprobe th; do
+	ln -s "$BENCH_DIR/bench_stub" "$WORK_DIR/bin/$stub"
+done
+touch "$WORK_DIR/input.mkv" "$WORK_DIR/waifu2x_worker.lua"
+
+# Reads a counter, or the sum of a histogram, out of the metrics JSON
+function metric() {
+	sed -n -e "s/^  \"$1\": \([0-9]*\),\$/\1/p" -e "s/^  \"$1\": { \"count\": [0-9]*, \"sum\": \([0-9.]*\),.*/\1/p" "$WORK_DIR/metrics.json"
+}
+
+printf "%-10s %-11s %6s %8s %8s %9s %9s | %9s %9s %9s %9s %9s\n" \
+	size mode frames seconds "frames/s" "in MB/s" "out MB/s" "src (s)" "temp" "upscale" "read" "encode"
+for size in $SIZES; do
+	export BENCH_WIDTH=${size%x*} BENCH_HEIGHT=${size#*x}
+	for mode in $MODES; do
+		case $mode in
+			png) flags=() ;;
+			persistent) flags=(--persistent-upscaler) ;;
+			raw) flags=(--raw-transport) ;;
+			cpu) flags=(--backend=cpu) ;;
+			*) echo "Unknown mode $mode, use png, persistent, raw or cpu"; exit 1 ;;
+		esac
+		rm -f "$WORK_DIR/metrics.json" "$WORK_DIR/output.mkv"
+		start=$(date +%s.%N)
+		PATH="$WORK_DIR/bin:$PATH" "$UPSCALER" "${flags[@]}" --waifu2x="$WORK_DIR" --waifu2x-worker="$WORK_DIR/waifu2x_worker.lua" \
+			--metrics-file="$WORK_DIR/metrics.json" -- "$WORK_DIR/input.mkv" "$WORK_DIR/output.mkv" > "$WORK_DIR/log.txt" 2>&1 || {
+			echo "$size $mode failed:"
+			tail -n 20 "$WORK_DIR/log.txt"
+			exit 1
+		}
+		end=$(date +%s.%N)
+
+		awk -v size="$size" -v mode="$mode" -v start="$start" -v end="$end" \
+			-v frames="$(metric frames_encoded_total)" -v source_bytes="$(metric source_bytes_total)" -v result_bytes="$(metric result_bytes_total)" \
+			-v source="$(metric source_read_seconds)" -v temp="$(metric temp_file_batch_write_seconds)" -v upscale="$(metric upscaler_round_seconds)" \
+			-v read="$(metric output_batch_read_seconds)" -v encode="$(metric encoder_write_seconds)" \
+			'BEGIN { seconds = end - start;
+				printf "%-10s %-11s %6d %8.2f %8.1f %9.1f %9.1f | %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+					size, mode, frames, seconds, frames / seconds, source_bytes / seconds / 1e6, result_bytes / seconds / 1e6,
+					source, temp, upscale, read, encode }'
+	done
+done
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <pthread.h>
+
+// Blocks are kept in power of two size classes, so buffers grow geometrically
+#define BUFFER_POOL_CLASS_COUNT 48
+#define BUFFER_POOL_MIN_CLASS 6 // 64 bytes
+#define BUFFER_POOL_MIN_POOLED_CLASS 16 // Smaller blocks go straight back to malloc
+#define BUFFER_POOL_MAX_POOLED (256ULL << 20)
+
+/*
+  Memory behind every expandable_buffer.
+  When a buffer grows, its old block is kept for the next buffer that grows to that size instead of going back to malloc,
+  and everything handed out is counted so the total can be checked against --max-memory.
+*/
+typedef struct {
+	pthread_mutex_t mutex;
+	void* free_blocks[BUFFER_POOL_CLASS_COUNT]; // Each free block starts with a pointer to the next one
+	uint64_t in_use;
+	uint64_t peak_in_use;
+	uint64_t pooled;
+	uint64_t budget; // 0 for no limit
+	int warned_over_budget;
+} buffer_pool;
+
+static buffer_pool frame_buffer_pool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+int buffer_pool_class(uint64_t size){
+	int size_class = BUFFER_POOL_MIN_CLASS;
+	while (size_class < BUFFER_POOL_CLASS_COUNT - 1 && (1ULL << size_class) < size) size_class++;
+	return size_class;
+}
+// The capacity a buffer of this size really gets
+uint64_t buffer_pool_block_size(uint64_t size){
+	return 1ULL << buffer_pool_class(size);
+}
+
+// Allocates at least size bytes, the real size is written to capacity
+void* buffer_pool_alloc(uint64_t size, size_t* capacity){
+	const int size_class = buffer_pool_class(size);
+	const uint64_t block_size = 1ULL << size_class;
+	void* block = NULL;
+
+	pthread_mutex_lock(&frame_buffer_pool.mutex);
+	if (frame_buffer_pool.free_blocks[size_class] != NULL){
+		block = frame_buffer_pool.free_blocks[size_class];
+		frame_buffer_pool.free_blocks[size_class] = *(void**)block;
+		frame_buffer_pool.pooled -= block_size;
+	}
+	frame_buffer_pool.in_use += block_size;
+	if (frame_buffer_pool.in_use > frame_buffer_pool.peak_in_use) frame_buffer_pool.peak_in_use = frame_buffer_pool.in_use;
+	const int over_budget = frame_buffer_pool.budget != 0 && frame_buffer_pool.in_use > frame_buffer_pool.budget && !frame_buffer_pool.warned_over_budget;
+	if (over_budget) frame_buffer_pool.warned_over_budget = 1;
+	pthread_mutex_unlock(&frame_buffer_pool.mutex);
+
+	if (over_budget){
+		fprintf(stderr, "Frame buffers have gone over --max-memory, frames are bigger than estimated\n");
+	}
+	if (block == NULL){
+		block = malloc(block_size);
+		if (block == NULL){
+			fprintf(stderr, "Out of memory allocating a %llu byte buffer\n", (unsigned long long)block_size);
+			exit(1);
+		}
+	}
+	*capacity = block_size;
+	return block;
+}
+
+void buffer_pool_free(void* block, size_t capacity){
+	if (block == NULL) return;
+	const int size_class = buffer_pool_class(capacity);
+	pthread_mutex_lock(&frame_buffer_pool.mutex);
+	frame_buffer_pool.in_use -= capacity;
+	// Only keep blocks worth reusing, and never more than the budget has room for
+	const int keep = size_class >= BUFFER_POOL_MIN_POOLED_CLASS
+		&& frame_buffer_pool.pooled + capacity <= BUFFER_POOL_MAX_POOLED
+		&& (frame_buffer_pool.budget == 0 || frame_buffer_pool.in_use + frame_buffer_pool.pooled + capacity <= frame_buffer_pool.budget);
+	if (keep){
+		*(void**)block = frame_buffer_pool.free_blocks[size_class];
+		frame_buffer_pool.free_blocks[size_class] = block;
+		frame_buffer_pool.pooled += capacity;
+	}
+	pthread_mutex_unlock(&frame_buffer_pool.mutex);
+	if (!keep) free(block);
+}
+
+// Moves the block into one that fits at least size bytes, keeping the first used bytes
+void* buffer_pool_realloc(void* block, size_t capacity, size_t used, uint64_t size, size_t* new_capacity){
+	if (block == NULL) return buffer_pool_alloc(size, new_capacity);
+	if (buffer_pool_block_size(size) <= capacity){
+		*new_capacity = capacity;
+		return block;
+	}
+	void* new_block = buffer_pool_alloc(size, new_capacity);
+	memcpy(new_block, block, used);
+	buffer_pool_free(block, capacity);
+	return new_block;
+}
+
+void buffer_pool_set_budget(uint64_t budget){
+	pthread_mutex_lock(&frame_buffer_pool.mutex);
+	frame_buffer_pool.budget = budget;
+	pthread_mutex_unlock(&frame_buffer_pool.mutex);
+}
+
+uint64_t buffer_pool_in_use(){
+	pthread_mutex_lock(&frame_buffer_pool.mutex);
+	uint64_t in_use = frame_buffer_pool.in_use;
+	pthread_mutex_unlock(&frame_buffer_pool.mutex);
+	return in_use;
+}
+uint64_t buffer_pool_peak_in_use(){
+	pthread_mutex_lock(&frame_buffer_pool.mutex);
+	uint64_t peak = frame_buffer_pool.peak_in_use;
+	pthread_mutex_unlock(&frame_buffer_pool.mutex);
+	return peak;
+}
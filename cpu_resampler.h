@@ -0,0 +1,419 @@
+#include <immintrin.h>
+
+#define MAX_CPU_THREADS 256
+#define RESAMPLE_MAX_TAPS 24
+
+enum { RESAMPLE_BICUBIC, RESAMPLE_LANCZOS };
+static const char* const resample_filter_names[] = { "bicubic", "lanczos" };
+
+/*
+  Where each output pixel along one axis comes from, the filter's taps and their weights.
+  Taps past the edge are clamped to it, so every output pixel has the same number of them.
+*/
+typedef struct {
+	size_t taps;
+	size_t output_size;
+	int* indices; // taps per output pixel
+	float* weights;
+} resample_axis;
+
+// Catmull-Rom, or Lanczos with 3 lobes
+float resample_kernel(int filter, float x){
+	x = fabsf(x);
+	if (filter == RESAMPLE_BICUBIC){
+		if (x < 1.0f) return 1.5f * x * x * x - 2.5f * x * x + 1.0f;
+		if (x < 2.0f) return -0.5f * x * x * x + 2.5f * x * x - 4.0f * x + 2.0f;
+		return 0.0f;
+	}
+	if (x < 1e-6f) return 1.0f;
+	if (x >= 3.0f) return 0.0f;
+	const float pi_x = (float)M_PI * x;
+	return 3.0f * sinf(pi_x) * sinf(pi_x / 3.0f) / (pi_x * pi_x);
+}
+
+int resample_filter_radius(int filter){
+	return (filter == RESAMPLE_BICUBIC) ? 2 : 3;
+}
+
+// Shrinking widens the kernel by the same amount, as far as RESAMPLE_MAX_TAPS goes
+int resampler_can_scale(int filter, size_t input_size, size_t output_size){
+	return input_size <= output_size * (RESAMPLE_MAX_TAPS / 2 / resample_filter_radius(filter));
+}
+
+void init_resample_axis(resample_axis* axis, int filter, size_t input_size, size_t output_size){
+	const float support = (input_size > output_size) ? (float)input_size / output_size : 1.0f;
+	const int radius = (int)ceilf(resample_filter_radius(filter) * support);
+	axis->taps = radius * 2;
+	axis->output_size = output_size;
+	axis->indices = calloc(output_size * axis->taps, sizeof(int));
+	axis->weights = calloc(output_size * axis->taps, sizeof(float));
+	size_t i, tap;
+	for (i = 0; i < output_size; i++){
+		// Pixel centres line up, like ffmpeg's scaler
+		const float center = (i + 0.5f) * input_size / output_size - 0.5f;
+		const int first = (int)floorf(center) - radius + 1;
+		float total = 0.0f;
+		for (tap = 0; tap < axis->taps; tap++){
+			int index = first + (int)tap;
+			const float weight = resample_kernel(filter, (center - index) / support);
+			if (index < 0) index = 0;
+			if (index > (int)input_size - 1) index = input_size - 1;
+			axis->indices[i * axis->taps + tap] = index;
+			axis->weights[i * axis->taps + tap] = weight;
+			total += weight;
+		}
+		for (tap = 0; tap < axis->taps; tap++) axis->weights[i * axis->taps + tap] /= total;
+	}
+}
+void free_resample_axis(resample_axis* axis){
+	free(axis->indices);
+	free(axis->weights);
+}
+
+/*
+  Scales rgb24 frames with a separable filter.
+  Each source row is filtered horizontally once, into a ring of rows that covers the vertical taps,
+  then every output row is a weighted sum of rows in the ring, which is where the AVX2 goes.
+*/
+typedef struct {
+	unsigned int input_width, input_height;
+	unsigned int output_width, output_height;
+	resample_axis horizontal;
+	resample_axis vertical;
+	// The horizontal taps again, expanded per channel and stored tap by tap for gathers
+	int* channel_indices;
+	float* channel_weights;
+	int use_avx2;
+} resampler;
+
+// What each thread needs to resample a frame
+typedef struct {
+	float* input_row;
+	float* rows; // vertical taps rows of output_width * 3
+	int* row_numbers; // Which source row is in each, -1 for none
+} resampler_scratch;
+
+void init_resampler(resampler* r, int filter, unsigned int input_width, unsigned int input_height, unsigned int output_width, unsigned int output_height){
+	r->input_width = input_width;
+	r->input_height = input_height;
+	r->output_width = output_width;
+	r->output_height = output_height;
+	init_resample_axis(&r->horizontal, filter, input_width, output_width);
+	init_resample_axis(&r->vertical, filter, input_height, output_height);
+	// Rows are gathered on the stack, so anything wider has to be turned away by resampler_can_scale first
+	assert(r->horizontal.taps <= RESAMPLE_MAX_TAPS && r->vertical.taps <= RESAMPLE_MAX_TAPS);
+
+	const size_t channel_count = (size_t)output_width * 3;
+	const size_t taps = r->horizontal.taps;
+	r->channel_indices = calloc(channel_count * taps, sizeof(int));
+	r->channel_weights = calloc(channel_count * taps, sizeof(float));
+	size_t i, tap;
+	for (i = 0; i < channel_count; i++){
+		for (tap = 0; tap < taps; tap++){
+			r->channel_indices[tap * channel_count + i] = r->horizontal.indices[(i / 3) * taps + tap] * 3 + i % 3;
+			r->channel_weights[tap * channel_count + i] = r->horizontal.weights[(i / 3) * taps + tap];
+		}
+	}
+	__builtin_cpu_init();
+	r->use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+void free_resampler(resampler* r){
+	free_resample_axis(&r->horizontal);
+	free_resample_axis(&r->vertical);
+	free(r->channel_indices);
+	free(r->channel_weights);
+}
+
+resampler_scratch create_resampler_scratch(resampler* r){
+	resampler_scratch scratch = {
+		.input_row = calloc((size_t)r->input_width * 3, sizeof(float)),
+		.rows = calloc((size_t)r->output_width * 3 * r->vertical.taps, sizeof(float)),
+		.row_numbers = calloc(r->vertical.taps, sizeof(int))
+	};
+	return scratch;
+}
+void free_resampler_scratch(resampler_scratch* scratch){
+	free(scratch->input_row);
+	free(scratch->rows);
+	free(scratch->row_numbers);
+}
+
+void resample_row_horizontal(resampler* r, const float* input, float* output){
+	const size_t channel_count = (size_t)r->output_width * 3;
+	size_t i, tap;
+	for (i = 0; i < channel_count; i++) output[i] = 0.0f;
+	for (tap = 0; tap < r->horizontal.taps; tap++){
+		const int* indices = r->channel_indices + tap * channel_count;
+		const float* weights = r->channel_weights + tap * channel_count;
+		for (i = 0; i < channel_count; i++) output[i] += weights[i] * input[indices[i]];
+	}
+}
+__attribute__((target("avx2,fma")))
+void resample_row_horizontal_avx2(resampler* r, const float* input, float* output){
+	const size_t channel_count = (size_t)r->output_width * 3;
+	size_t i, tap;
+	for (i = 0; i + 8 <= channel_count; i += 8){
+		__m256 sum = _mm256_setzero_ps();
+		for (tap = 0; tap < r->horizontal.taps; tap++){
+			const __m256i indices = _mm256_loadu_si256((const __m256i*)(r->channel_indices + tap * channel_count + i));
+			const __m256 weights = _mm256_loadu_ps(r->channel_weights + tap * channel_count + i);
+			sum = _mm256_fmadd_ps(weights, _mm256_i32gather_ps(input, indices, 4), sum);
+		}
+		_mm256_storeu_ps(output + i, sum);
+	}
+	for (; i < channel_count; i++){
+		float sum = 0.0f;
+		for (tap = 0; tap < r->horizontal.taps; tap++)
+			sum += r->channel_weights[tap * channel_count + i] * input[r->channel_indices[tap * channel_count + i]];
+		output[i] = sum;
+	}
+}
+
+void resample_row_vertical(const float* const* rows, const float* weights, size_t taps, size_t count, BYTE* output){
+	size_t i, tap;
+	for (i = 0; i < count; i++){
+		float sum = 0.0f;
+		for (tap = 0; tap < taps; tap++) sum += weights[tap] * rows[tap][i];
+		const long value = lrintf(sum);
+		output[i] = (value < 0) ? 0 : (value > 255) ? 255 : value;
+	}
+}
+__attribute__((target("avx2,fma")))
+void resample_row_vertical_avx2(const float* const* rows, const float* weights, size_t taps, size_t count, BYTE* output){
+	size_t i, tap;
+	for (i = 0; i + 8 <= count; i += 8){
+		__m256 sum = _mm256_setzero_ps();
+		for (tap = 0; tap < taps; tap++)
+			sum = _mm256_fmadd_ps(_mm256_set1_ps(weights[tap]), _mm256_loadu_ps(rows[tap] + i), sum);
+		// Round, then saturate down to bytes
+		const __m256i values = _mm256_cvtps_epi32(sum);
+		const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+		_mm_storel_epi64((__m128i*)(output + i), _mm_packus_epi16(words, words));
+	}
+	if (i < count){
+		// The last few are left to the scalar version
+		const float* tail_rows[RESAMPLE_MAX_TAPS];
+		for (tap = 0; tap < taps; tap++) tail_rows[tap] = rows[tap] + i;
+		resample_row_vertical(tail_rows, weights, taps, count - i, output + i);
+	}
+}
+
+// Scales input_width x input_height rgb24 pixels into output
+void resample_frame(resampler* r, resampler_scratch* scratch, const BYTE* input, BYTE* output){
+	const size_t input_row_size = (size_t)r->input_width * 3;
+	const size_t output_row_size = (size_t)r->output_width * 3;
+	const size_t taps = r->vertical.taps;
+	const float* rows[RESAMPLE_MAX_TAPS];
+	size_t i, y, tap;
+	for (tap = 0; tap < taps; tap++) scratch->row_numbers[tap] = -1;
+
+	for (y = 0; y < r->output_height; y++){
+		const int* indices = r->vertical.indices + y * taps;
+		for (tap = 0; tap < taps; tap++){
+			// The rows a window covers are consecutive, so they never share a slot
+			const int source_row = indices[tap];
+			float* row = scratch->rows + (source_row % taps) * output_row_size;
+			if (scratch->row_numbers[source_row % taps] != source_row){
+				const BYTE* input_row = input + source_row * input_row_size;
+				for (i = 0; i < input_row_size; i++) scratch->input_row[i] = input_row[i];
+				if (r->use_avx2){
+					resample_row_horizontal_avx2(r, scratch->input_row, row);
+				}else{
+					resample_row_horizontal(r, scratch->input_row, row);
+				}
+				scratch->row_numbers[source_row % taps] = source_row;
+			}
+			rows[tap] = row;
+		}
+		if (r->use_avx2){
+			resample_row_vertical_avx2(rows, r->vertical.weights + y * taps, taps, output_row_size, output + y * output_row_size);
+		}else{
+			resample_row_vertical(rows, r->vertical.weights + y * taps, taps, output_row_size, output + y * output_row_size);
+		}
+	}
+}
+
+/*
+  Upscales frames in this process, straight from their decoded pixels to a PPM in their buffer.
+  Threads are started once and take whole frames of each round off a shared counter,
+  so there's no fork, no temp file and only one round however many times bigger the output is.
+  The same threads take waifu2x's output the rest of the way to the target size when the scale plan needs it.
+*/
+typedef struct {
+	resampler resampler;
+	int from_upscaled; // Scales the PPM the last waifu2x round left in each frame's buffer instead of its decoded pixels
+	size_t thread_count;
+	pthread_t* threads;
+	volatile sig_atomic_t* stop_signalled;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t round_started;
+	pthread_cond_t round_finished;
+	size_t round_number; // Bumped for each round so the threads know there's new work
+	size_t finished_threads;
+	int stopping;
+	_Atomic int failed; // Set by any thread that couldn't scale its frame this round
+
+	temp_frame* frames;
+	const size_t* frame_indices;
+	size_t frame_count;
+	_Atomic size_t next_frame;
+	_Atomic size_t completed_frames;
+	double start_time;
+	int progress_fd; // eventfd poked whenever a frame is done or a thread runs out of them
+} cpu_backend;
+
+void cpu_backend_poke(cpu_backend* cpu){
+	const uint64_t one = 1;
+	if (write(cpu->progress_fd, &one, sizeof(one)) != sizeof(one)) errno = 0;
+}
+
+// spare is swapped with the frame's buffer when the input is in there
+// returns 1 on failure
+int cpu_backend_resample(cpu_backend* cpu, resampler_scratch* scratch, expandable_buffer* spare, temp_frame* frame){
+	resampler* r = &cpu->resampler;
+	const BYTE* input = frame->source_pixels;
+	expandable_buffer* output = &frame->buffer;
+	if (cpu->from_upscaled){
+		const size_t offset = ppm_pixel_offset(&frame->buffer, r->input_width, r->input_height);
+		if (offset == 0){
+			fprintf(stderr, "%s isn't a %ux%u PPM\n", frame->output_filename, r->input_width, r->input_height);
+			return 1;
+		}
+		input = frame->buffer.pointer + offset;
+		output = spare;
+	}
+	char header[PPM_HEADER_MAX_LENGTH];
+	const int header_length = write_ppm_header(header, r->output_width, r->output_height);
+	expandable_buffer_clear(output);
+	BYTE* data = expandable_buffer_increase_size(output, header_length + (size_t)r->output_width * r->output_height * 3);
+	memcpy(data, header, header_length);
+	resample_frame(r, scratch, input, data + header_length);
+	if (output == spare){
+		const expandable_buffer upscaled = frame->buffer;
+		frame->buffer = *spare;
+		*spare = upscaled;
+	}
+	return 0;
+}
+
+void* run_cpu_backend_thread(void* arg){
+	cpu_backend* cpu = arg;
+	resampler_scratch scratch = create_resampler_scratch(&cpu->resampler);
+	expandable_buffer spare = { .pointer = NULL };
+	size_t last_round_number = 0;
+
+	pthread_mutex_lock(&cpu->mutex);
+	while (1){
+		while (!cpu->stopping && cpu->round_number == last_round_number) pthread_cond_wait(&cpu->round_started, &cpu->mutex);
+		if (cpu->stopping) break;
+		last_round_number = cpu->round_number;
+		pthread_mutex_unlock(&cpu->mutex);
+
+		size_t index;
+		while (*cpu->stop_signalled == 0 && (index = atomic_fetch_add(&cpu->next_frame, 1)) < cpu->frame_count){
+			if (cpu_backend_resample(cpu, &scratch, &spare, &cpu->frames[cpu->frame_indices[index]]) != 0) atomic_store(&cpu->failed, 1);
+			atomic_fetch_add(&cpu->completed_frames, 1);
+			cpu_backend_poke(cpu);
+		}
+
+		pthread_mutex_lock(&cpu->mutex);
+		if (++cpu->finished_threads == cpu->thread_count) pthread_cond_signal(&cpu->round_finished);
+		cpu_backend_poke(cpu);
+	}
+	pthread_mutex_unlock(&cpu->mutex);
+	free_resampler_scratch(&scratch);
+	if (spare.pointer != NULL) free_expandable_buffer(&spare);
+	return NULL;
+}
+
+int cpu_backend_submit_batch(upscaler_backend* backend, progress_reactor* reactor, temp_frame* frames, const size_t* frame_indices, size_t frame_count, size_t round){
+	cpu_backend* cpu = backend->state;
+	progress_reactor_watch_workers(reactor, cpu->progress_fd);
+	pthread_mutex_lock(&cpu->mutex);
+	cpu->frames = frames;
+	cpu->frame_indices = frame_indices;
+	cpu->frame_count = frame_count;
+	atomic_store(&cpu->next_frame, 0);
+	atomic_store(&cpu->completed_frames, 0);
+	atomic_store(&cpu->failed, 0);
+	cpu->finished_threads = 0;
+	cpu->start_time = monotonic_seconds();
+	cpu->round_number++;
+	pthread_cond_broadcast(&cpu->round_started);
+	pthread_mutex_unlock(&cpu->mutex);
+	return 0;
+}
+
+int cpu_backend_poll_completions(upscaler_backend* backend, progress_reactor* reactor, upscaler_progress* progress){
+	cpu_backend* cpu = backend->state;
+	progress_reactor_wait(reactor);
+	pthread_mutex_lock(&cpu->mutex);
+	const int finished = (cpu->finished_threads == cpu->thread_count);
+	pthread_mutex_unlock(&cpu->mutex);
+	progress->completed_frames = atomic_load(&cpu->completed_frames);
+	progress->total_frames = cpu->frame_count;
+	const double elapsed_ms = (monotonic_seconds() - cpu->start_time) * 1000.0;
+	snprintf(progress->rate, sizeof(progress->rate), "%.1fms", progress->completed_frames ? elapsed_ms / progress->completed_frames : 0.0);
+	return finished;
+}
+
+int cpu_backend_finish_batch(upscaler_backend* backend, progress_reactor* reactor){
+	cpu_backend* cpu = backend->state;
+	// Polling stops early on a stop signal, the threads still have to be done with the frames
+	pthread_mutex_lock(&cpu->mutex);
+	while (cpu->finished_threads != cpu->thread_count) pthread_cond_wait(&cpu->round_finished, &cpu->mutex);
+	pthread_mutex_unlock(&cpu->mutex);
+	return atomic_load(&cpu->failed);
+}
+
+void cpu_backend_shutdown(upscaler_backend* backend){
+	cpu_backend* cpu = backend->state;
+	pthread_mutex_lock(&cpu->mutex);
+	cpu->stopping = 1;
+	pthread_cond_broadcast(&cpu->round_started);
+	pthread_mutex_unlock(&cpu->mutex);
+	size_t i;
+	for (i = 0; i < cpu->thread_count; i++) pthread_join(cpu->threads[i], NULL);
+	free(cpu->threads);
+	pthread_mutex_destroy(&cpu->mutex);
+	pthread_cond_destroy(&cpu->round_started);
+	pthread_cond_destroy(&cpu->round_finished);
+	close(cpu->progress_fd);
+	free_resampler(&cpu->resampler);
+}
+
+// Starts the threads, so the event loop has to be set up already
+upscaler_backend create_cpu_backend(int filter, size_t thread_count, unsigned int input_width, unsigned int input_height,
+									unsigned int output_width, unsigned int output_height, int from_upscaled,
+									uint64_t settings_hash, volatile sig_atomic_t* stop_signalled){
+	cpu_backend* cpu = calloc(1, sizeof(cpu_backend));
+	init_resampler(&cpu->resampler, filter, input_width, input_height, output_width, output_height);
+	cpu->from_upscaled = from_upscaled;
+	cpu->thread_count = thread_count;
+	cpu->threads = calloc(thread_count, sizeof(pthread_t));
+	cpu->stop_signalled = stop_signalled;
+	pthread_mutex_init(&cpu->mutex, NULL);
+	pthread_cond_init(&cpu->round_started, NULL);
+	pthread_cond_init(&cpu->round_finished, NULL);
+	cpu->progress_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	size_t i;
+	for (i = 0; i < thread_count; i++){
+		if (pthread_create(&cpu->threads[i], NULL, run_cpu_backend_thread, cpu) != 0){
+			fprintf(stderr, "Failed to start resampler thread\n");
+			exit(1);
+		}
+	}
+
+	upscaler_backend backend = {
+		.name = "cpu",
+		.rounds = 1,
+		.settings_hash = settings_hash,
+		.state = cpu,
+		.submit_batch = cpu_backend_submit_batch,
+		.poll_completions = cpu_backend_poll_completions,
+		.finish_batch = cpu_backend_finish_batch,
+		.shutdown = cpu_backend_shutdown
+	};
+	return backend;
+}
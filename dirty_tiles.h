@@ -0,0 +1,94 @@
+#define DIRTY_TILE_SIZE 64
+#define DIRTY_TILE_PADDING 16 // Source pixels of context kept round the changed tiles
+#define DIRTY_TILE_MAX_AREA 0.5 // Any more of the frame than this and it's upscaled whole
+
+/*
+  Frames where only a mouth or some eyes moved are upscaled as just the box round the tiles that changed,
+  then pasted over the upscaled frame before them.
+  The first frame of each batch is always upscaled whole, so a frame never refers back to an earlier batch
+  and changes too small for the tolerance can't build up for longer than a batch.
+*/
+
+// Compares the frames in DIRTY_TILE_SIZE squares and puts the box round the ones that differ by more than tolerance in changed
+// returns 0 if nothing changed
+int find_dirty_tiles(const BYTE* pixels, const BYTE* reference, unsigned int width, unsigned int height, BYTE tolerance, frame_rect* changed){
+	unsigned int left = width, top = height, right = 0, bottom = 0;
+	unsigned int tile_x, tile_y, y;
+	for (tile_y = 0; tile_y < height; tile_y += DIRTY_TILE_SIZE){
+		const unsigned int tile_bottom = (tile_y + DIRTY_TILE_SIZE < height) ? tile_y + DIRTY_TILE_SIZE : height;
+		for (tile_x = 0; tile_x < width; tile_x += DIRTY_TILE_SIZE){
+			const unsigned int tile_right = (tile_x + DIRTY_TILE_SIZE < width) ? tile_x + DIRTY_TILE_SIZE : width;
+			// Already inside the box, so it can't make it any bigger
+			if (tile_x >= left && tile_right <= right && tile_y >= top && tile_bottom <= bottom) continue;
+			for (y = tile_y; y < tile_bottom; y++){
+				const size_t offset = ((size_t)y * width + tile_x) * 3;
+				if (!frame_data_within_tolerance(pixels + offset, reference + offset, (size_t)(tile_right - tile_x) * 3, tolerance)) break;
+			}
+			if (y == tile_bottom) continue;
+			if (tile_x < left) left = tile_x;
+			if (tile_y < top) top = tile_y;
+			if (tile_right > right) right = tile_right;
+			if (tile_bottom > bottom) bottom = tile_bottom;
+		}
+	}
+	if (right == 0) return 0;
+	changed->x = left;
+	changed->y = top;
+	changed->width = right - left;
+	changed->height = bottom - top;
+	return 1;
+}
+
+// The changed box with DIRTY_TILE_PADDING round it, kept inside the frame
+frame_rect pad_dirty_tiles(const frame_rect* changed, unsigned int width, unsigned int height){
+	const unsigned int left = (changed->x > DIRTY_TILE_PADDING) ? changed->x - DIRTY_TILE_PADDING : 0;
+	const unsigned int top = (changed->y > DIRTY_TILE_PADDING) ? changed->y - DIRTY_TILE_PADDING : 0;
+	const unsigned int right = (changed->x + changed->width + DIRTY_TILE_PADDING < width) ? changed->x + changed->width + DIRTY_TILE_PADDING : width;
+	const unsigned int bottom = (changed->y + changed->height + DIRTY_TILE_PADDING < height) ? changed->y + changed->height + DIRTY_TILE_PADDING : height;
+	frame_rect crop = { .x = left, .y = top, .width = right - left, .height = bottom - top };
+	return crop;
+}
+
+// Fills the buffer with the crop of the frame as a PPM, for the upscaler
+void crop_dirty_tiles(expandable_buffer* buffer, const BYTE* pixels, unsigned int width, const frame_rect* crop){
+	char header[PPM_HEADER_MAX_LENGTH];
+	const int header_length = write_ppm_header(header, crop->width, crop->height);
+	const size_t row_size = (size_t)crop->width * 3;
+	expandable_buffer_clear(buffer);
+	memcpy(expandable_buffer_increase_size(buffer, header_length), header, header_length);
+	BYTE* rows = expandable_buffer_increase_size(buffer, row_size * crop->height);
+	unsigned int y;
+	for (y = 0; y < crop->height; y++)
+		memcpy(rows + y * row_size, pixels + (((size_t)(crop->y + y) * width) + crop->x) * 3, row_size);
+}
+
+/*
+  Replaces the frame's upscaled crop with a copy of the reference's upscaled frame that has the changed part pasted over it.
+  scratch is swapped with the frame's buffer so nothing is allocated once it's big enough.
+  returns 1 if the upscaled crop or the reference isn't the size it should be
+*/
+int composite_dirty_tiles(temp_frame* frame, const expandable_buffer* reference, expandable_buffer* scratch, unsigned int width, unsigned int height, unsigned int scale){
+	const unsigned int crop_width = frame->crop.width * scale;
+	const size_t crop_offset = ppm_pixel_offset(&frame->buffer, crop_width, frame->crop.height * scale);
+	if (crop_offset == 0) return 1;
+
+	expandable_buffer_clear(scratch);
+	memcpy(expandable_buffer_increase_size(scratch, reference->size), reference->pointer, reference->size);
+	const size_t offset = ppm_pixel_offset(scratch, width, height);
+	if (offset == 0) return 1;
+
+	// Only the changed part is pasted, the padding round it was just there for context
+	const size_t row_size = (size_t)frame->changed.width * scale * 3;
+	const unsigned int crop_left = (frame->changed.x - frame->crop.x) * scale;
+	const unsigned int crop_top = (frame->changed.y - frame->crop.y) * scale;
+	unsigned int y;
+	for (y = 0; y < frame->changed.height * scale; y++){
+		memcpy(scratch->pointer + offset + (((size_t)(frame->changed.y * scale + y) * width) + frame->changed.x * scale) * 3,
+			   frame->buffer.pointer + crop_offset + (((size_t)(crop_top + y) * crop_width) + crop_left) * 3, row_size);
+	}
+
+	expandable_buffer swap = frame->buffer;
+	frame->buffer = *scratch;
+	*scratch = swap;
+	return 0;
+}
@@ -8,16 +8,14 @@ typedef struct {
 	BYTE* pointer;
 } expandable_buffer;
 
+// Memory comes from the buffer pool, so capacity is always a power of two
 expandable_buffer create_expandable_buffer(size_t starting_capacity){
-	expandable_buffer buffer = {
-		.capacity = starting_capacity,
-		.size = 0,
-		.pointer = (BYTE*)malloc(sizeof(BYTE) * starting_capacity)
-	};
+	expandable_buffer buffer = { .size = 0 };
+	buffer.pointer = (BYTE*)buffer_pool_alloc(starting_capacity, &buffer.capacity);
 	return buffer;
 }
 void free_expandable_buffer(expandable_buffer* buffer){
-	free(buffer->pointer);
+	buffer_pool_free(buffer->pointer, buffer->capacity);
 	buffer->size = 0;
 	buffer->capacity = 0;
 	buffer->pointer = NULL;
@@ -35,11 +33,10 @@ BYTE* expandable_buffer_increase_size(expandable_buffer* buffer, size_t size_del
 	size_t old_size = buffer->size;
 	
 	buffer->size += size_delta;
-	if (buffer->size > buffer->capacity){
-		size_t old_capacity = buffer->capacity;
-		buffer->capacity = buffer->size - (buffer->size % 8) + 8;
+	if (buffer->size > buffer->capacity || buffer->pointer == NULL){
+		// Grows to the next power of two, so a frame built up chunk by chunk only moves a few times
+		buffer->pointer = (BYTE*)buffer_pool_realloc(buffer->pointer, buffer->capacity, old_size, buffer->size, &buffer->capacity);
 		assert(buffer->capacity >= buffer->size);
-		buffer->pointer = (BYTE*)realloc(buffer->pointer, buffer->capacity);
 	}
 
 	return buffer->pointer + old_size;
@@ -51,6 +48,21 @@ int expandable_buffer_read_data_in(expandable_buffer* buffer, FILE* in, size_t s
 	return fread(data_start, 1, size, in);
 }
 
+// Reads everything left in the FILE* into the buffer, replacing what was there
+// returns 1 if unsuccessful
+int expandable_buffer_read_file_in(expandable_buffer* buffer, FILE* in){
+	const size_t READ_SIZE = 1 << 16;
+
+	expandable_buffer_clear(buffer);
+	while(1){
+		size_t total_read = expandable_buffer_read_data_in(buffer, in, READ_SIZE);
+		// Only keep what was actually read
+		buffer->size -= READ_SIZE - total_read;
+		if (total_read < READ_SIZE) break;
+	}
+	return ferror(in) ? 1 : 0;
+}
+
 void expandable_buffer_push_file_end(expandable_buffer* buffer){
 	BYTE* data_start = expandable_buffer_increase_size(buffer, 1);
 	*data_start = '\0';
@@ -91,7 +103,8 @@ int expandable_buffer_read_png_in(expandable_buffer* buffer, FILE* in){
 	}
 	//expandable_buffer_print(buffer);
 
-	char chunk_name[CHUNK_NAME_SIZE + 1] = {'\0'};
+	char chunk_name[CHUNK_NAME_SIZE + 1];
+	memset(chunk_name, 0, sizeof(chunk_name));
 	do {
 		if (expandable_buffer_read_data_in(buffer, in, CHUNK_LENGTH_SIZE) != CHUNK_LENGTH_SIZE){
 			fprintf(stderr, "problem reading chunk length\n");
@@ -148,14 +161,17 @@ int expandable_buffer_write_to_file(expandable_buffer* buffer, FILE* out){
 	
 	return 0;
 }
-void expandable_buffer_write_to_pipe(expandable_buffer* buffer, FILE* out){
-	BYTE* pointer = buffer->pointer;
-	size_t size_left = buffer->size;
+void write_to_pipe(const BYTE* pointer, size_t size_left, FILE* out){
 	while(size_left > 0) {
 		size_t total_written = fwrite(pointer, sizeof(pointer[0]), size_left, out);
 		pointer += total_written;
 		size_left -= total_written;
 
+		// The encoder exits when we're interrupted, so it can go away mid-frame
+		if (size_left != 0 && ferror(out) && errno == EPIPE){
+			clearerr(out);
+			return;
+		}
 		assert(size_left == 0);
 		if (ferror(out)){
 			clearerr(out);
@@ -170,6 +186,9 @@ void expandable_buffer_write_to_pipe(expandable_buffer* buffer, FILE* out){
 		}
 	}
 }
+void expandable_buffer_write_to_pipe(expandable_buffer* buffer, FILE* out){
+	write_to_pipe(buffer->pointer, buffer->size, out);
+}
 
 void expandable_buffer_print(expandable_buffer* buffer){
 	fprintf(stdout, "Buffer Pointer: %p\nBuffer Size: %zu\nBuffer Capacity: %zu\n", buffer->pointer, buffer->size, buffer->capacity);
@@ -0,0 +1,73 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FRAME_HASH_PRIME_1 0x9E3779B185EBCA87ULL
+#define FRAME_HASH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define FRAME_HASH_PRIME_3 0x165667B19E3779F9ULL
+#define FRAME_HASH_PRIME_4 0x85EBCA77C2B2AE63ULL
+
+uint64_t rotate_left_64(uint64_t value, int amount){
+	return (value << amount) | (value >> (64 - amount));
+}
+
+// xxHash64 style hash, four independent lanes so it runs at memory speed on whole frames
+uint64_t hash_frame_data(const BYTE* data, size_t size){
+	uint64_t lanes[4] = {
+		FRAME_HASH_PRIME_1 + FRAME_HASH_PRIME_2,
+		FRAME_HASH_PRIME_2,
+		0,
+		-FRAME_HASH_PRIME_1
+	};
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32){
+		int lane;
+		for (lane = 0; lane < 4; lane++){
+			uint64_t word;
+			memcpy(&word, data + i + lane * 8, sizeof(word));
+			lanes[lane] = rotate_left_64(lanes[lane] + word * FRAME_HASH_PRIME_2, 31) * FRAME_HASH_PRIME_1;
+		}
+	}
+	uint64_t hash = rotate_left_64(lanes[0], 1) + rotate_left_64(lanes[1], 7)
+		+ rotate_left_64(lanes[2], 12) + rotate_left_64(lanes[3], 18);
+	for (; i < size; i++){
+		hash ^= data[i] * FRAME_HASH_PRIME_4;
+		hash = rotate_left_64(hash, 11) * FRAME_HASH_PRIME_1;
+	}
+	hash ^= size;
+
+	hash ^= hash >> 33;
+	hash *= FRAME_HASH_PRIME_2;
+	hash ^= hash >> 29;
+	hash *= FRAME_HASH_PRIME_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// Checks that no byte differs by more than tolerance, stopping at the first one that does
+// returns 1 if the data is within tolerance
+int frame_data_within_tolerance(const BYTE* a, const BYTE* b, size_t size, BYTE tolerance){
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i limit = _mm_set1_epi8((char)tolerance);
+	for (; i + 64 <= size; i += 64){
+		__m128i worst = _mm_setzero_si128();
+		int block;
+		for (block = 0; block < 4; block++){
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + i + block * 16));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + i + block * 16));
+			// |a - b| for unsigned bytes
+			__m128i difference = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+			worst = _mm_max_epu8(worst, difference);
+		}
+		// Any byte where worst > limit survives the saturating subtract
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(worst, limit), _mm_setzero_si128())) != 0xFFFF)
+			return 0;
+	}
+#endif
+	for (; i < size; i++){
+		int difference = (int)a[i] - (int)b[i];
+		if (difference > tolerance || -difference > tolerance) return 0;
+	}
+	return 1;
+}
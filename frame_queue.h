@@ -0,0 +1,92 @@
+// Each worker owns a contiguous shard of the batch's frame indices and takes from the front of it,
+// once a worker runs dry it steals from the back of whichever shard has the most left
+typedef struct {
+	size_t* indices;
+	size_t head;
+	size_t tail;
+	pthread_mutex_t mutex;
+} frame_deque;
+
+typedef struct {
+	frame_deque* deques;
+	size_t deque_count;
+	size_t capacity;
+} work_stealing_queue;
+
+void init_work_stealing_queue(work_stealing_queue* queue, size_t deque_count, size_t capacity){
+	queue->deques = calloc(deque_count, sizeof(frame_deque));
+	queue->deque_count = deque_count;
+	queue->capacity = capacity;
+	size_t i;
+	for (i = 0; i < deque_count; i++){
+		queue->deques[i].indices = calloc(capacity, sizeof(size_t));
+		queue->deques[i].head = 0;
+		queue->deques[i].tail = 0;
+		pthread_mutex_init(&queue->deques[i].mutex, NULL);
+	}
+}
+void free_work_stealing_queue(work_stealing_queue* queue){
+	size_t i;
+	for (i = 0; i < queue->deque_count; i++){
+		free(queue->deques[i].indices);
+		pthread_mutex_destroy(&queue->deques[i].mutex);
+	}
+	free(queue->deques);
+	queue->deques = NULL;
+	queue->deque_count = 0;
+}
+
+// Shards the frame indices evenly over the deques, keeping neighbouring frames together
+// Must not be called while workers are taking from the queue
+void work_stealing_queue_fill(work_stealing_queue* queue, const size_t* frame_indices, size_t frame_count){
+	assert(frame_count <= queue->capacity * queue->deque_count);
+	size_t next_frame = 0;
+	size_t i;
+	for (i = 0; i < queue->deque_count; i++){
+		frame_deque* deque = &queue->deques[i];
+		size_t shard_size = frame_count / queue->deque_count + (i < frame_count % queue->deque_count ? 1 : 0);
+		deque->head = 0;
+		deque->tail = 0;
+		while (deque->tail < shard_size) deque->indices[deque->tail++] = frame_indices[next_frame++];
+	}
+}
+
+// Gets the next frame for the given worker
+// returns 1 once every deque is empty
+int work_stealing_queue_take(work_stealing_queue* queue, size_t deque_index, size_t* frame_index){
+	frame_deque* own = &queue->deques[deque_index];
+	pthread_mutex_lock(&own->mutex);
+	if (own->head < own->tail){
+		*frame_index = own->indices[own->head++];
+		pthread_mutex_unlock(&own->mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&own->mutex);
+
+	while (1){
+		// Pick the victim with the most work left, its back end is furthest from what its owner is doing
+		frame_deque* victim = NULL;
+		size_t victim_size = 0;
+		size_t i;
+		for (i = 0; i < queue->deque_count; i++){
+			frame_deque* deque = &queue->deques[i];
+			pthread_mutex_lock(&deque->mutex);
+			size_t size = deque->tail - deque->head;
+			pthread_mutex_unlock(&deque->mutex);
+			if (size > victim_size){
+				victim = deque;
+				victim_size = size;
+			}
+		}
+		if (victim == NULL) return 1;
+
+		pthread_mutex_lock(&victim->mutex);
+		if (victim->head < victim->tail){
+			*frame_index = victim->indices[--victim->tail];
+			pthread_mutex_unlock(&victim->mutex);
+			return 0;
+		}
+		// Someone else got there first, look again
+		pthread_mutex_unlock(&victim->mutex);
+	}
+}
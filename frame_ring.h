@@ -0,0 +1,141 @@
+#include <sys/mman.h>
+#include <pthread.h>
+
+/*
+  Fixed-size frame slots in one shared memory mapping,
+  used when ffmpeg sends rawvideo so frame boundaries are known ahead of time.
+  Slots are taken in order by the decoder and given back in order by the encoder.
+*/
+typedef struct {
+	BYTE* slots;
+	size_t slot_size;
+	size_t slot_count;
+	size_t mapping_size;
+
+	size_t head; // Next slot to be taken
+	size_t used;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t slot_released;
+} frame_ring;
+
+void init_frame_ring(frame_ring* ring, size_t slot_size, size_t slot_count){
+	int file_descriptor = memfd_create("anime-upscaler-frame-ring", MFD_CLOEXEC);
+	if (file_descriptor == -1){
+		fprintf(stderr, "Failed to create frame ring: %s\n", strerror(errno));
+		exit(1);
+	}
+	ring->slot_size = slot_size;
+	ring->slot_count = slot_count;
+	ring->mapping_size = slot_size * slot_count;
+	if (ftruncate(file_descriptor, ring->mapping_size) != 0){
+		fprintf(stderr, "Failed to size frame ring to %zu bytes: %s\n", ring->mapping_size, strerror(errno));
+		exit(1);
+	}
+	ring->slots = mmap(NULL, ring->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+	close(file_descriptor); // The mapping keeps the memory alive
+	if (ring->slots == MAP_FAILED){
+		fprintf(stderr, "Failed to map frame ring: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	ring->head = 0;
+	ring->used = 0;
+	ring->closed = 0;
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->slot_released, NULL);
+}
+void free_frame_ring(frame_ring* ring){
+	if (ring->slots == NULL) return;
+	munmap(ring->slots, ring->mapping_size);
+	ring->slots = NULL;
+	pthread_mutex_destroy(&ring->mutex);
+	pthread_cond_destroy(&ring->slot_released);
+}
+
+// Blocks until a slot is free
+// returns NULL if the ring was closed
+BYTE* frame_ring_acquire(frame_ring* ring){
+	pthread_mutex_lock(&ring->mutex);
+	while (ring->used == ring->slot_count && !ring->closed)
+		pthread_cond_wait(&ring->slot_released, &ring->mutex);
+	BYTE* slot = NULL;
+	if (!ring->closed){
+		slot = ring->slots + (ring->head * ring->slot_size);
+		ring->head = (ring->head + 1) % ring->slot_count;
+		ring->used++;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+	return slot;
+}
+
+// Gives back the oldest slots
+void frame_ring_release(frame_ring* ring, size_t slot_count){
+	pthread_mutex_lock(&ring->mutex);
+	assert(slot_count <= ring->used);
+	ring->used -= slot_count;
+	pthread_cond_broadcast(&ring->slot_released);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+// Hands back the most recently taken slot, for when the stream ends before it was filled
+void frame_ring_cancel_last(frame_ring* ring){
+	pthread_mutex_lock(&ring->mutex);
+	assert(ring->used > 0);
+	ring->head = (ring->head + ring->slot_count - 1) % ring->slot_count;
+	ring->used--;
+	pthread_cond_broadcast(&ring->slot_released);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+void frame_ring_close(frame_ring* ring){
+	pthread_mutex_lock(&ring->mutex);
+	ring->closed = 1;
+	pthread_cond_broadcast(&ring->slot_released);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+// Reads exactly one frame from ffmpeg into the slot
+// returns 1 if the stream ended
+int frame_ring_read_frame_in(frame_ring* ring, BYTE* slot, FILE* in){
+	size_t total_read = fread(slot, 1, ring->slot_size, in);
+	if (total_read == ring->slot_size) return 0;
+	if (total_read != 0) fprintf(stderr, "Source ended part way through a frame\n");
+	return 1;
+}
+
+/*
+  Upscalers are given frames as binary PPMs, which is just a short header in front of the rgb24 pixels
+*/
+#define PPM_HEADER_MAX_LENGTH 32
+
+int write_ppm_header(char* header, unsigned int width, unsigned int height){
+	return snprintf(header, PPM_HEADER_MAX_LENGTH, "P6\n%u %u\n255\n", width, height);
+}
+
+// Writes the pixels out as a PPM file
+int write_ppm_file(const char* filename, BYTE* pixels, unsigned int width, unsigned int height){
+	char header[PPM_HEADER_MAX_LENGTH];
+	int header_length = write_ppm_header(header, width, height);
+	FILE* out = fopen(filename, "wb");
+	if (out == NULL) return 1;
+	int failed = fwrite(header, 1, header_length, out) != header_length
+		|| fwrite(pixels, 1, (size_t)width * height * 3, out) != (size_t)width * height * 3;
+	failed |= fclose(out) != 0;
+	return failed;
+}
+
+// Finds where the pixels start in a buffer holding a whole PPM file
+// returns 0 if it isn't a PPM of the expected size
+size_t ppm_pixel_offset(expandable_buffer* buffer, unsigned int width, unsigned int height){
+	char header[PPM_HEADER_MAX_LENGTH + 1] = {'\0'};
+	memcpy(header, buffer->pointer, buffer->size < PPM_HEADER_MAX_LENGTH ? buffer->size : PPM_HEADER_MAX_LENGTH);
+
+	unsigned int ppm_width, ppm_height, ppm_max_value;
+	int header_length = 0;
+	if (sscanf(header, "P6 %u %u %u%n", &ppm_width, &ppm_height, &ppm_max_value, &header_length) != 3) return 0;
+	header_length++; // Single whitespace after the max value
+	if (ppm_width != width || ppm_height != height || ppm_max_value != 255) return 0;
+	if (buffer->size != header_length + (size_t)width * height * 3) return 0;
+	return header_length;
+}
@@ -0,0 +1,389 @@
+#define PROBE_CACHE_FILE TEMP_DIR "probe-cache"
+#define PROBE_CACHE_MAX_ENTRIES 256 // Past this the cache starts again from empty
+#define PROBE_MAX_MOOV_SIZE (64 << 20)
+
+// What we need to know about the first video stream, the framerate kept as a fraction like ffprobe gives it
+typedef struct {
+	unsigned int width;
+	unsigned int height;
+	float framerate_numerator;
+	float framerate_denominator;
+} media_probe;
+
+uint64_t probe_gcd(uint64_t a, uint64_t b){
+	while (b != 0){
+		const uint64_t remainder = a % b;
+		a = b;
+		b = remainder;
+	}
+	return a;
+}
+
+// Frames of frame_duration ticks in a timescale of ticks per second, snapped to n/1001 rates like ffprobe reports when it's that close
+void probe_set_framerate(media_probe* probe, uint64_t timescale, uint64_t frame_duration){
+	const double framerate = (double)timescale / frame_duration;
+	const double ntsc_numerator = round(framerate * 1001);
+	if (fmod(ntsc_numerator, 1000) == 0 && fabs(ntsc_numerator / 1001 - framerate) < framerate * 1e-6){
+		probe->framerate_numerator = ntsc_numerator;
+		probe->framerate_denominator = 1001;
+		return;
+	}
+	const uint64_t divisor = probe_gcd(timescale, frame_duration);
+	probe->framerate_numerator = timescale / divisor;
+	probe->framerate_denominator = frame_duration / divisor;
+}
+
+uint64_t probe_read_big_endian(const BYTE* data, size_t size){
+	uint64_t value = 0;
+	size_t i;
+	for (i = 0; i < size; i++) value = (value << 8) | data[i];
+	return value;
+}
+
+/*
+  Matroska is a tree of EBML elements, each an ID and a size as variable length integers then the data.
+  Tracks comes before the first Cluster, and only the start of that Cluster is read, to check DefaultDuration against.
+*/
+#define EBML_ID_SEGMENT 0x18538067
+#define EBML_ID_INFO 0x1549A966
+#define EBML_ID_TIMESTAMP_SCALE 0x2AD7B1
+#define EBML_ID_TRACKS 0x1654AE6B
+#define EBML_ID_CLUSTER 0x1F43B675
+#define EBML_ID_CLUSTER_TIMESTAMP 0xE7
+#define EBML_ID_BLOCK_GROUP 0xA0
+#define EBML_ID_BLOCK 0xA1
+#define EBML_ID_SIMPLE_BLOCK 0xA3
+#define EBML_ID_TRACK_ENTRY 0xAE
+#define EBML_ID_TRACK_NUMBER 0xD7
+#define EBML_ID_TRACK_TYPE 0x83
+#define EBML_ID_DEFAULT_DURATION 0x23E383
+#define EBML_ID_VIDEO 0xE0
+#define EBML_ID_PIXEL_WIDTH 0xB0
+#define EBML_ID_PIXEL_HEIGHT 0xBA
+#define EBML_UNKNOWN_SIZE UINT64_MAX
+#define MATROSKA_TRACK_TYPE_VIDEO 1
+#define MATROSKA_DEFAULT_TIMESTAMP_SCALE 1000000
+#define MATROSKA_CHECKED_BLOCKS 64 // Video blocks at the start of the first Cluster that have to be DefaultDuration apart
+#define MATROSKA_MIN_CHECKED_BLOCKS 3
+#define MATROSKA_MAX_REORDER 16 // Blocks are in decode order, so frames read later can still come before the last few read
+
+// Reads a variable length integer, keeping the length marker for IDs
+// returns 1 at the end of the file or if it's invalid
+int ebml_read_vint(FILE* file, uint64_t* value, int keep_marker){
+	const int first = fgetc(file);
+	if (first == EOF || first == 0) return 1;
+	int length = 1;
+	while (!(first & (0x80 >> (length - 1)))) length++;
+	uint64_t result = keep_marker ? first : (first & (0xFF >> length));
+	int all_ones = (result == (uint64_t)(0xFF >> length));
+	int i;
+	for (i = 1; i < length; i++){
+		const int next = fgetc(file);
+		if (next == EOF) return 1;
+		result = (result << 8) | next;
+		if (next != 0xFF) all_ones = 0;
+	}
+	*value = (!keep_marker && all_ones) ? EBML_UNKNOWN_SIZE : result;
+	return 0;
+}
+
+int ebml_read_element(FILE* file, uint64_t* id, uint64_t* size){
+	return ebml_read_vint(file, id, 1) != 0 || ebml_read_vint(file, size, 0) != 0;
+}
+
+uint64_t ebml_read_uint(FILE* file, uint64_t size){
+	BYTE data[8] = {0};
+	if (size > 8 || fread(data, 1, size, file) != size) return 0;
+	return probe_read_big_endian(data, size);
+}
+
+// Looks through the children of a TrackEntry ending at end
+// returns 1 unless it's a video track with a default frame duration
+int probe_matroska_track(FILE* file, long end, media_probe* probe, uint64_t* track_number, uint64_t* default_duration){
+	uint64_t id, size;
+	uint64_t track_type = 0;
+	*track_number = 0;
+	*default_duration = 0;
+	while (ftell(file) < end && ebml_read_element(file, &id, &size) == 0){
+		if (size == EBML_UNKNOWN_SIZE) return 1;
+		if (id == EBML_ID_VIDEO) continue; // Its children are what we want
+		const long next = ftell(file) + size;
+		if (id == EBML_ID_TRACK_TYPE) track_type = ebml_read_uint(file, size);
+		else if (id == EBML_ID_TRACK_NUMBER) *track_number = ebml_read_uint(file, size);
+		else if (id == EBML_ID_DEFAULT_DURATION) *default_duration = ebml_read_uint(file, size);
+		else if (id == EBML_ID_PIXEL_WIDTH) probe->width = ebml_read_uint(file, size);
+		else if (id == EBML_ID_PIXEL_HEIGHT) probe->height = ebml_read_uint(file, size);
+		fseek(file, next, SEEK_SET);
+	}
+	return track_type != MATROSKA_TRACK_TYPE_VIDEO || *track_number == 0 || *default_duration == 0 || probe->width == 0 || probe->height == 0;
+}
+
+int compare_matroska_timestamps(const void* a, const void* b){
+	const int64_t a_timestamp = *(const int64_t*)a;
+	const int64_t b_timestamp = *(const int64_t*)b;
+	return (a_timestamp > b_timestamp) - (a_timestamp < b_timestamp);
+}
+
+// DefaultDuration is only a hint, variable framerate files often have one too,
+// so the track's blocks in the Cluster ending at end have to agree with it
+// returns 1 if they don't, or there aren't enough of them to tell
+int matroska_check_default_duration(FILE* file, long end, uint64_t track_number, uint64_t default_duration, uint64_t timestamp_scale){
+	int64_t timestamps[MATROSKA_CHECKED_BLOCKS];
+	size_t timestamp_count = 0;
+	int64_t cluster_timestamp = 0;
+	uint64_t id, size;
+	while (timestamp_count < MATROSKA_CHECKED_BLOCKS && ftell(file) < end && ebml_read_element(file, &id, &size) == 0){
+		if (id == EBML_ID_CLUSTER) break; // The next one, when this one's size is unknown
+		if (size == EBML_UNKNOWN_SIZE) return 1;
+		if (id == EBML_ID_BLOCK_GROUP) continue; // Its Block is what we want
+		const long next = ftell(file) + size;
+		if (id == EBML_ID_CLUSTER_TIMESTAMP){
+			cluster_timestamp = ebml_read_uint(file, size);
+		}else if (id == EBML_ID_SIMPLE_BLOCK || id == EBML_ID_BLOCK){
+			// The track number, a timestamp relative to the Cluster's then the flags
+			uint64_t block_track;
+			BYTE header[3];
+			if (ebml_read_vint(file, &block_track, 0) != 0 || fread(header, 1, 3, file) != 3) return 1;
+			if (block_track == track_number){
+				if (header[2] & 0x06) return 1; // Laced, so more than one frame with only the first's timestamp
+				timestamps[timestamp_count++] = cluster_timestamp + (int16_t)probe_read_big_endian(header, 2);
+			}
+		}
+		fseek(file, next, SEEK_SET);
+	}
+	if (timestamp_count == MATROSKA_CHECKED_BLOCKS) timestamp_count -= MATROSKA_MAX_REORDER;
+	if (timestamp_count < MATROSKA_MIN_CHECKED_BLOCKS) return 1;
+
+	qsort(timestamps, timestamp_count, sizeof(int64_t), compare_matroska_timestamps);
+	size_t i;
+	for (i = 1; i < timestamp_count; i++){
+		// Each timestamp is rounded to the scale, so the gap between two can be a tick out either way
+		const double gap = (double)(timestamps[i] - timestamps[i - 1]) * timestamp_scale;
+		if (fabs(gap - (double)default_duration) > timestamp_scale) return 1;
+	}
+	return 0;
+}
+
+// returns 1 if it isn't Matroska or the first video track has no fixed frame duration
+int probe_matroska(FILE* file, media_probe* probe){
+	uint64_t id, size;
+	if (ebml_read_element(file, &id, &size) != 0 || id != 0x1A45DFA3 || size == EBML_UNKNOWN_SIZE) return 1;
+	fseek(file, size, SEEK_CUR);
+	if (ebml_read_element(file, &id, &size) != 0 || id != EBML_ID_SEGMENT) return 1;
+	uint64_t timestamp_scale = MATROSKA_DEFAULT_TIMESTAMP_SCALE;
+	uint64_t track_number = 0, default_duration = 0;
+	while (ebml_read_element(file, &id, &size) == 0){
+		const long end = (size == EBML_UNKNOWN_SIZE) ? LONG_MAX : ftell(file) + size;
+		if (id == EBML_ID_CLUSTER){
+			if (track_number == 0 || timestamp_scale == 0
+				|| matroska_check_default_duration(file, end, track_number, default_duration, timestamp_scale) != 0) return 1;
+			probe_set_framerate(probe, 1000000000, default_duration);
+			return 0;
+		}
+		if (size == EBML_UNKNOWN_SIZE) return 1;
+		if (id == EBML_ID_INFO){
+			while (ftell(file) < end && ebml_read_element(file, &id, &size) == 0){
+				if (size == EBML_UNKNOWN_SIZE) return 1;
+				const long next = ftell(file) + size;
+				if (id == EBML_ID_TIMESTAMP_SCALE) timestamp_scale = ebml_read_uint(file, size);
+				fseek(file, next, SEEK_SET);
+			}
+		}else if (id == EBML_ID_TRACKS){
+			while (ftell(file) < end && ebml_read_element(file, &id, &size) == 0){
+				if (size == EBML_UNKNOWN_SIZE) return 1;
+				const long track_end = ftell(file) + size;
+				if (id == EBML_ID_TRACK_ENTRY){
+					memset(probe, 0, sizeof(media_probe));
+					if (probe_matroska_track(file, track_end, probe, &track_number, &default_duration) == 0) break;
+					track_number = 0;
+					// The first video track is v:0, whether it's usable or not
+					if (probe->width != 0) return 1;
+				}
+				fseek(file, track_end, SEEK_SET);
+			}
+			if (track_number == 0) return 1;
+		}
+		fseek(file, end, SEEK_SET);
+	}
+	return 1;
+}
+
+/*
+  MP4 is a tree of boxes, each a 32 bit size and a type then the data.
+  All of moov is read in, which can be at the end of the file.
+*/
+// Finds the child box of the given type in data, putting its contents in box and box_size
+// returns 1 if there isn't one
+int mp4_find_box(const BYTE* data, size_t size, const char* type, const BYTE** box, size_t* box_size){
+	size_t offset = 0;
+	while (offset + 8 <= size){
+		uint64_t length = probe_read_big_endian(data + offset, 4);
+		size_t header_length = 8;
+		if (length == 1 && offset + 16 <= size){
+			length = probe_read_big_endian(data + offset + 8, 8);
+			header_length = 16;
+		}else if (length == 0){
+			length = size - offset;
+		}
+		if (length < header_length || length > size - offset) return 1;
+		if (memcmp(data + offset + 4, type, 4) == 0){
+			*box = data + offset + header_length;
+			*box_size = length - header_length;
+			return 0;
+		}
+		offset += length;
+	}
+	return 1;
+}
+
+// returns 1 if the track isn't video or its frames aren't all the same length
+int probe_mp4_track(const BYTE* trak, size_t trak_size, media_probe* probe){
+	const BYTE *mdia, *hdlr, *mdhd, *minf, *stbl, *stsd, *stts;
+	size_t mdia_size, hdlr_size, mdhd_size, minf_size, stbl_size, stsd_size, stts_size;
+	if (mp4_find_box(trak, trak_size, "mdia", &mdia, &mdia_size) != 0
+		|| mp4_find_box(mdia, mdia_size, "hdlr", &hdlr, &hdlr_size) != 0 || hdlr_size < 12 || memcmp(hdlr + 8, "vide", 4) != 0
+		|| mp4_find_box(mdia, mdia_size, "mdhd", &mdhd, &mdhd_size) != 0 || mdhd_size < 24
+		|| mp4_find_box(mdia, mdia_size, "minf", &minf, &minf_size) != 0
+		|| mp4_find_box(minf, minf_size, "stbl", &stbl, &stbl_size) != 0
+		|| mp4_find_box(stbl, stbl_size, "stsd", &stsd, &stsd_size) != 0 || stsd_size < 44
+		|| mp4_find_box(stbl, stbl_size, "stts", &stts, &stts_size) != 0 || stts_size < 8){
+		return 1;
+	}
+	const uint64_t timescale = probe_read_big_endian(mdhd + ((mdhd[0] == 1) ? 20 : 12), 4);
+	// The first sample description is a VisualSampleEntry
+	probe->width = probe_read_big_endian(stsd + 40, 2);
+	probe->height = probe_read_big_endian(stsd + 42, 2);
+
+	// ffprobe's average rate is the frame count over the duration
+	const uint64_t entry_count = probe_read_big_endian(stts + 4, 4);
+	if (entry_count == 0 || stts_size < 8 + entry_count * 8) return 1;
+	uint64_t frame_count = 0, duration = 0, frame_duration = 0;
+	size_t entry;
+	for (entry = 0; entry < entry_count; entry++){
+		const uint64_t count = probe_read_big_endian(stts + 8 + entry * 8, 4);
+		const uint64_t delta = probe_read_big_endian(stts + 12 + entry * 8, 4);
+		// Only the last frame is allowed a different length
+		if (frame_duration != 0 && delta != frame_duration && !(entry == entry_count - 1 && count == 1)) return 1;
+		if (frame_duration == 0) frame_duration = delta;
+		frame_count += count;
+		duration += count * delta;
+	}
+	if (timescale == 0 || frame_duration == 0 || probe->width == 0 || probe->height == 0) return 1;
+	probe_set_framerate(probe, timescale * frame_count, duration);
+	return 0;
+}
+
+// returns 1 if it isn't MP4 or the first video track has frames of different lengths
+int probe_mp4(FILE* file, media_probe* probe){
+	BYTE header[16];
+	int found_ftyp = 0;
+	while (fread(header, 1, 8, file) == 8){
+		uint64_t length = probe_read_big_endian(header, 4);
+		size_t header_length = 8;
+		if (length == 1){
+			if (fread(header + 8, 1, 8, file) != 8) return 1;
+			length = probe_read_big_endian(header + 8, 8);
+			header_length = 16;
+		}
+		if (!found_ftyp && memcmp(header + 4, "ftyp", 4) != 0) return 1;
+		found_ftyp = 1;
+		if (length < header_length) return 1;
+		if (memcmp(header + 4, "moov", 4) != 0){
+			if (fseek(file, length - header_length, SEEK_CUR) != 0) return 1;
+			continue;
+		}
+
+		const size_t moov_size = length - header_length;
+		if (moov_size > PROBE_MAX_MOOV_SIZE) return 1;
+		BYTE* moov = malloc(moov_size);
+		int result = 1;
+		if (fread(moov, 1, moov_size, file) == moov_size){
+			// The first video trak is v:0
+			size_t offset = 0;
+			const BYTE* trak;
+			size_t trak_size;
+			while (mp4_find_box(moov + offset, moov_size - offset, "trak", &trak, &trak_size) == 0){
+				memset(probe, 0, sizeof(media_probe));
+				result = probe_mp4_track(trak, trak_size, probe);
+				if (result == 0 || probe->width != 0) break;
+				offset = (trak + trak_size) - moov;
+			}
+		}
+		free(moov);
+		return result;
+	}
+	return 1;
+}
+
+// Reads the size and framerate of the first video stream from the container's headers
+// returns 1 if it's not a container we can read or the framerate isn't fixed, ffprobe knows better then
+int probe_media_file(const char* filepath, media_probe* probe){
+	FILE* file = fopen(filepath, "rb");
+	if (file == NULL){
+		errno = 0;
+		return 1;
+	}
+	int result = probe_matroska(file, probe);
+	if (result != 0){
+		rewind(file);
+		result = probe_mp4(file, probe);
+	}
+	fclose(file);
+	errno = 0;
+	return result;
+}
+
+/*
+  Probes are cached by the file's identity, so repeat jobs on the same file skip probing altogether.
+  Each line is the device, inode, size and modification time, then the probe.
+*/
+// returns 1 on a miss
+int probe_cache_lookup(const char* filepath, media_probe* probe){
+	struct stat file_stat;
+	FILE* cache = fopen(PROBE_CACHE_FILE, "r");
+	if (cache == NULL || stat(filepath, &file_stat) != 0){
+		if (cache != NULL) fclose(cache);
+		errno = 0;
+		return 1;
+	}
+	unsigned long long device, inode;
+	long long size, modified_seconds, modified_nanoseconds;
+	media_probe entry;
+	int found = 0;
+	while (!found && fscanf(cache, "%llu %llu %lld %lld %lld %u %u %f %f\n", &device, &inode, &size, &modified_seconds, &modified_nanoseconds,
+							&entry.width, &entry.height, &entry.framerate_numerator, &entry.framerate_denominator) == 9){
+		found = device == file_stat.st_dev && inode == file_stat.st_ino && size == file_stat.st_size
+			&& modified_seconds == file_stat.st_mtim.tv_sec && modified_nanoseconds == file_stat.st_mtim.tv_nsec;
+	}
+	fclose(cache);
+	if (!found) return 1;
+	*probe = entry;
+	return 0;
+}
+
+void probe_cache_store(const char* filepath, const media_probe* probe){
+	struct stat file_stat;
+	if (stat(filepath, &file_stat) != 0){
+		errno = 0;
+		return;
+	}
+	if (mkdir(TEMP_DIR, 0700) != 0) errno = 0;
+	// Count what's there so the cache can't grow forever
+	size_t entry_count = 0;
+	FILE* cache = fopen(PROBE_CACHE_FILE, "r");
+	if (cache != NULL){
+		int c;
+		while ((c = fgetc(cache)) != EOF) if (c == '\n') entry_count++;
+		fclose(cache);
+	}
+	cache = fopen(PROBE_CACHE_FILE, (entry_count >= PROBE_CACHE_MAX_ENTRIES) ? "w" : "a");
+	if (cache == NULL){
+		errno = 0;
+		return;
+	}
+	fprintf(cache, "%llu %llu %lld %lld %lld %u %u %.9g %.9g\n", (unsigned long long)file_stat.st_dev, (unsigned long long)file_stat.st_ino,
+			(long long)file_stat.st_size, (long long)file_stat.st_mtim.tv_sec, (long long)file_stat.st_mtim.tv_nsec,
+			probe->width, probe->height, probe->framerate_numerator, probe->framerate_denominator);
+	fclose(cache);
+	errno = 0;
+}
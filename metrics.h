@@ -0,0 +1,198 @@
+#define METRICS_PREFIX "anime_upscaler_"
+#define METRICS_HISTOGRAM_BUCKETS 16 // Powers of four from 10us, the last one catches everything
+#define METRICS_HISTOGRAM_FIRST_BUCKET 1e-5
+#define METRICS_STALL_SECONDS 0.001 // Writes to the encoder slower than this count as backpressure
+#define DEFAULT_METRICS_INTERVAL 10
+
+enum {
+	METRIC_FRAMES_DECODED,
+	METRIC_SOURCE_BYTES,
+	METRIC_REPEATED_FRAMES,
+	METRIC_CACHE_HITS,
+	METRIC_FRAMES_UPSCALED,
+	METRIC_UPSCALE_ROUNDS,
+	METRIC_FRAMES_ENCODED,
+	METRIC_RESULT_BYTES,
+	METRIC_ENCODER_STALLS,
+	METRIC_PARTIAL_FRAMES,
+	METRIC_COUNTER_COUNT
+};
+static const char* const metric_counter_names[METRIC_COUNTER_COUNT][2] = {
+	{ "frames_decoded_total", "Frames read from the source ffmpeg" },
+	{ "source_bytes_total", "Bytes of PNG or rawvideo read from the source ffmpeg" },
+	{ "repeated_frames_total", "Frames skipped for repeating the previous one" },
+	{ "cache_hits_total", "Frames taken from the upscale cache" },
+	{ "frames_upscaled_total", "Frames sent through every upscale round" },
+	{ "upscale_rounds_total", "Upscaler rounds run, one per batch per 2x step" },
+	{ "frames_encoded_total", "Frames written to the result ffmpeg" },
+	{ "result_bytes_total", "Bytes of PNG or rawvideo written to the result ffmpeg" },
+	{ "encoder_stalls_total", "Frame writes to the result ffmpeg that blocked" },
+	{ "partial_frames_total", "Frames where only the tiles that changed were upscaled" },
+};
+
+enum {
+	HISTOGRAM_SOURCE_READ,
+	HISTOGRAM_TEMP_FILE_BATCH_WRITE,
+	HISTOGRAM_UPSCALER_ROUND,
+	HISTOGRAM_UPSCALER_ROUND_PER_FRAME,
+	HISTOGRAM_OUTPUT_BATCH_READ,
+	HISTOGRAM_ENCODER_WRITE,
+	METRIC_HISTOGRAM_COUNT
+};
+static const char* const metric_histogram_names[METRIC_HISTOGRAM_COUNT][2] = {
+	{ "source_read_seconds", "Time reading a decoded frame from the source ffmpeg" },
+	{ "temp_file_batch_write_seconds", "Time writing a batch's frames to their temp files for the upscaler" },
+	{ "upscaler_round_seconds", "Wall time of an upscaler round" },
+	{ "upscaler_round_seconds_per_frame", "Wall time of an upscaler round divided by its frames, once per round" },
+	{ "output_batch_read_seconds", "Time reading a batch's upscaled frames back in" },
+	{ "encoder_write_seconds", "Time writing a frame to the result ffmpeg" },
+};
+
+typedef struct {
+	_Atomic uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum_microseconds;
+} metrics_histogram;
+
+/*
+  Counters and latency histograms for every stage, updated from any thread.
+  With --metrics-file a thread writes them out every interval as JSON or as a Prometheus textfile,
+  replacing the file by renaming so a collector never sees half of one.
+*/
+typedef struct {
+	_Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+	metrics_histogram histograms[METRIC_HISTOGRAM_COUNT];
+
+	const char* filepath;
+	int prometheus;
+	unsigned int interval;
+	int stopping;
+	pthread_t writer_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t stop;
+} metrics;
+
+static metrics session_metrics = { .mutex = PTHREAD_MUTEX_INITIALIZER, .stop = PTHREAD_COND_INITIALIZER };
+
+void metrics_count(int counter, uint64_t amount){
+	atomic_fetch_add(&session_metrics.counters[counter], amount);
+}
+
+double metrics_bucket_bound(int bucket){
+	return METRICS_HISTOGRAM_FIRST_BUCKET * pow(4, bucket);
+}
+
+void metrics_observe(int histogram, double seconds){
+	metrics_histogram* h = &session_metrics.histograms[histogram];
+	int bucket = 0;
+	while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && seconds > metrics_bucket_bound(bucket)) bucket++;
+	atomic_fetch_add(&h->buckets[bucket], 1);
+	atomic_fetch_add(&h->count, 1);
+	atomic_fetch_add(&h->sum_microseconds, (uint64_t)(seconds * 1e6));
+}
+
+void write_metrics_json(FILE* file){
+	fprintf(file, "{\n");
+	int i, bucket;
+	for (i = 0; i < METRIC_COUNTER_COUNT; i++)
+		fprintf(file, "  \"%s\": %llu,\n", metric_counter_names[i][0], (unsigned long long)atomic_load(&session_metrics.counters[i]));
+	fprintf(file, "  \"buffer_bytes_in_use\": %llu,\n", (unsigned long long)buffer_pool_in_use());
+	fprintf(file, "  \"buffer_bytes_peak\": %llu,\n", (unsigned long long)buffer_pool_peak_in_use());
+	for (i = 0; i < METRIC_HISTOGRAM_COUNT; i++){
+		metrics_histogram* h = &session_metrics.histograms[i];
+		fprintf(file, "  \"%s\": { \"count\": %llu, \"sum\": %f, \"buckets\": [", metric_histogram_names[i][0],
+				(unsigned long long)atomic_load(&h->count), atomic_load(&h->sum_microseconds) / 1e6);
+		for (bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++){
+			// Unlike the Prometheus output these aren't cumulative, the last bound is null for infinity
+			char bound[32] = "null";
+			if (bucket < METRICS_HISTOGRAM_BUCKETS - 1) snprintf(bound, sizeof(bound), "%g", metrics_bucket_bound(bucket));
+			fprintf(file, "%s{ \"le\": %s, \"count\": %llu }", bucket ? ", " : "", bound, (unsigned long long)atomic_load(&h->buckets[bucket]));
+		}
+		fprintf(file, "] }%s\n", (i == METRIC_HISTOGRAM_COUNT - 1) ? "" : ",");
+	}
+	fprintf(file, "}\n");
+}
+
+void write_metrics_prometheus(FILE* file){
+	int i, bucket;
+	for (i = 0; i < METRIC_COUNTER_COUNT; i++){
+		fprintf(file, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n" METRICS_PREFIX "%s %llu\n",
+				metric_counter_names[i][0], metric_counter_names[i][1], metric_counter_names[i][0],
+				metric_counter_names[i][0], (unsigned long long)atomic_load(&session_metrics.counters[i]));
+	}
+	fprintf(file, "# HELP " METRICS_PREFIX "buffer_bytes_in_use Memory held by frame buffers\n# TYPE " METRICS_PREFIX "buffer_bytes_in_use gauge\n"
+			METRICS_PREFIX "buffer_bytes_in_use %llu\n", (unsigned long long)buffer_pool_in_use());
+	fprintf(file, "# HELP " METRICS_PREFIX "buffer_bytes_peak Most memory frame buffers have held at once\n# TYPE " METRICS_PREFIX "buffer_bytes_peak gauge\n"
+			METRICS_PREFIX "buffer_bytes_peak %llu\n", (unsigned long long)buffer_pool_peak_in_use());
+	for (i = 0; i < METRIC_HISTOGRAM_COUNT; i++){
+		metrics_histogram* h = &session_metrics.histograms[i];
+		const char* name = metric_histogram_names[i][0];
+		fprintf(file, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s histogram\n", name, metric_histogram_names[i][1], name);
+		uint64_t cumulative = 0;
+		for (bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++){
+			cumulative += atomic_load(&h->buckets[bucket]);
+			if (bucket == METRICS_HISTOGRAM_BUCKETS - 1){
+				fprintf(file, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+			}else{
+				fprintf(file, METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n", name, metrics_bucket_bound(bucket), (unsigned long long)cumulative);
+			}
+		}
+		fprintf(file, METRICS_PREFIX "%s_sum %f\n" METRICS_PREFIX "%s_count %llu\n",
+				name, atomic_load(&h->sum_microseconds) / 1e6, name, (unsigned long long)atomic_load(&h->count));
+	}
+}
+
+void write_metrics_file(){
+	char temp_filepath[PATH_MAX];
+	snprintf(temp_filepath, PATH_MAX, "%s.tmp", session_metrics.filepath);
+	FILE* file = fopen(temp_filepath, "w");
+	if (file == NULL){
+		fprintf(stderr, "Failed to write %s: %s\n", temp_filepath, strerror(errno));
+		errno = 0;
+		return;
+	}
+	if (session_metrics.prometheus){
+		write_metrics_prometheus(file);
+	}else{
+		write_metrics_json(file);
+	}
+	if (fclose(file) != 0 || rename(temp_filepath, session_metrics.filepath) != 0){
+		fprintf(stderr, "Failed to write %s: %s\n", session_metrics.filepath, strerror(errno));
+		errno = 0;
+	}
+}
+
+void* write_metrics_periodically(void* arg){
+	pthread_mutex_lock(&session_metrics.mutex);
+	while (!session_metrics.stopping){
+		struct timespec wake_time;
+		clock_gettime(CLOCK_REALTIME, &wake_time);
+		wake_time.tv_sec += session_metrics.interval;
+		while (!session_metrics.stopping && pthread_cond_timedwait(&session_metrics.stop, &session_metrics.mutex, &wake_time) != ETIMEDOUT);
+		write_metrics_file();
+	}
+	pthread_mutex_unlock(&session_metrics.mutex);
+	return NULL;
+}
+
+void start_metrics_writer(const char* filepath, int prometheus, unsigned int interval){
+	session_metrics.filepath = filepath;
+	session_metrics.prometheus = prometheus;
+	session_metrics.interval = interval;
+	session_metrics.stopping = 0;
+	if (pthread_create(&session_metrics.writer_thread, NULL, write_metrics_periodically, NULL) != 0){
+		fprintf(stderr, "Failed to start the metrics writer\n");
+		exit(1);
+	}
+}
+
+// Writes the metrics one last time and stops
+void stop_metrics_writer(){
+	if (session_metrics.filepath == NULL) return;
+	pthread_mutex_lock(&session_metrics.mutex);
+	session_metrics.stopping = 1;
+	pthread_cond_signal(&session_metrics.stop);
+	pthread_mutex_unlock(&session_metrics.mutex);
+	pthread_join(session_metrics.writer_thread, NULL);
+	session_metrics.filepath = NULL;
+}
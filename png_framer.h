@@ -0,0 +1,157 @@
+#define PNG_FRAMER_READ_SIZE (1 << 16) // Smallest read, larger ones are made when a chunk is known to be larger
+#define PNG_FRAMER_PIPE_SIZE (1 << 20)
+#define PNG_SIGNATURE "\211PNG\r\n\032\n"
+#define PNG_SIGNATURE_SIZE 8
+#define PNG_CHUNK_OVERHEAD 12 // Length, name and CRC
+#define PNG_MAX_CHUNK_LENGTH 0x7FFFFFFFu
+
+/*
+  Splits the PNG stream coming out of ffmpeg into frames.
+  Data is read from the fd in large blocks straight into the frame's buffer and chunk boundaries are found in place,
+  only the few bytes read past the end of a frame are copied, into carry, to start the next one.
+*/
+typedef struct {
+	int fd;
+	expandable_buffer carry;
+	int end_of_stream;
+	int check_crc;
+	int broken; // Set if framing stopped because of bad data rather than the end of the stream
+} png_framer;
+
+// Slice-by-8 CRC32, the table is filled in the first time a checking framer is made
+static uint32_t crc32_table[8][256];
+void init_crc32_table(){
+	if (crc32_table[0][1] != 0) return;
+	uint32_t i;
+	for (i = 0; i < 256; i++){
+		uint32_t crc = i;
+		int bit;
+		for (bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320u : 0);
+		crc32_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++){
+		int slice;
+		for (slice = 1; slice < 8; slice++)
+			crc32_table[slice][i] = (crc32_table[slice - 1][i] >> 8) ^ crc32_table[0][crc32_table[slice - 1][i] & 0xFF];
+	}
+}
+uint32_t crc32_of(const BYTE* data, size_t size){
+	uint32_t crc = 0xFFFFFFFFu;
+	for (; size >= 8; data += 8, size -= 8){
+		uint32_t low, high;
+		memcpy(&low, data, sizeof(low));
+		memcpy(&high, data + 4, sizeof(high));
+		low ^= crc; // Assumes a little endian CPU
+		crc = crc32_table[7][low & 0xFF] ^ crc32_table[6][(low >> 8) & 0xFF]
+			^ crc32_table[5][(low >> 16) & 0xFF] ^ crc32_table[4][low >> 24]
+			^ crc32_table[3][high & 0xFF] ^ crc32_table[2][(high >> 8) & 0xFF]
+			^ crc32_table[1][(high >> 16) & 0xFF] ^ crc32_table[0][high >> 24];
+	}
+	for (; size > 0; data++, size--) crc = (crc >> 8) ^ crc32_table[0][(crc ^ *data) & 0xFF];
+	return crc ^ 0xFFFFFFFFu;
+}
+
+uint32_t read_big_endian_32(const BYTE* data){
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+void init_png_framer(png_framer* framer, int fd, int check_crc){
+	framer->fd = fd;
+	framer->carry = create_expandable_buffer(PNG_FRAMER_READ_SIZE);
+	framer->end_of_stream = 0;
+	framer->check_crc = check_crc;
+	framer->broken = 0;
+	if (check_crc) init_crc32_table();
+	// A bigger pipe means fewer, larger reads, it's fine if we aren't allowed one
+	if (fcntl(fd, F_SETPIPE_SZ, PNG_FRAMER_PIPE_SIZE) == -1) errno = 0;
+}
+void free_png_framer(png_framer* framer){
+	free_expandable_buffer(&framer->carry);
+}
+
+// Reads until the buffer holds at least size bytes
+// returns 1 if the stream ended first
+int png_framer_fill(png_framer* framer, expandable_buffer* buffer, size_t size){
+	while (buffer->size < size){
+		if (framer->end_of_stream) return 1;
+		size_t read_size = size - buffer->size;
+		if (read_size < PNG_FRAMER_READ_SIZE) read_size = PNG_FRAMER_READ_SIZE;
+		BYTE* read_start = expandable_buffer_increase_size(buffer, read_size);
+		ssize_t total_read = read(framer->fd, read_start, read_size);
+		buffer->size -= read_size - (total_read > 0 ? total_read : 0);
+		if (total_read == 0){
+			framer->end_of_stream = 1;
+		}else if (total_read < 0){
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Error reading PNGs from ffmpeg: %s\n", strerror(errno));
+			framer->end_of_stream = 1;
+			framer->broken = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Reads the next whole PNG in the stream into the buffer, replacing what was there
+// returns 1 at the end of the stream or if the data is broken
+int png_framer_read_in(png_framer* framer, expandable_buffer* buffer){
+	expandable_buffer_clear(buffer);
+	if (framer->carry.size > 0){
+		memcpy(expandable_buffer_increase_size(buffer, framer->carry.size), framer->carry.pointer, framer->carry.size);
+		expandable_buffer_clear(&framer->carry);
+	}
+
+	if (png_framer_fill(framer, buffer, PNG_SIGNATURE_SIZE) != 0){
+		if (buffer->size != 0 && !framer->broken){
+			fprintf(stderr, "Problem reading header\n");
+			framer->broken = 1;
+		}
+		return 1;
+	}
+	if (memcmp(buffer->pointer, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0){
+		fprintf(stderr, "PNG header was different\n");
+		framer->broken = 1;
+		return 1;
+	}
+
+	size_t frame_size = PNG_SIGNATURE_SIZE;
+	while (1){
+		if (png_framer_fill(framer, buffer, frame_size + 8) != 0){
+			fprintf(stderr, "problem reading chunk header\n");
+			framer->broken = 1;
+			return 1;
+		}
+		const uint32_t chunk_data_size = read_big_endian_32(buffer->pointer + frame_size);
+		if (chunk_data_size > PNG_MAX_CHUNK_LENGTH){
+			fprintf(stderr, "PNG chunk length %u is too long\n", chunk_data_size);
+			framer->broken = 1;
+			return 1;
+		}
+		if (png_framer_fill(framer, buffer, frame_size + PNG_CHUNK_OVERHEAD + chunk_data_size) != 0){
+			fprintf(stderr, "problem reading chunk data\n");
+			framer->broken = 1;
+			return 1;
+		}
+		// Filling can move the buffer
+		const BYTE* chunk = buffer->pointer + frame_size;
+		if (framer->check_crc){
+			// The CRC covers the name and the data
+			const uint32_t crc = read_big_endian_32(chunk + 8 + chunk_data_size);
+			if (crc32_of(chunk + 4, 4 + chunk_data_size) != crc){
+				fprintf(stderr, "Corrupt PNG from ffmpeg, bad CRC in %.4s chunk\n", (const char*)(chunk + 4));
+				framer->broken = 1;
+				return 1;
+			}
+		}
+		frame_size += PNG_CHUNK_OVERHEAD + chunk_data_size;
+		if (memcmp(chunk + 4, "IEND", 4) == 0) break;
+	}
+
+	// Whatever came after IEND belongs to the next frame
+	if (buffer->size > frame_size){
+		const size_t carry_size = buffer->size - frame_size;
+		memcpy(expandable_buffer_increase_size(&framer->carry, carry_size), buffer->pointer + frame_size, carry_size);
+		buffer->size = frame_size;
+	}
+	return 0;
+}
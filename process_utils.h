@@ -1,3 +1,5 @@
+#include <spawn.h>
+
 typedef union {
 	int array[2];
 	struct {
@@ -8,7 +10,9 @@ typedef union {
 
 pipe_data create_pipe_data(){
 	pipe_data data;
-	if (pipe(data.array)){
+	// Close-on-exec so our ends don't leak into unrelated children and hold pipes open,
+	// dup2 clears the flag on the stdin/stdout/stderr a child actually uses
+	if (pipe2(data.array, O_CLOEXEC)){
 		fprintf(stderr, "Failed to create pipe\n");
 		exit(1);
 	}
@@ -32,77 +36,52 @@ void pipe_data_close_write_to(pipe_data* pipe){
 	pipe->files.write_to = -1;
 }
 
-pid_t fork_to_function(int (*func)(void*), void* data, char* working_directory, pipe_data* input_pipe, pipe_data* output_pipe, pipe_data* err_pipe){
-	pid_t process_id = fork();
-	switch(process_id){
-	case -1:
-		fprintf(stderr, "fork() failed\n");
-		exit(1);
-	case 0:
-		// We are the new process, start the command
-		if (input_pipe != NULL){
-			// Redirect stdin
-			if (dup2(input_pipe->files.read_from, 0) < 0){
-				pipe_data_close_read_from(input_pipe);
-				fprintf(stderr, "Failed to redirect input for fork\n");
-				exit(1);
-			}
-			pipe_data_close_write_to(input_pipe); // We don't need this anymore
-		}
-		if (output_pipe != NULL){
-			// Redirect stdout
-			if (dup2(output_pipe->files.write_to, 1) < 0){
-				pipe_data_close_write_to(output_pipe);
-				fprintf(stderr, "Failed to redirect output for fork\n");
-				exit(1);
-			}
-			pipe_data_close_read_from(output_pipe); // We don't need this anymore
-		}
-		// Redirect stderr to /dev/null
-		if (err_pipe == NULL){
-			//freopen("/dev/null", "w", stderr);
-		}else{
-			// Redirect stderr
-			if (dup2(err_pipe->files.write_to, 2) < 0){
-				pipe_data_close_write_to(err_pipe);
-				fprintf(stderr, "Failed to redirect stderr for fork\n");
-				exit(1);
-			}
-			pipe_data_close_read_from(err_pipe); // We don't need this anymore
-		}
-		if (working_directory != NULL){
-			chdir(working_directory);
-		}
-		// Run the command, exit with returned status
-		// Use _exit so we don't call exit handlers
-		_exit((*func)(data));
-		break;
-	default:
-		// We are the parent
-		if (err_pipe != NULL) pipe_data_close_write_to(err_pipe);
-		if (output_pipe != NULL) pipe_data_close_write_to(output_pipe);
-		if (input_pipe != NULL) pipe_data_close_read_from(input_pipe);
-	}
-	return process_id;
-}
+/*
+  Starts the command with posix_spawn, which doesn't copy our page tables like fork would,
+  so starting a child takes the same time however many frames we're holding.
+  The pipes are close-on-exec, so the child only keeps the ends it's given as stdin, stdout and stderr.
+  Its ends are closed here whether it started or not, so a command that couldn't be run looks like one that exited straight away.
+  returns -1 if it couldn't be started, never pass that on to kill() or waitpid()
+*/
+pid_t run_command(char* const command[], char* working_directory, pipe_data* input_pipe, pipe_data* output_pipe, pipe_data* err_pipe){
+	posix_spawn_file_actions_t file_actions;
+	posix_spawn_file_actions_init(&file_actions);
+	if (input_pipe != NULL) posix_spawn_file_actions_adddup2(&file_actions, input_pipe->files.read_from, 0);
+	if (output_pipe != NULL) posix_spawn_file_actions_adddup2(&file_actions, output_pipe->files.write_to, 1);
+	if (err_pipe != NULL) posix_spawn_file_actions_adddup2(&file_actions, err_pipe->files.write_to, 2);
+	if (working_directory != NULL) posix_spawn_file_actions_addchdir_np(&file_actions, working_directory);
 
-int exec_from_void(void* command){
-	char** actual_command = (char**)command;
-	execvp(actual_command[0], actual_command);
-	fprintf(stderr, "Failed to exec() command %s with err %s\n", actual_command[0], strerror(errno));
-	return 1;
-}
+	// Signals blocked for our own event loop would stay blocked through exec
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	sigset_t no_signals;
+	sigemptyset(&no_signals);
+	posix_spawnattr_setsigmask(&attributes, &no_signals);
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
 
-pid_t run_command(char* const command[], char* working_directory, pipe_data* input_pipe, pipe_data* output_pipe, pipe_data* err_pipe){
-	return fork_to_function(&exec_from_void, (void*)command, working_directory, input_pipe, output_pipe, err_pipe);
+	pid_t process_id;
+	const int error = posix_spawnp(&process_id, command[0], &file_actions, &attributes, command, environ);
+	posix_spawn_file_actions_destroy(&file_actions);
+	posix_spawnattr_destroy(&attributes);
+	if (error != 0){
+		fprintf(stderr, "Failed to run %s: %s\n", command[0], strerror(error));
+		process_id = -1;
+	}
+
+	if (err_pipe != NULL) pipe_data_close_write_to(err_pipe);
+	if (output_pipe != NULL) pipe_data_close_write_to(output_pipe);
+	if (input_pipe != NULL) pipe_data_close_read_from(input_pipe);
+	return process_id;
 }
 
-int fix_carriage_return_passthrough(void* arg){
-	int c;
-	while((c = getc(stdin)) != EOF){
-		fputc(c == '\r' ? '\n' : c, stdout);
-	}
-	fflush(stdout);
-	fclose(stdout);
-	return 0;
+// Joins two NULL terminated argument lists into one, free() the result once the command has been run
+char** join_commands(char* const first[], char* const second[]){
+	size_t first_length = 0, second_length = 0;
+	while (first[first_length] != NULL) first_length++;
+	while (second[second_length] != NULL) second_length++;
+	char** command = calloc(first_length + second_length + 1, sizeof(char*));
+	memcpy(command, first, first_length * sizeof(char*));
+	memcpy(command + first_length, second, second_length * sizeof(char*));
+	command[first_length + second_length] = NULL;
+	return command;
 }
@@ -0,0 +1,259 @@
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#define PROGRESS_REACTOR_TIMEOUT_MS 1000 // Only so a stop signal caught by another thread is noticed
+#define PROGRESS_REACTOR_READ_SIZE 4096
+#define PROGRESS_REACTOR_MAX_EVENTS 4
+#define PROGRESS_STEP_CHARACTERS 32
+
+// What each fd added to epoll is, stored in its event data
+enum { PROGRESS_SOURCE_SIGNALS, PROGRESS_SOURCE_ENCODER, PROGRESS_SOURCE_UPSCALER, PROGRESS_SOURCE_WORKERS };
+#define PROGRESS_SOURCE_BITS 8 // An encoder's index goes above its source
+
+// A child's output, split into lines as it arrives
+typedef struct {
+	int fd; // -1 once closed
+	expandable_buffer partial_line;
+} progress_stream;
+
+/*
+  Waits on everything the main thread cares about while frames are being upscaled, using no CPU in between.
+  ffmpeg's -progress output and waifu2x's progress bar are parsed here instead of through sed,
+  and children are reaped when SIGCHLD arrives on a signalfd instead of being polled for.
+*/
+typedef struct {
+	int epoll_fd;
+	int signal_fd;
+	sigset_t blocked_signals;
+
+	// One for each result ffmpeg
+	progress_stream encoders[MAX_RESULT_ENCODERS];
+	pid_t encoder_pids[MAX_RESULT_ENCODERS];
+	int encoder_exited[MAX_RESULT_ENCODERS];
+	int encoder_statuses[MAX_RESULT_ENCODERS];
+	unsigned int encoder_frames[MAX_RESULT_ENCODERS];
+	size_t encoder_count;
+	unsigned int encoded_frames; // Between all of them
+
+	// A one-off waifu2x started for a single round
+	progress_stream upscaler;
+	pid_t upscaler_pid;
+	int upscaler_exited;
+	int upscaler_status;
+	char upscaler_step[PROGRESS_STEP_CHARACTERS];
+	unsigned int upscaled_frames;
+	unsigned int upscaler_total_frames;
+
+	int workers_fd; // eventfd the persistent workers poke after each frame, -1 if there are none
+} progress_reactor;
+
+void progress_reactor_add(progress_reactor* reactor, int fd, uint32_t source){
+	struct epoll_event event = { .events = EPOLLIN, .data.u32 = source };
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0){
+		fprintf(stderr, "Failed to watch fd %d: %s\n", fd, strerror(errno));
+		exit(1);
+	}
+}
+
+void init_progress_stream(progress_reactor* reactor, progress_stream* stream, int fd, uint32_t source){
+	stream->fd = fd;
+	expandable_buffer_clear(&stream->partial_line);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	progress_reactor_add(reactor, fd, source);
+}
+void close_progress_stream(progress_reactor* reactor, progress_stream* stream){
+	if (stream->fd == -1) return;
+	epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+	close(stream->fd);
+	stream->fd = -1;
+}
+
+// Must be called before any threads are started, so they all inherit SIGCHLD being blocked and it can only arrive on the signalfd
+void init_progress_reactor(progress_reactor* reactor){
+	sigemptyset(&reactor->blocked_signals);
+	sigaddset(&reactor->blocked_signals, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &reactor->blocked_signals, NULL);
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	reactor->signal_fd = signalfd(-1, &reactor->blocked_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (reactor->epoll_fd == -1 || reactor->signal_fd == -1){
+		fprintf(stderr, "Failed to set up the event loop: %s\n", strerror(errno));
+		exit(1);
+	}
+	progress_reactor_add(reactor, reactor->signal_fd, PROGRESS_SOURCE_SIGNALS);
+
+	reactor->upscaler.partial_line = create_expandable_buffer(PROGRESS_REACTOR_READ_SIZE);
+	reactor->upscaler.fd = -1;
+	reactor->upscaler_pid = 0;
+	reactor->workers_fd = -1;
+	reactor->encoder_count = 0;
+	reactor->encoded_frames = 0;
+}
+
+// Follows a result ffmpeg's -progress output on fd until it exits
+void progress_reactor_watch_encoder(progress_reactor* reactor, int fd, pid_t pid){
+	const size_t encoder = reactor->encoder_count++;
+	reactor->encoders[encoder].partial_line = create_expandable_buffer(PROGRESS_REACTOR_READ_SIZE);
+	init_progress_stream(reactor, &reactor->encoders[encoder], fd, PROGRESS_SOURCE_ENCODER | (encoder << PROGRESS_SOURCE_BITS));
+	reactor->encoder_pids[encoder] = pid;
+	reactor->encoder_exited[encoder] = 0;
+	reactor->encoder_statuses[encoder] = 0;
+	reactor->encoder_frames[encoder] = 0;
+}
+
+// Follows a one-off waifu2x's progress bar on fd until it exits
+void progress_reactor_watch_upscaler(progress_reactor* reactor, int fd, pid_t pid){
+	init_progress_stream(reactor, &reactor->upscaler, fd, PROGRESS_SOURCE_UPSCALER);
+	reactor->upscaler_pid = pid;
+	reactor->upscaler_exited = 0;
+	reactor->upscaler_status = 0;
+	reactor->upscaler_step[0] = '\0';
+	reactor->upscaled_frames = 0;
+	reactor->upscaler_total_frames = 0;
+}
+
+void progress_reactor_watch_workers(progress_reactor* reactor, int fd){
+	if (fd == -1 || reactor->workers_fd == fd) return;
+	if (reactor->workers_fd != -1) epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->workers_fd, NULL);
+	reactor->workers_fd = fd;
+	progress_reactor_add(reactor, fd, PROGRESS_SOURCE_WORKERS);
+}
+
+// ffmpeg -progress writes key=value lines
+void parse_encoder_line(progress_reactor* reactor, size_t encoder, char* line){
+	if (sscanf(line, "frame=%u", &reactor->encoder_frames[encoder]) != 1) return;
+	reactor->encoded_frames = 0;
+	size_t i;
+	for (i = 0; i < reactor->encoder_count; i++) reactor->encoded_frames += reactor->encoder_frames[i];
+}
+
+// waifu2x redraws a progress bar ending in "Step: 3ms 5/30" with backspaces mixed in
+void parse_upscaler_line(progress_reactor* reactor, size_t stream_index, char* line){
+	char* out = line;
+	char* in;
+	for (in = line; *in != '\0'; in++){
+		if (isprint((unsigned char)*in)) *out++ = *in;
+	}
+	*out = '\0';
+	char* step = line;
+	char* found;
+	while ((found = strstr(step, "Step: ")) != NULL) step = found + strlen("Step: ");
+	char step_string[PROGRESS_STEP_CHARACTERS];
+	unsigned int upscaled_frames, total_frames;
+	if (sscanf(step, "%31s %u/%u", step_string, &upscaled_frames, &total_frames) == 3){
+		strcpy(reactor->upscaler_step, step_string);
+		reactor->upscaled_frames = upscaled_frames;
+		reactor->upscaler_total_frames = total_frames;
+	}
+}
+
+// Reads what's waiting on the stream and hands each whole line to parse_line, along with which of its kind the stream is
+void read_progress_stream(progress_reactor* reactor, progress_stream* stream, size_t stream_index, void (*parse_line)(progress_reactor*, size_t, char*)){
+	while (stream->fd != -1){
+		BYTE* read_start = expandable_buffer_increase_size(&stream->partial_line, PROGRESS_REACTOR_READ_SIZE);
+		ssize_t total_read = read(stream->fd, read_start, PROGRESS_REACTOR_READ_SIZE);
+		stream->partial_line.size -= PROGRESS_REACTOR_READ_SIZE - (total_read > 0 ? total_read : 0);
+		if (total_read < 0){
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN) close_progress_stream(reactor, stream);
+			errno = 0;
+			break;
+		}
+		if (total_read == 0){
+			close_progress_stream(reactor, stream);
+			break;
+		}
+
+		// waifu2x ends its lines with \r
+		size_t line_start = 0;
+		size_t i;
+		for (i = 0; i < stream->partial_line.size; i++){
+			BYTE* c = &stream->partial_line.pointer[i];
+			if (*c != '\n' && *c != '\r') continue;
+			*c = '\0';
+			parse_line(reactor, stream_index, (char*)stream->partial_line.pointer + line_start);
+			line_start = i + 1;
+		}
+		memmove(stream->partial_line.pointer, stream->partial_line.pointer + line_start, stream->partial_line.size - line_start);
+		stream->partial_line.size -= line_start;
+	}
+}
+
+// Reaps whichever of our children have exited, SIGCHLDs can be merged so every one is checked
+void reap_progress_children(progress_reactor* reactor){
+	struct signalfd_siginfo info;
+	while (read(reactor->signal_fd, &info, sizeof(info)) == sizeof(info));
+	errno = 0;
+
+	if (reactor->upscaler_pid != 0 && !reactor->upscaler_exited
+		&& waitpid(reactor->upscaler_pid, &reactor->upscaler_status, WNOHANG) == reactor->upscaler_pid){
+		reactor->upscaler_exited = 1;
+	}
+	size_t i;
+	for (i = 0; i < reactor->encoder_count; i++){
+		if (!reactor->encoder_exited[i] && waitpid(reactor->encoder_pids[i], &reactor->encoder_statuses[i], WNOHANG) == reactor->encoder_pids[i])
+			reactor->encoder_exited[i] = 1;
+	}
+	errno = 0;
+}
+
+// Sleeps until something happens and handles it
+void progress_reactor_wait(progress_reactor* reactor){
+	struct epoll_event events[PROGRESS_REACTOR_MAX_EVENTS];
+	int event_count = epoll_wait(reactor->epoll_fd, events, PROGRESS_REACTOR_MAX_EVENTS, PROGRESS_REACTOR_TIMEOUT_MS);
+	if (event_count < 0){
+		// Interrupted by a signal, the caller checks stop_signalled
+		errno = 0;
+		return;
+	}
+	int i;
+	for (i = 0; i < event_count; i++){
+		const size_t stream_index = events[i].data.u32 >> PROGRESS_SOURCE_BITS;
+		switch (events[i].data.u32 & ((1 << PROGRESS_SOURCE_BITS) - 1)){
+		case PROGRESS_SOURCE_SIGNALS:
+			reap_progress_children(reactor);
+			break;
+		case PROGRESS_SOURCE_ENCODER:
+			read_progress_stream(reactor, &reactor->encoders[stream_index], stream_index, parse_encoder_line);
+			break;
+		case PROGRESS_SOURCE_UPSCALER:
+			read_progress_stream(reactor, &reactor->upscaler, 0, parse_upscaler_line);
+			break;
+		case PROGRESS_SOURCE_WORKERS:
+		{
+			uint64_t count;
+			if (read(reactor->workers_fd, &count, sizeof(count)) != sizeof(count)) errno = 0;
+			break;
+		}
+		}
+	}
+}
+
+// Keeps reading the progress until every result ffmpeg exits
+// returns the exit status of the first one that failed, as from waitpid, or 0
+int progress_reactor_wait_for_encoders(progress_reactor* reactor){
+	// Catch an exit that happened before we started waiting
+	reap_progress_children(reactor);
+	size_t i;
+	for (i = 0; i < reactor->encoder_count; i++){
+		while (!reactor->encoder_exited[i]) progress_reactor_wait(reactor);
+	}
+	for (i = 0; i < reactor->encoder_count; i++){
+		if (!WIFEXITED(reactor->encoder_statuses[i]) || WEXITSTATUS(reactor->encoder_statuses[i]) != 0) return reactor->encoder_statuses[i];
+	}
+	return 0;
+}
+
+void free_progress_reactor(progress_reactor* reactor){
+	size_t i;
+	for (i = 0; i < reactor->encoder_count; i++){
+		close_progress_stream(reactor, &reactor->encoders[i]);
+		free_expandable_buffer(&reactor->encoders[i].partial_line);
+	}
+	close_progress_stream(reactor, &reactor->upscaler);
+	free_expandable_buffer(&reactor->upscaler.partial_line);
+	close(reactor->signal_fd);
+	close(reactor->epoll_fd);
+	pthread_sigmask(SIG_UNBLOCK, &reactor->blocked_signals, NULL);
+}
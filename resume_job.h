@@ -0,0 +1,132 @@
+#define RESUME_DIRECTORY_SUFFIX ".resume"
+#define RESUME_JOB_FILE "job"
+#define RESUME_SEGMENT_LIST_FILE "segments.csv"
+
+/*
+  A job that can be picked up again after being interrupted.
+  The result ffmpeg writes the video in segments of one batch each, ffmpeg's segment list records which ones were closed.
+  A segment only counts as committed once it holds a whole batch, anything after the first short one is redone.
+*/
+typedef struct {
+	char* directory;
+	const char* segment_extension;
+	size_t frames_per_segment;
+	size_t committed_segments;
+} resume_job;
+
+void resume_job_filename(resume_job* job, const char* name, char* filename){
+	snprintf(filename, PATH_MAX, "%s/%s", job->directory, name);
+}
+void resume_job_segment_filename(resume_job* job, size_t segment, char* filename){
+	video_segment_filename(job->directory, segment, job->segment_extension, filename);
+}
+
+void resume_job_save(resume_job* job, unsigned int target_width, unsigned int target_height){
+	char filename[PATH_MAX];
+	char temp_filename[PATH_MAX + 8];
+	resume_job_filename(job, RESUME_JOB_FILE, filename);
+	snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+	FILE* file = fopen(temp_filename, "w");
+	if (file == NULL){
+		fprintf(stderr, "Failed to write %s: %s\n", temp_filename, strerror(errno));
+		exit(1);
+	}
+	fprintf(file, "frames_per_segment=%zu\ntarget_size=%ux%u\ncommitted_segments=%zu\n",
+			job->frames_per_segment, target_width, target_height, job->committed_segments);
+	if (fclose(file) != 0 || rename(temp_filename, filename) != 0){
+		fprintf(stderr, "Failed to write %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+}
+
+// Adds the segments the last run closed with a full batch in them
+void resume_job_commit_listed_segments(resume_job* job, float framerate){
+	char filename[PATH_MAX];
+	resume_job_filename(job, RESUME_SEGMENT_LIST_FILE, filename);
+	FILE* list = fopen(filename, "r");
+	if (list == NULL){
+		if (errno == ENOENT) errno = 0;
+		return;
+	}
+	// Half a frame of slack for rounding in ffmpeg's timestamps
+	const double full_duration = (job->frames_per_segment - 0.5) / framerate;
+	char* line = NULL;
+	size_t line_length = 0;
+	while (getline(&line, &line_length, list) != -1){
+		char expected_name[PATH_MAX];
+		snprintf(expected_name, PATH_MAX, VIDEO_SEGMENT_PATTERN "%s,", job->committed_segments, job->segment_extension);
+		if (strncmp(line, expected_name, strlen(expected_name)) != 0) break;
+		double start_time, end_time;
+		if (sscanf(line + strlen(expected_name), "%lf,%lf", &start_time, &end_time) != 2) break;
+		if (end_time - start_time < full_duration) break;
+		job->committed_segments++;
+	}
+	free(line);
+	fclose(list);
+	unlink(filename);
+}
+
+// Loads the job for output_filepath, or starts a new one
+void init_resume_job(resume_job* job, const char* output_filepath, size_t frames_per_segment, unsigned int target_width, unsigned int target_height, float framerate){
+	job->directory = create_video_segment_directory(output_filepath, RESUME_DIRECTORY_SUFFIX);
+	job->segment_extension = video_segment_extension(output_filepath);
+	job->frames_per_segment = frames_per_segment;
+	job->committed_segments = 0;
+
+	char filename[PATH_MAX];
+	resume_job_filename(job, RESUME_JOB_FILE, filename);
+	FILE* file = fopen(filename, "r");
+	if (file != NULL){
+		size_t saved_frames_per_segment;
+		unsigned int saved_width, saved_height;
+		if (fscanf(file, "frames_per_segment=%zu\ntarget_size=%ux%u\ncommitted_segments=%zu\n",
+				   &saved_frames_per_segment, &saved_width, &saved_height, &job->committed_segments) != 4){
+			fprintf(stderr, "Couldn't read %s, delete %s to start again\n", filename, job->directory);
+			exit(1);
+		}
+		fclose(file);
+		if (saved_frames_per_segment != frames_per_segment || saved_width != target_width || saved_height != target_height){
+			fprintf(stderr, "%s was started with --frame-count=%zu --target-size=%ux%u, use those or delete it to start again\n",
+					job->directory, saved_frames_per_segment, saved_width, saved_height);
+			exit(1);
+		}
+	}else if (errno == ENOENT){
+		errno = 0;
+	}
+
+	resume_job_commit_listed_segments(job, framerate);
+	// Throw away whatever was encoded past the last committed segment
+	size_t segment;
+	for (segment = job->committed_segments; ; segment++){
+		resume_job_segment_filename(job, segment, filename);
+		if (unlink(filename) != 0) break;
+	}
+	errno = 0;
+	resume_job_save(job, target_width, target_height);
+}
+
+size_t resume_job_start_frame(resume_job* job){
+	return job->committed_segments * job->frames_per_segment;
+}
+
+// Called once every frame has been encoded
+// returns 1 on failure, the job is kept so nothing is lost
+int finish_resume_job(resume_job* job, char* input_filepath, char* output_filepath){
+	// The last segment is usually short, count whatever ffmpeg wrote
+	char filename[PATH_MAX];
+	size_t segment_count = job->committed_segments;
+	while (1){
+		resume_job_segment_filename(job, segment_count, filename);
+		if (access(filename, F_OK) != 0) break;
+		segment_count++;
+	}
+	errno = 0;
+	if (concat_video_segments(job->directory, job->segment_extension, segment_count, input_filepath, output_filepath) != 0) return 1;
+	remove_video_segment_directory(job->directory);
+	return 0;
+}
+
+void free_resume_job(resume_job* job){
+	free(job->directory);
+	job->directory = NULL;
+}
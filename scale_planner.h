@@ -0,0 +1,107 @@
+#define SCALE_PLAN_MAX_ROUNDS 4
+// What a resample costs per output pixel, against a waifu2x round per input pixel
+#define SCALE_PLAN_RESAMPLE_COST 0.01
+
+enum { SCALE_QUALITY_FULL, SCALE_QUALITY_BALANCED, SCALE_QUALITY_FAST };
+static const char* const scale_quality_names[] = { "full", "balanced", "fast" };
+// How small each quality lets the source get before waifu2x, or how much it lets the resample after make up
+static const double scale_quality_limits[][2] = {
+	{ 1.0, 1.0 },
+	{ 0.75, 1.25 },
+	{ 0.5, 2.0 },
+};
+
+/*
+  How frames get from the source size to the target size.
+  ffmpeg may shrink the source first, each waifu2x round doubles it and a resample makes up whatever is left,
+  in this process when frames are raw or with the result ffmpeg's scale filter when they're PNGs.
+*/
+typedef struct {
+	unsigned int source_width, source_height;
+	unsigned int input_width, input_height; // What the first round gets
+	size_t rounds;
+	unsigned int upscaled_width, upscaled_height; // What the last round makes
+	unsigned int target_width, target_height;
+	double cost; // Predicted work per frame, in megapixels going into waifu2x
+} scale_plan;
+
+int scale_plan_shrinks_source(const scale_plan* plan){
+	return plan->input_width != plan->source_width || plan->input_height != plan->source_height;
+}
+int scale_plan_resamples(const scale_plan* plan){
+	return plan->upscaled_width != plan->target_width || plan->upscaled_height != plan->target_height;
+}
+
+scale_plan make_scale_plan(unsigned int source_width, unsigned int source_height, unsigned int target_width, unsigned int target_height,
+						   size_t rounds, double input_scale){
+	scale_plan plan = {
+		.source_width = source_width,
+		.source_height = source_height,
+		.input_width = source_width,
+		.input_height = source_height,
+		.rounds = rounds,
+		.target_width = target_width,
+		.target_height = target_height
+	};
+	if (input_scale < 1.0){
+		plan.input_width = (unsigned int)lround(source_width * input_scale);
+		plan.input_height = (unsigned int)lround(source_height * input_scale);
+		if (plan.input_width == 0) plan.input_width = 1;
+		if (plan.input_height == 0) plan.input_height = 1;
+	}
+	plan.upscaled_width = plan.input_width << rounds;
+	plan.upscaled_height = plan.input_height << rounds;
+
+	// Each round has four times the pixels of the one before
+	double pixels = (double)plan.input_width * plan.input_height;
+	size_t round;
+	for (round = 0; round < rounds; round++, pixels *= 4) plan.cost += pixels;
+	if (scale_plan_shrinks_source(&plan)) plan.cost += SCALE_PLAN_RESAMPLE_COST * source_width * source_height;
+	if (scale_plan_resamples(&plan)) plan.cost += SCALE_PLAN_RESAMPLE_COST * target_width * target_height;
+	plan.cost /= 1e6;
+	return plan;
+}
+
+/*
+  Fills candidates with the cheapest plan for each number of rounds between min_rounds and max_rounds that the quality allows.
+  A plan either shrinks the source so the rounds overshoot the target by less, or resamples up what the rounds fall short by, never both.
+  returns the index of the cheapest, the one with the most rounds makes up anything too big for all of them
+*/
+size_t plan_scale(unsigned int source_width, unsigned int source_height, unsigned int target_width, unsigned int target_height,
+				  int quality, size_t min_rounds, size_t max_rounds, scale_plan* candidates, size_t* candidate_count){
+	const double min_input_scale = scale_quality_limits[quality][0];
+	const double max_resample_scale = scale_quality_limits[quality][1];
+	const double width_scale = (double)target_width / source_width;
+	const double height_scale = (double)target_height / source_height;
+	const double target_scale = (width_scale > height_scale) ? width_scale : height_scale;
+
+	size_t best = 0;
+	size_t rounds;
+	*candidate_count = 0;
+	for (rounds = min_rounds; rounds <= max_rounds; rounds++){
+		const double rounds_scale = (double)(1 << rounds);
+		double input_scale = target_scale / rounds_scale;
+		if (input_scale < min_input_scale) input_scale = min_input_scale;
+		// Too small to reach the target without a resample, which has to be small enough itself
+		if (input_scale > 1.0){
+			if (target_scale > rounds_scale * max_resample_scale && rounds < max_rounds) continue;
+			input_scale = 1.0;
+		}
+		candidates[*candidate_count] = make_scale_plan(source_width, source_height, target_width, target_height, rounds, input_scale);
+		if (candidates[*candidate_count].cost < candidates[best].cost) best = *candidate_count;
+		(*candidate_count)++;
+	}
+	return best;
+}
+
+// Something like "1280x720 shrunk to 960x540, 1 round to 1920x1080"
+void describe_scale_plan(const scale_plan* plan, char* description, size_t length){
+	int written = snprintf(description, length, "%ux%u", plan->source_width, plan->source_height);
+	if (scale_plan_shrinks_source(plan) && written < length)
+		written += snprintf(description + written, length - written, " shrunk to %ux%u", plan->input_width, plan->input_height);
+	if (plan->rounds > 0 && written < length)
+		written += snprintf(description + written, length - written, ", %zu round%s to %ux%u",
+							plan->rounds, (plan->rounds == 1) ? "" : "s", plan->upscaled_width, plan->upscaled_height);
+	if (scale_plan_resamples(plan) && written < length)
+		snprintf(description + written, length - written, ", resampled to %ux%u", plan->target_width, plan->target_height);
+}
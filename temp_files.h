@@ -2,85 +2,104 @@
 #include <sys/types.h>
 
 #define TEMP_DIR "/dev/shm/anime-upscaler/"
-#define TEMP_FILE_PATTERN "anime-upscaler-tempfile-XXXXXX"
-#define TEMP_FILE_PATH_PATTERN TEMP_DIR TEMP_FILE_PATTERN
+#define TEMP_DIRECTORY_PATTERN TEMP_DIR "run-XXXXXX"
+#define TEMP_FRAME_PATTERN "%s/frame_%05zu"
+#define TEMP_FRAME_NAME_EXTRA 32 // Room for "/frame_00000_output.png" after the folder
 
 typedef struct {
-	char absolute_filename[PATH_MAX];
+	char* absolute_filename;
 } temp_file;
-temp_file* create_temp_file(char* access_type){
-	struct stat st = {0};
-	if (stat(TEMP_DIR, &st) == -1){
-		mkdir(TEMP_DIR, 0700);
-	}
-	
-	char filename[] = TEMP_FILE_PATH_PATTERN;
-	int file_descriptor = mkstemp(filename);
-	if (file_descriptor == -1){
-		fprintf(stderr, "Failed to create temp file\n");
+
+/*
+  Every temp frame's files go in one folder made for this run, named after the frame's slot,
+  and all of their names are kept in one allocation.
+  Setting up a slot costs no syscalls at all, its files are only made when something is first written to them.
+*/
+typedef struct {
+	char directory[PATH_MAX];
+	char extension[8]; // The format the upscaler should write, e.g. ".png"
+	size_t slot_count;
+	size_t name_length;
+	char* names; // An input then an output name for each slot
+	temp_file* files;
+	char generic_output_filename[PATH_MAX]; // The output path with the input's basename replaced with %s
+} temp_frame_store;
+
+void init_temp_frame_store(temp_frame_store* store, size_t slot_count, const char* output_extension){
+	if (mkdir(TEMP_DIR, 0700) != 0) errno = 0;
+	strcpy(store->directory, TEMP_DIRECTORY_PATTERN);
+	if (mkdtemp(store->directory) == NULL){
+		fprintf(stderr, "Failed to create a temp folder in %s: %s\n", TEMP_DIR, strerror(errno));
 		exit(1);
 	}
-
-	temp_file* tfile = malloc(sizeof(temp_file));
-	
-	realpath(filename, tfile->absolute_filename);
-	close(file_descriptor);
-//tfile->file = fdopen(file_descriptor, access_type);
-	return tfile;
-}
-void free_temp_file(temp_file** tfile_pointer){
-	// The temp file will automatically be destroyed once unlinked
-	unlink((*tfile_pointer)->absolute_filename);
-	//fclose((*tfile_pointer)->file);
-	free(*tfile_pointer);
-	*tfile_pointer = NULL;
+	snprintf(store->extension, sizeof(store->extension), "%s", output_extension);
+	store->slot_count = slot_count;
+	store->name_length = strlen(store->directory) + TEMP_FRAME_NAME_EXTRA;
+	store->names = calloc(slot_count * 2, store->name_length);
+	store->files = calloc(slot_count, sizeof(temp_file));
+	snprintf(store->generic_output_filename, PATH_MAX, "%s/%%s_output%s", store->directory, store->extension);
 }
-void reopen_temp_file(temp_file* tfile, char* access_type){
-	//tfile->file = freopen(tfile->absolute_filename, access_type, tfile->file);
+// Every frame has to have been freed first
+void free_temp_frame_store(temp_frame_store* store){
+	if (store->names == NULL) return;
+	rmdir(store->directory);
+	free(store->names);
+	free(store->files);
+	store->names = NULL;
+	store->files = NULL;
 }
 
 #define INITIAL_FRAME_BUFFER_SIZE 64
 
+typedef struct {
+	unsigned int x, y, width, height;
+} frame_rect;
+
 
 typedef struct {
 	expandable_buffer buffer;
+	// These point into the temp_frame_store
 	temp_file* file;
 	char* generic_output_filename; // The absolute path with the basename replaced with %s
 	char* output_filename;
-} temp_frame;
-temp_frame create_temp_frame(){
-	temp_frame frame;
-	frame.buffer = create_expandable_buffer(INITIAL_FRAME_BUFFER_SIZE);
-	frame.file = create_temp_file("wb+");
 
-	const char* new_basename = "/%s_output.png";
+	BYTE* source_pixels; // The frame's slot in the frame ring when using raw transport
+	size_t result_offset; // Where the data for the result ffmpeg starts in buffer
+	const BYTE* encode_data; // What the result ffmpeg gets, another frame's data when this one repeats it
+	size_t encode_size;
 
-	char* absolute_filename_dup = strdup(frame.file->absolute_filename);
-	const char* absolute_filename_dirname = dirname(absolute_filename_dup);
-	const size_t dirname_length = strlen(absolute_filename_dirname);
-	// TODO: Is it an issue if total_length > PATH_MAX?
-	const size_t total_length = dirname_length + strlen(new_basename) + 1;
-	frame.generic_output_filename = calloc(total_length, sizeof(char));
-	strcpy(frame.generic_output_filename, absolute_filename_dirname);
-	strcpy(frame.generic_output_filename + dirname_length, new_basename);
-	free(absolute_filename_dup);
+	uint64_t content_hash; // Hash of the decoded frame
+	size_t content_size;
+	int repeats_previous; // Set if the frame is a copy of the one before it and doesn't need upscaling
 
-	absolute_filename_dup = strdup(frame.file->absolute_filename);
-	const char* absolute_filename_basename = basename(absolute_filename_dup);
-	frame.output_filename = calloc(PATH_MAX, sizeof(char));
-	snprintf(frame.output_filename, PATH_MAX, frame.generic_output_filename, absolute_filename_basename);
-	free(absolute_filename_dup);
+	// Set if only part of the frame changed since the one before it, then only crop is upscaled, see dirty_tiles.h
+	int partial;
+	frame_rect changed;
+	frame_rect crop; // changed with padding round it, so the upscaler has the context it needs at the edges
+} temp_frame;
+temp_frame create_temp_frame(temp_frame_store* store, size_t slot){
+	temp_frame frame;
+	frame.buffer = create_expandable_buffer(INITIAL_FRAME_BUFFER_SIZE);
+	frame.source_pixels = NULL;
+	frame.result_offset = 0;
+	frame.content_hash = 0;
+	frame.content_size = 0;
+	frame.repeats_previous = 0;
+	frame.partial = 0;
 
-	// Open and close the file to make sure it exists
-	fclose(fopen(frame.output_filename, "wb"));
-	
-	//fprintf(stdout, "temp file output name is: %s\n", frame.output_filename);
+	frame.file = &store->files[slot];
+	frame.file->absolute_filename = store->names + slot * 2 * store->name_length;
+	snprintf(frame.file->absolute_filename, store->name_length, TEMP_FRAME_PATTERN, store->directory, slot);
+	frame.output_filename = frame.file->absolute_filename + store->name_length;
+	snprintf(frame.output_filename, store->name_length, TEMP_FRAME_PATTERN "_output%s", store->directory, slot, store->extension);
+	frame.generic_output_filename = store->generic_output_filename;
 	return frame;
 }
 void free_temp_frame(temp_frame* frame){
 	free_expandable_buffer(&frame->buffer);
-	free_temp_file(&frame->file);
-	free(frame->generic_output_filename);
+	// Either file might not have been written yet
+	unlink(frame->file->absolute_filename);
 	unlink(frame->output_filename);
-	free(frame->output_filename);
+	errno = 0;
+	frame->file = NULL;
 }
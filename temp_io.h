@@ -0,0 +1,301 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define TEMP_IO_ENTRIES 256
+#define TEMP_IO_CHAIN_LENGTH 4 // Open, header, data and close
+#define TEMP_IO_FILE_SLOTS (TEMP_IO_ENTRIES / TEMP_IO_CHAIN_LENGTH)
+
+// What each completion was for, kept in the low bits of its user_data under the file's position
+enum { TEMP_IO_OPEN, TEMP_IO_HEADER, TEMP_IO_DATA, TEMP_IO_CLOSE, TEMP_IO_STATX, TEMP_IO_RENAME };
+#define TEMP_IO_OP_BITS 3
+
+/*
+  Temp file I/O for a whole batch at once through io_uring, instead of a few blocking syscalls per frame.
+  Each file is opened straight into a registered file slot, written or read and closed as one linked chain,
+  and every chain queued is submitted with one io_uring_enter, or a few if they don't all fit in the ring.
+  Anything that doesn't complete in full is marked failed, for the caller to redo the old way.
+*/
+typedef struct {
+	int ring_fd; // -1 if io_uring isn't available
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_mapping;
+	size_t sq_mapping_size;
+	void* cq_mapping; // The same as sq_mapping on kernels with IORING_FEAT_SINGLE_MMAP
+	size_t cq_mapping_size;
+	size_t sqes_size;
+
+	unsigned tail; // Our copy of the submission queue tail
+	unsigned queued; // Entries added since the last submit
+	unsigned file_slots_used;
+	int broken; // Set once io_uring_enter fails for good, nothing is queued after that
+	BYTE* fixed_buffer; // Registered once so writes from it don't pin its pages every time, NULL if it couldn't be
+	size_t fixed_buffer_size;
+
+	size_t max_files;
+	int* failed;
+	size_t* expected_lengths; // The header and data length of each file
+	struct statx* stats;
+} temp_io;
+
+// returns 1 if io_uring can't be used, the caller should use blocking calls instead
+int init_temp_io(temp_io* io, size_t max_files, BYTE* fixed_buffer, size_t fixed_buffer_size){
+	memset(io, 0, sizeof(*io));
+	io->ring_fd = -1;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring_fd = syscall(__NR_io_uring_setup, TEMP_IO_ENTRIES, &params);
+	if (ring_fd == -1){
+		errno = 0; // Old kernel, or blocked by a seccomp filter
+		return 1;
+	}
+	// Opening into a slot needs a sparse file table, which came with 5.19
+	struct io_uring_rsrc_register files = { .nr = TEMP_IO_FILE_SLOTS, .flags = IORING_RSRC_REGISTER_SPARSE };
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == -1){
+		close(ring_fd);
+		errno = 0;
+		return 1;
+	}
+
+	io->sq_mapping_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	io->cq_mapping_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP){
+		if (io->cq_mapping_size > io->sq_mapping_size) io->sq_mapping_size = io->cq_mapping_size;
+		io->cq_mapping_size = io->sq_mapping_size;
+	}
+	io->sq_mapping = mmap(NULL, io->sq_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	io->cq_mapping = (params.features & IORING_FEAT_SINGLE_MMAP) ? io->sq_mapping
+		: mmap(NULL, io->cq_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (io->sq_mapping == MAP_FAILED || io->cq_mapping == MAP_FAILED || io->sqes == MAP_FAILED){
+		if (io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_size);
+		if (io->cq_mapping != MAP_FAILED && io->cq_mapping != io->sq_mapping) munmap(io->cq_mapping, io->cq_mapping_size);
+		if (io->sq_mapping != MAP_FAILED) munmap(io->sq_mapping, io->sq_mapping_size);
+		close(ring_fd);
+		memset(io, 0, sizeof(*io));
+		io->ring_fd = -1;
+		errno = 0;
+		return 1;
+	}
+
+	BYTE* sq = io->sq_mapping;
+	BYTE* cq = io->cq_mapping;
+	io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	io->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	io->cq_head = (unsigned*)(cq + params.cq_off.head);
+	io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	io->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	io->tail = *io->sq_tail;
+	// Entries are always used in order, so the index array never changes
+	unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+	unsigned i;
+	for (i = 0; i < params.sq_entries; i++) sq_array[i] = i;
+
+	if (fixed_buffer != NULL){
+		struct iovec buffer = { .iov_base = fixed_buffer, .iov_len = fixed_buffer_size };
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &buffer, 1) == 0){
+			io->fixed_buffer = fixed_buffer;
+			io->fixed_buffer_size = fixed_buffer_size;
+		}
+		errno = 0; // Over RLIMIT_MEMLOCK is fine, writes from it just aren't fixed
+	}
+
+	io->ring_fd = ring_fd;
+	io->max_files = max_files;
+	io->failed = calloc(max_files, sizeof(int));
+	io->expected_lengths = calloc(max_files * 2, sizeof(size_t));
+	io->stats = calloc(max_files, sizeof(struct statx));
+	return 0;
+}
+void free_temp_io(temp_io* io){
+	if (io->ring_fd == -1) return;
+	munmap(io->sqes, io->sqes_size);
+	if (io->cq_mapping != io->sq_mapping) munmap(io->cq_mapping, io->cq_mapping_size);
+	munmap(io->sq_mapping, io->sq_mapping_size);
+	close(io->ring_fd); // Closes anything left in the file slots
+	free(io->failed);
+	free(io->expected_lengths);
+	free(io->stats);
+	io->ring_fd = -1;
+}
+
+// returns 1 if batches can go through the ring
+int temp_io_usable(const temp_io* io){
+	return io->ring_fd != -1 && !io->broken;
+}
+
+// Clears the failures of the first file_count files
+void temp_io_begin(temp_io* io, size_t file_count){
+	memset(io->failed, 0, file_count * sizeof(int));
+}
+
+void temp_io_complete(temp_io* io, const struct io_uring_cqe* cqe){
+	const size_t position = cqe->user_data >> TEMP_IO_OP_BITS;
+	const int op = cqe->user_data & ((1 << TEMP_IO_OP_BITS) - 1);
+	// Whatever was linked after a failure comes back cancelled
+	if (cqe->res < 0){
+		io->failed[position] = 1;
+	}else if ((op == TEMP_IO_HEADER || op == TEMP_IO_DATA) && (size_t)cqe->res != io->expected_lengths[position * 2 + op - TEMP_IO_HEADER]){
+		io->failed[position] = 1;
+	}
+}
+
+// Reaps whatever has completed
+// returns how many that was
+unsigned temp_io_reap(temp_io* io){
+	unsigned head = *io->cq_head;
+	const unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned reaped = 0;
+	for (; head != tail; head++, reaped++)
+		temp_io_complete(io, &io->cqes[head & io->cq_mask]);
+	__atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+// Submits everything queued and waits for all of it to complete
+void temp_io_flush(temp_io* io){
+	unsigned to_submit = io->queued;
+	unsigned waiting = io->queued;
+	io->queued = 0;
+	io->file_slots_used = 0;
+	if (io->broken) return;
+	__atomic_store_n(io->sq_tail, io->tail, __ATOMIC_RELEASE);
+	while (waiting > 0){
+		int submitted = syscall(__NR_io_uring_enter, io->ring_fd, to_submit, waiting, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted == -1 && (errno == EINTR || errno == EAGAIN)){
+			errno = 0;
+			continue;
+		}
+		if (submitted == -1){
+			fprintf(stderr, "Error submitting temp file I/O: %s\n", strerror(errno));
+			errno = 0;
+			io->broken = 1;
+			break;
+		}
+		to_submit -= submitted;
+		waiting -= temp_io_reap(io);
+	}
+	if (!io->broken) return;
+
+	// What the kernel already took still reads and writes the buffers, so it has to finish before anything is redone.
+	// What it didn't take stays in the ring, which is never submitted to again
+	unsigned in_flight = waiting - to_submit;
+	while (in_flight > 0){
+		if (syscall(__NR_io_uring_enter, io->ring_fd, 0, in_flight, IORING_ENTER_GETEVENTS, NULL, 0) == -1){
+			errno = 0;
+			// Completions still turn up without waiting for them, just not as promptly
+			const struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+			nanosleep(&pause, NULL);
+		}
+		in_flight -= temp_io_reap(io);
+	}
+	// Everything is redone the old way, which reports the error if it fails again
+	size_t i;
+	for (i = 0; i < io->max_files; i++) io->failed[i] = 1;
+}
+
+// Flushes first if a chain of entry_count entries, using a file slot if uses_file_slot, wouldn't fit
+// returns 1 if the ring is broken, the file is marked failed instead
+int temp_io_reserve(temp_io* io, size_t position, unsigned entry_count, int uses_file_slot){
+	if (io->queued + entry_count > TEMP_IO_ENTRIES || (uses_file_slot && io->file_slots_used == TEMP_IO_FILE_SLOTS))
+		temp_io_flush(io);
+	if (io->broken) io->failed[position] = 1;
+	return io->broken;
+}
+
+struct io_uring_sqe* temp_io_add(temp_io* io, int opcode, size_t position, int op, int flags){
+	struct io_uring_sqe* sqe = &io->sqes[io->tail & io->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->user_data = ((uint64_t)position << TEMP_IO_OP_BITS) | op;
+	io->tail++;
+	io->queued++;
+	return sqe;
+}
+
+// Starts a chain by opening the file into a free slot
+// returns the slot
+unsigned temp_io_open(temp_io* io, size_t position, const char* filename, int flags){
+	const unsigned slot = io->file_slots_used++;
+	struct io_uring_sqe* sqe = temp_io_add(io, IORING_OP_OPENAT, position, TEMP_IO_OPEN, IOSQE_IO_LINK);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)filename;
+	sqe->open_flags = flags; // Slots are never inherited, and O_CLOEXEC is refused for them
+	sqe->len = 0600;
+	sqe->file_index = slot + 1;
+	return slot;
+}
+void temp_io_close(temp_io* io, size_t position, unsigned slot){
+	struct io_uring_sqe* sqe = temp_io_add(io, IORING_OP_CLOSE, position, TEMP_IO_CLOSE, 0);
+	sqe->file_index = slot + 1;
+}
+
+// Queues writing the header then the data as the whole of the file, both have to stay put until the flush
+void temp_io_write(temp_io* io, size_t position, const char* filename, const BYTE* header, size_t header_length, const BYTE* data, size_t length){
+	if (temp_io_reserve(io, position, TEMP_IO_CHAIN_LENGTH, 1) != 0) return;
+	io->expected_lengths[position * 2] = header_length;
+	io->expected_lengths[position * 2 + 1] = length;
+
+	const unsigned slot = temp_io_open(io, position, filename, O_WRONLY | O_CREAT | O_TRUNC);
+	struct io_uring_sqe* sqe;
+	if (header_length != 0){
+		sqe = temp_io_add(io, IORING_OP_WRITE, position, TEMP_IO_HEADER, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		sqe->fd = slot;
+		sqe->addr = (uintptr_t)header;
+		sqe->len = header_length;
+		sqe->off = 0;
+	}
+	const int fixed = io->fixed_buffer != NULL && data >= io->fixed_buffer && data + length <= io->fixed_buffer + io->fixed_buffer_size;
+	sqe = temp_io_add(io, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, position, TEMP_IO_DATA, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+	sqe->fd = slot;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = length;
+	sqe->off = header_length;
+	sqe->buf_index = 0;
+	temp_io_close(io, position, slot);
+}
+
+// Queues finding the file's size, which ends up in stats once flushed
+void temp_io_stat(temp_io* io, size_t position, const char* filename){
+	if (temp_io_reserve(io, position, 1, 0) != 0) return;
+	struct io_uring_sqe* sqe = temp_io_add(io, IORING_OP_STATX, position, TEMP_IO_STATX, 0);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)filename;
+	sqe->len = STATX_SIZE;
+	sqe->off = (uintptr_t)&io->stats[position];
+}
+
+// Queues reading the first length bytes of the file
+void temp_io_read(temp_io* io, size_t position, const char* filename, BYTE* data, size_t length){
+	if (temp_io_reserve(io, position, TEMP_IO_CHAIN_LENGTH - 1, 1) != 0) return;
+	io->expected_lengths[position * 2 + 1] = length;
+
+	const unsigned slot = temp_io_open(io, position, filename, O_RDONLY);
+	struct io_uring_sqe* sqe = temp_io_add(io, IORING_OP_READ, position, TEMP_IO_DATA, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+	sqe->fd = slot;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = length;
+	sqe->off = 0;
+	temp_io_close(io, position, slot);
+}
+
+void temp_io_rename(temp_io* io, size_t position, const char* old_filename, const char* new_filename){
+	if (temp_io_reserve(io, position, 1, 0) != 0) return;
+	struct io_uring_sqe* sqe = temp_io_add(io, IORING_OP_RENAMEAT, position, TEMP_IO_RENAME, 0);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)old_filename;
+	sqe->len = AT_FDCWD;
+	sqe->addr2 = (uintptr_t)new_filename;
+}
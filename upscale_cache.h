@@ -0,0 +1,393 @@
+#include <sys/file.h>
+#include <dirent.h>
+
+#define UPSCALE_CACHE_INDEX_FILE "index"
+#define UPSCALE_CACHE_LOCK_FILE "index.lock"
+#define UPSCALE_CACHE_INDEX_MAGIC "AUCACHE1"
+#define UPSCALE_CACHE_INITIAL_CAPACITY 1024
+#define DEFAULT_UPSCALE_CACHE_SIZE (10ULL << 30)
+
+/*
+  Upscaled frames kept on disk between runs, keyed by the decoded frame and the settings used on it.
+  The whole index lives in memory and is written out as one file, so lookups never touch the filesystem.
+  Other processes can share the directory, so what this run added and removed is kept aside
+  and replayed onto whatever index is on disk when it's saved.
+  Entry files a crashed run never got to index are picked up then too, as the oldest entries.
+*/
+typedef struct {
+	uint64_t content_hash; // 0 marks an empty slot in the table
+	uint64_t content_size;
+	uint64_t settings_hash; // Model, mode, noise level, round and output format
+	uint64_t stored_size;
+	uint64_t last_used;
+} upscale_cache_entry;
+
+typedef struct {
+	upscale_cache_entry entry;
+	int removed;
+} upscale_cache_change;
+
+typedef struct {
+	char* directory;
+	uint64_t max_size;
+	uint64_t total_size;
+
+	upscale_cache_entry* entries; // Open addressing on content_hash ^ settings_hash
+	size_t capacity;
+	size_t count;
+	uint64_t clock;
+
+	upscale_cache_change* changes;
+	size_t change_count;
+	size_t change_capacity;
+
+	size_t hits;
+	size_t misses;
+} upscale_cache;
+
+uint64_t upscale_cache_settings_hash(const char* model, const char* mode, int noise_level, size_t round, const char* format){
+	char settings[PATH_MAX + 64];
+	int length = snprintf(settings, sizeof(settings), "%s|%s|%d|%zu|%s", model, mode, noise_level, round, format);
+	return hash_frame_data((BYTE*)settings, length);
+}
+
+void upscale_cache_entry_filename(upscale_cache* cache, upscale_cache_entry* entry, char* filename){
+	// Spread the files over 256 directories
+	snprintf(filename, PATH_MAX, "%s/%02x/%016llx%016llx%016llx", cache->directory,
+			 (unsigned int)(entry->content_hash >> 56),
+			 (unsigned long long)entry->content_hash, (unsigned long long)entry->content_size, (unsigned long long)entry->settings_hash);
+}
+
+upscale_cache_entry* upscale_cache_find_slot(upscale_cache* cache, uint64_t content_hash, uint64_t content_size, uint64_t settings_hash){
+	if (content_hash == 0) content_hash = 1; // 0 is kept for empty slots
+	size_t slot = (content_hash ^ settings_hash) & (cache->capacity - 1);
+	while (1){
+		upscale_cache_entry* entry = &cache->entries[slot];
+		if (entry->content_hash == 0) return entry;
+		if (entry->content_hash == content_hash && entry->content_size == content_size && entry->settings_hash == settings_hash) return entry;
+		slot = (slot + 1) & (cache->capacity - 1);
+	}
+}
+
+void upscale_cache_resize(upscale_cache* cache, size_t new_capacity){
+	upscale_cache_entry* old_entries = cache->entries;
+	size_t old_capacity = cache->capacity;
+	cache->entries = calloc(new_capacity, sizeof(upscale_cache_entry));
+	cache->capacity = new_capacity;
+	size_t i;
+	for (i = 0; i < old_capacity; i++){
+		if (old_entries[i].content_hash == 0) continue;
+		*upscale_cache_find_slot(cache, old_entries[i].content_hash, old_entries[i].content_size, old_entries[i].settings_hash) = old_entries[i];
+	}
+	free(old_entries);
+}
+
+void upscale_cache_record_change(upscale_cache* cache, const upscale_cache_entry* entry, int removed){
+	if (cache->change_count == cache->change_capacity){
+		cache->change_capacity = (cache->change_capacity == 0) ? 64 : cache->change_capacity * 2;
+		cache->changes = realloc(cache->changes, cache->change_capacity * sizeof(upscale_cache_change));
+	}
+	cache->changes[cache->change_count].entry = *entry;
+	cache->changes[cache->change_count].removed = removed;
+	cache->change_count++;
+}
+
+// Puts the entry in the table unless it's already there
+void upscale_cache_insert(upscale_cache* cache, const upscale_cache_entry* entry){
+	if ((cache->count + 1) * 2 > cache->capacity) upscale_cache_resize(cache, cache->capacity * 2);
+	upscale_cache_entry* slot = upscale_cache_find_slot(cache, entry->content_hash, entry->content_size, entry->settings_hash);
+	if (slot->content_hash != 0) return;
+	*slot = *entry;
+	cache->count++;
+	cache->total_size += entry->stored_size;
+	if (entry->last_used > cache->clock) cache->clock = entry->last_used;
+}
+
+// Takes the entry out of the table without leaving a hole in any probe sequence
+void upscale_cache_remove(upscale_cache* cache, upscale_cache_entry* entry){
+	cache->total_size -= entry->stored_size;
+	cache->count--;
+	entry->content_hash = 0;
+
+	size_t slot = (entry - cache->entries + 1) & (cache->capacity - 1);
+	while (cache->entries[slot].content_hash != 0){
+		upscale_cache_entry moved = cache->entries[slot];
+		cache->entries[slot].content_hash = 0;
+		*upscale_cache_find_slot(cache, moved.content_hash, moved.content_size, moved.settings_hash) = moved;
+		slot = (slot + 1) & (cache->capacity - 1);
+	}
+}
+
+void init_upscale_cache_table(upscale_cache* cache, char* directory, uint64_t max_size){
+	cache->directory = directory;
+	cache->max_size = max_size;
+	cache->total_size = 0;
+	cache->capacity = UPSCALE_CACHE_INITIAL_CAPACITY;
+	cache->entries = calloc(cache->capacity, sizeof(upscale_cache_entry));
+	cache->count = 0;
+	cache->clock = 0;
+	cache->changes = NULL;
+	cache->change_count = 0;
+	cache->change_capacity = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+// Adds the entries of the index on disk to the table
+void upscale_cache_load_index(upscale_cache* cache){
+	char index_filename[PATH_MAX];
+	snprintf(index_filename, PATH_MAX, "%s/%s", cache->directory, UPSCALE_CACHE_INDEX_FILE);
+	FILE* index = fopen(index_filename, "rb");
+	if (index == NULL){
+		// New cache
+		if (errno == ENOENT) errno = 0;
+		return;
+	}
+
+	char magic[8];
+	uint64_t entry_count;
+	if (fread(magic, 1, sizeof(magic), index) != sizeof(magic) || memcmp(magic, UPSCALE_CACHE_INDEX_MAGIC, sizeof(magic)) != 0
+		|| fread(&entry_count, sizeof(entry_count), 1, index) != 1){
+		fprintf(stderr, "Ignoring unreadable cache index %s\n", index_filename);
+		fclose(index);
+		return;
+	}
+	upscale_cache_entry entry;
+	while (entry_count-- > 0 && fread(&entry, sizeof(entry), 1, index) == 1){
+		if (entry.content_hash == 0) continue;
+		upscale_cache_insert(cache, &entry);
+	}
+	fclose(index);
+}
+
+void init_upscale_cache(upscale_cache* cache, char* directory, uint64_t max_size){
+	init_upscale_cache_table(cache, directory, max_size);
+	if (mkdir(directory, 0700) != 0 && errno == EEXIST) errno = 0;
+	upscale_cache_load_index(cache);
+}
+
+// Reads the cached upscale into the buffer
+// returns 1 on a miss
+int upscale_cache_read(upscale_cache* cache, uint64_t content_hash, uint64_t content_size, uint64_t settings_hash, expandable_buffer* buffer){
+	upscale_cache_entry* entry = upscale_cache_find_slot(cache, content_hash, content_size, settings_hash);
+	if (entry->content_hash == 0){
+		cache->misses++;
+		return 1;
+	}
+
+	char filename[PATH_MAX];
+	upscale_cache_entry_filename(cache, entry, filename);
+	FILE* file = fopen(filename, "rb");
+	int failed = (file == NULL) || expandable_buffer_read_file_in(buffer, file) != 0 || buffer->size != entry->stored_size;
+	if (file != NULL) fclose(file);
+	if (failed){
+		// Deleted or damaged behind our back
+		unlink(filename);
+		upscale_cache_record_change(cache, entry, 1);
+		upscale_cache_remove(cache, entry);
+		cache->misses++;
+		return 1;
+	}
+	entry->last_used = ++cache->clock;
+	cache->hits++;
+	return 0;
+}
+
+int compare_upscale_cache_entries_by_age(const void* a, const void* b){
+	uint64_t a_used = (*(upscale_cache_entry* const*)a)->last_used;
+	uint64_t b_used = (*(upscale_cache_entry* const*)b)->last_used;
+	return (a_used > b_used) - (a_used < b_used);
+}
+
+// Drops the least recently used entries until the cache is comfortably under its size limit
+void upscale_cache_evict(upscale_cache* cache){
+	const uint64_t target_size = cache->max_size - cache->max_size / 10;
+	upscale_cache_entry* entries = calloc(cache->count, sizeof(upscale_cache_entry));
+	upscale_cache_entry** by_age = calloc(cache->count, sizeof(upscale_cache_entry*));
+	size_t entry_count = 0;
+	size_t i;
+	for (i = 0; i < cache->capacity; i++){
+		if (cache->entries[i].content_hash == 0) continue;
+		entries[entry_count] = cache->entries[i];
+		by_age[entry_count] = &entries[entry_count];
+		entry_count++;
+	}
+	qsort(by_age, entry_count, sizeof(upscale_cache_entry*), compare_upscale_cache_entries_by_age);
+
+	char filename[PATH_MAX];
+	for (i = 0; i < entry_count && cache->total_size > target_size; i++){
+		upscale_cache_entry_filename(cache, by_age[i], filename);
+		unlink(filename);
+		upscale_cache_record_change(cache, by_age[i], 1);
+		upscale_cache_remove(cache, upscale_cache_find_slot(cache, by_age[i]->content_hash, by_age[i]->content_size, by_age[i]->settings_hash));
+	}
+	free(by_age);
+	free(entries);
+}
+
+// Stores an upscaled frame
+void upscale_cache_write(upscale_cache* cache, uint64_t content_hash, uint64_t content_size, uint64_t settings_hash, expandable_buffer* buffer){
+	if (buffer->size > cache->max_size) return;
+	if ((cache->count + 1) * 2 > cache->capacity) upscale_cache_resize(cache, cache->capacity * 2);
+	upscale_cache_entry* entry = upscale_cache_find_slot(cache, content_hash, content_size, settings_hash);
+	if (entry->content_hash != 0) return; // Already stored
+
+	upscale_cache_entry new_entry = {
+		.content_hash = content_hash ? content_hash : 1,
+		.content_size = content_size,
+		.settings_hash = settings_hash,
+		.stored_size = buffer->size,
+		.last_used = ++cache->clock
+	};
+	char filename[PATH_MAX];
+	char temp_filename[PATH_MAX + 32];
+	upscale_cache_entry_filename(cache, &new_entry, filename);
+	// Named for this process, another one could be storing the same frame
+	snprintf(temp_filename, sizeof(temp_filename), "%s.%d.tmp", filename, (int)getpid());
+
+	char* subdirectory = strdup(filename);
+	if (mkdir(dirname(subdirectory), 0700) != 0 && errno == EEXIST) errno = 0;
+	free(subdirectory);
+
+	// Write then rename so a crash never leaves a truncated entry behind
+	FILE* file = fopen(temp_filename, "wb");
+	if (file == NULL) return;
+	int failed = fwrite(buffer->pointer, 1, buffer->size, file) != buffer->size;
+	failed |= fclose(file) != 0;
+	if (failed || rename(temp_filename, filename) != 0){
+		unlink(temp_filename);
+		return;
+	}
+
+	*entry = new_entry;
+	cache->count++;
+	cache->total_size += new_entry.stored_size;
+	upscale_cache_record_change(cache, &new_entry, 0);
+	if (cache->total_size > cache->max_size) upscale_cache_evict(cache);
+}
+
+// Adds entry files that no index counts, left by a run that was killed before it saved,
+// and removes the temp files of ones that died while writing
+void upscale_cache_adopt_orphans(upscale_cache* cache){
+	char subdirectory_name[PATH_MAX];
+	char filename[PATH_MAX + 256];
+	unsigned int subdirectory;
+	for (subdirectory = 0; subdirectory < 256; subdirectory++){
+		snprintf(subdirectory_name, PATH_MAX, "%s/%02x", cache->directory, subdirectory);
+		DIR* directory = opendir(subdirectory_name);
+		if (directory == NULL) continue;
+		struct dirent* file;
+		while ((file = readdir(directory)) != NULL){
+			if (file->d_name[0] == '.') continue;
+			snprintf(filename, sizeof(filename), "%s/%s", subdirectory_name, file->d_name);
+			unsigned long long content_hash, content_size, settings_hash;
+			int pid, name_length = 0;
+			if (sscanf(file->d_name, "%16llx%16llx%16llx%n", &content_hash, &content_size, &settings_hash, &name_length) != 3 || name_length != 48) continue;
+			if (file->d_name[48] != '\0'){
+				// Another process's entry on its way in, unless that process is gone
+				if (sscanf(file->d_name + 48, ".%d.tmp", &pid) == 1 && kill(pid, 0) != 0 && errno == ESRCH) unlink(filename);
+				continue;
+			}
+			const upscale_cache_entry* entry = upscale_cache_find_slot(cache, content_hash, content_size, settings_hash);
+			struct stat file_stat;
+			if (entry->content_hash != 0 || stat(filename, &file_stat) != 0) continue;
+			upscale_cache_entry orphan = {
+				.content_hash = content_hash,
+				.content_size = content_size,
+				.settings_hash = settings_hash,
+				.stored_size = file_stat.st_size,
+				.last_used = 0
+			};
+			upscale_cache_insert(cache, &orphan);
+		}
+		closedir(directory);
+	}
+	errno = 0;
+}
+
+/*
+  Rereads the index under a lock and replays this run's changes onto it before writing it back,
+  so entries other processes stored since we started stay counted and can still be evicted
+*/
+void upscale_cache_save(upscale_cache* cache){
+	char lock_filename[PATH_MAX];
+	snprintf(lock_filename, PATH_MAX, "%s/%s", cache->directory, UPSCALE_CACHE_LOCK_FILE);
+	const int lock = open(lock_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lock == -1 || flock(lock, LOCK_EX) != 0){
+		fprintf(stderr, "Failed to lock cache index %s: %s\n", lock_filename, strerror(errno));
+		if (lock != -1) close(lock);
+		errno = 0;
+		return;
+	}
+
+	upscale_cache merged;
+	init_upscale_cache_table(&merged, cache->directory, cache->max_size);
+	upscale_cache_load_index(&merged);
+	size_t i;
+	for (i = 0; i < merged.capacity; i++){
+		upscale_cache_entry* entry = &merged.entries[i];
+		if (entry->content_hash == 0) continue;
+		const upscale_cache_entry* ours = upscale_cache_find_slot(cache, entry->content_hash, entry->content_size, entry->settings_hash);
+		if (ours->content_hash != 0 && ours->last_used > entry->last_used) entry->last_used = ours->last_used;
+	}
+	for (i = 0; i < cache->change_count; i++){
+		const upscale_cache_entry* changed = &cache->changes[i].entry;
+		upscale_cache_entry* entry = upscale_cache_find_slot(&merged, changed->content_hash, changed->content_size, changed->settings_hash);
+		if (cache->changes[i].removed){
+			if (entry->content_hash != 0) upscale_cache_remove(&merged, entry);
+		}else if (entry->content_hash != 0){
+			// Already picked up as an orphan by someone else's save
+			if (changed->last_used > entry->last_used) entry->last_used = changed->last_used;
+		}else{
+			upscale_cache_insert(&merged, changed);
+		}
+	}
+	upscale_cache_adopt_orphans(&merged);
+	if (cache->clock > merged.clock) merged.clock = cache->clock;
+	if (merged.total_size > merged.max_size) upscale_cache_evict(&merged);
+
+	char index_filename[PATH_MAX];
+	char temp_filename[PATH_MAX + 32];
+	snprintf(index_filename, PATH_MAX, "%s/%s", cache->directory, UPSCALE_CACHE_INDEX_FILE);
+	snprintf(temp_filename, sizeof(temp_filename), "%s.%d.tmp", index_filename, (int)getpid());
+
+	FILE* index = fopen(temp_filename, "wb");
+	if (index == NULL){
+		fprintf(stderr, "Failed to write cache index %s: %s\n", temp_filename, strerror(errno));
+	}else{
+		uint64_t entry_count = merged.count;
+		int failed = fwrite(UPSCALE_CACHE_INDEX_MAGIC, 1, 8, index) != 8
+			|| fwrite(&entry_count, sizeof(entry_count), 1, index) != 1;
+		for (i = 0; i < merged.capacity && !failed; i++){
+			if (merged.entries[i].content_hash == 0) continue;
+			failed = fwrite(&merged.entries[i], sizeof(upscale_cache_entry), 1, index) != 1;
+		}
+		failed |= fclose(index) != 0;
+		if (failed || rename(temp_filename, index_filename) != 0){
+			fprintf(stderr, "Failed to write cache index %s\n", index_filename);
+			unlink(temp_filename);
+		}
+	}
+	flock(lock, LOCK_UN);
+	close(lock);
+
+	// The table now matches the disk, and nothing is left to replay
+	free(cache->entries);
+	free(cache->changes);
+	free(merged.changes);
+	merged.changes = NULL;
+	merged.change_count = 0;
+	merged.change_capacity = 0;
+	merged.hits = cache->hits;
+	merged.misses = cache->misses;
+	*cache = merged;
+}
+
+void free_upscale_cache(upscale_cache* cache){
+	free(cache->entries);
+	free(cache->changes);
+	cache->entries = NULL;
+	cache->changes = NULL;
+	cache->change_count = 0;
+	cache->count = 0;
+}
@@ -0,0 +1,607 @@
+#define DAEMON_MAX_CONNECTIONS 256
+#define DAEMON_MAX_EVENTS 16
+#define DAEMON_READ_SIZE 4096
+#define DAEMON_REPLY_SIZE (PATH_MAX * 2 + 64)
+#define DEFAULT_DAEMON_JOBS 2
+
+enum { DAEMON_JOB_QUEUED, DAEMON_JOB_RUNNING, DAEMON_JOB_DONE, DAEMON_JOB_FAILED, DAEMON_JOB_CANCELLED };
+static const char* const daemon_job_state_names[] = { "queued", "running", "done", "failed", "cancelled" };
+
+// What each fd added to epoll is, stored in the top half of its event data with an index in the bottom half
+enum { DAEMON_SOURCE_LISTENER, DAEMON_SOURCE_SIGNALS, DAEMON_SOURCE_CONNECTION, DAEMON_SOURCE_WORKER };
+
+// The same names waifu2x uses for its modes
+enum { DAEMON_MODE_NOISE_SCALE, DAEMON_MODE_SCALE, DAEMON_MODE_COUNT };
+static const char* const daemon_mode_names[DAEMON_MODE_COUNT] = { "noise_scale", "scale" };
+
+// A copy of this program run for one submitted video, with the daemon's workers standing in for its own
+typedef struct {
+	size_t id;
+	int state;
+	int priority; // Higher starts first
+	int cancelled;
+	pid_t pid;
+	char* request; // The submit line, split up in place into the fields below
+	char* working_directory;
+	char* input_filepath;
+	char* output_filepath;
+	char** options;
+} daemon_job;
+
+typedef struct {
+	int fd; // -1 for a free slot
+	uint64_t generation; // Bumped when the slot is reused, so answers meant for a closed connection don't reach the next one
+	expandable_buffer partial_line;
+	int mode; // Which workers its frames go to, -1 until it asks for some
+	int finished; // Closed once its lines have been handled
+} daemon_connection;
+
+// One frame a job wants upscaled
+typedef struct {
+	size_t connection;
+	uint64_t generation;
+	char* input_filename; // The output filename follows its null terminator
+} daemon_request;
+
+/*
+  Warm workers of one mode, shared by every job.
+  Requests from all connections go through one queue, so frames of several short clips fill the workers together.
+*/
+typedef struct {
+	char** command;
+	size_t worker_count; // 0 until a job asks for this mode
+	upscaler_worker workers[MAX_UPSCALER_WORKERS];
+	expandable_buffer partial_lines[MAX_UPSCALER_WORKERS];
+	// Workers answer in order, so the oldest request is always the one being answered
+	daemon_request in_flight[MAX_UPSCALER_WORKERS][WORKER_REQUESTS_IN_FLIGHT];
+	size_t first_in_flight[MAX_UPSCALER_WORKERS];
+
+	daemon_request* pending;
+	size_t first_pending;
+	size_t pending_count;
+	size_t pending_capacity;
+} daemon_worker_pool;
+
+/*
+  Keeps waifu2x workers alive across jobs submitted over a Unix socket.
+  Jobs are run as copies of this program that connect back to borrow the workers, a few at a time, highest priority first.
+  Everything happens on one thread around epoll, job exits and stop signals come in through a signalfd.
+*/
+typedef struct {
+	const char* socket_path;
+	char* working_directory;
+	const char* model;
+	size_t worker_count;
+	size_t max_running_jobs;
+	int listen_fd;
+	int epoll_fd;
+	int signal_fd;
+	int stopping;
+
+	daemon_job* jobs;
+	size_t job_count;
+	size_t job_capacity;
+	size_t running_jobs;
+
+	daemon_connection connections[DAEMON_MAX_CONNECTIONS];
+	daemon_worker_pool pools[DAEMON_MODE_COUNT];
+} upscale_daemon;
+
+void upscale_daemon_add(upscale_daemon* daemon, int fd, uint32_t source, uint32_t index){
+	struct epoll_event event = { .events = EPOLLIN, .data.u64 = ((uint64_t)source << 32) | index };
+	if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0){
+		fprintf(stderr, "Failed to watch fd %d: %s\n", fd, strerror(errno));
+		exit(1);
+	}
+}
+
+// Answers are short, a connection that can't take one has gone away
+void daemon_reply(daemon_connection* connection, const char* format, ...){
+	char reply[DAEMON_REPLY_SIZE];
+	va_list arguments;
+	va_start(arguments, format);
+	int length = vsnprintf(reply, sizeof(reply), format, arguments);
+	va_end(arguments);
+	if (length >= (int)sizeof(reply)) length = sizeof(reply) - 1;
+	if (send(connection->fd, reply, length, MSG_NOSIGNAL) != length) errno = 0;
+}
+
+void close_daemon_connection(upscale_daemon* daemon, size_t slot){
+	daemon_connection* connection = &daemon->connections[slot];
+	epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	connection->fd = -1;
+	connection->generation++;
+	expandable_buffer_clear(&connection->partial_line);
+}
+
+// Reads what's waiting on fd into partial_line
+// returns 1 once the other end has closed it
+int read_daemon_stream(int fd, expandable_buffer* partial_line){
+	while (1){
+		BYTE* read_start = expandable_buffer_increase_size(partial_line, DAEMON_READ_SIZE);
+		ssize_t total_read = read(fd, read_start, DAEMON_READ_SIZE);
+		partial_line->size -= DAEMON_READ_SIZE - (total_read > 0 ? total_read : 0);
+		if (total_read < 0){
+			if (errno == EINTR) continue;
+			const int closed = (errno != EAGAIN);
+			errno = 0;
+			return closed;
+		}
+		if (total_read == 0) return 1;
+	}
+}
+
+// Takes the next whole line off the front of partial_line, *consumed says how far it has got
+char* next_daemon_line(expandable_buffer* partial_line, size_t* consumed){
+	BYTE* end = memchr(partial_line->pointer + *consumed, '\n', partial_line->size - *consumed);
+	if (end == NULL){
+		memmove(partial_line->pointer, partial_line->pointer + *consumed, partial_line->size - *consumed);
+		partial_line->size -= *consumed;
+		return NULL;
+	}
+	*end = '\0';
+	char* line = (char*)partial_line->pointer + *consumed;
+	*consumed = end - partial_line->pointer + 1;
+	return line;
+}
+
+void start_daemon_worker(upscale_daemon* daemon, int mode, size_t index){
+	daemon_worker_pool* pool = &daemon->pools[mode];
+	pool->workers[index] = create_upscaler_worker(pool->command, daemon->working_directory);
+	pool->first_in_flight[index] = 0;
+	int fd = fileno(pool->workers[index].responses);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	upscale_daemon_add(daemon, fd, DAEMON_SOURCE_WORKER, mode * MAX_UPSCALER_WORKERS + index);
+}
+
+// Keeps every worker with as many requests queued as it takes, least busy first
+void dispatch_daemon_requests(upscale_daemon* daemon, int mode){
+	daemon_worker_pool* pool = &daemon->pools[mode];
+	while (pool->pending_count > 0){
+		size_t i, least_busy = 0;
+		for (i = 1; i < pool->worker_count; i++){
+			if (pool->workers[i].requests_in_flight < pool->workers[least_busy].requests_in_flight) least_busy = i;
+		}
+		upscaler_worker* worker = &pool->workers[least_busy];
+		if (worker->requests_in_flight >= WORKER_REQUESTS_IN_FLIGHT) break;
+
+		daemon_request request = pool->pending[pool->first_pending++];
+		pool->pending_count--;
+		// Nobody is waiting for frames from a job that has gone
+		if (daemon->connections[request.connection].generation != request.generation){
+			free(request.input_filename);
+			continue;
+		}
+		const char* output_filename = request.input_filename + strlen(request.input_filename) + 1;
+		const size_t slot = (pool->first_in_flight[least_busy] + worker->requests_in_flight) % WORKER_REQUESTS_IN_FLIGHT;
+		pool->in_flight[least_busy][slot] = request;
+		if (upscaler_worker_submit(worker, request.input_filename, output_filename) != 0){
+			// It's dead, its responses end and it gets replaced
+			worker->requests_in_flight++;
+			errno = 0;
+		}
+	}
+}
+
+void queue_daemon_request(upscale_daemon* daemon, size_t slot, char* line){
+	daemon_connection* connection = &daemon->connections[slot];
+	daemon_worker_pool* pool = &daemon->pools[connection->mode];
+	char* separator = strchr(line, '\t');
+	if (separator == NULL){
+		daemon_reply(connection, "err\t%s\n", line);
+		return;
+	}
+	*separator = '\0';
+	if (pool->first_pending + pool->pending_count == pool->pending_capacity){
+		if (pool->first_pending > 0){
+			memmove(pool->pending, pool->pending + pool->first_pending, pool->pending_count * sizeof(daemon_request));
+		}else{
+			pool->pending_capacity = pool->pending_capacity ? pool->pending_capacity * 2 : 64;
+			pool->pending = realloc(pool->pending, pool->pending_capacity * sizeof(daemon_request));
+		}
+		pool->first_pending = 0;
+	}
+	const size_t line_length = separator - line + 1 + strlen(separator + 1) + 1;
+	daemon_request request = { .connection = slot, .generation = connection->generation, .input_filename = malloc(line_length) };
+	memcpy(request.input_filename, line, line_length);
+	pool->pending[pool->first_pending + pool->pending_count++] = request;
+	dispatch_daemon_requests(daemon, connection->mode);
+}
+
+// Passes a worker's answer back to whoever asked for the frame
+void answer_daemon_request(upscale_daemon* daemon, int mode, size_t index, const char* answer){
+	daemon_worker_pool* pool = &daemon->pools[mode];
+	upscaler_worker* worker = &pool->workers[index];
+	daemon_request* request = &pool->in_flight[index][pool->first_in_flight[index]];
+	daemon_connection* connection = &daemon->connections[request->connection];
+	if (connection->generation == request->generation) daemon_reply(connection, "%s\t%s\n", answer, request->input_filename);
+	free(request->input_filename);
+	pool->first_in_flight[index] = (pool->first_in_flight[index] + 1) % WORKER_REQUESTS_IN_FLIGHT;
+	worker->requests_in_flight--;
+}
+
+void read_daemon_worker(upscale_daemon* daemon, int mode, size_t index){
+	daemon_worker_pool* pool = &daemon->pools[mode];
+	upscaler_worker* worker = &pool->workers[index];
+	const int closed = read_daemon_stream(fileno(worker->responses), &pool->partial_lines[index]);
+	size_t consumed = 0;
+	char* line;
+	while ((line = next_daemon_line(&pool->partial_lines[index], &consumed)) != NULL){
+		// Anything else is logging from torch
+		const int ok = (strncmp(line, "ok\t", 3) == 0);
+		if ((ok || strncmp(line, "err\t", 4) == 0) && worker->requests_in_flight > 0) answer_daemon_request(daemon, mode, index, ok ? "ok" : "err");
+	}
+	if (!closed) return;
+
+	// Whatever it was working on is lost, the jobs that asked find out and the worker is replaced
+	fprintf(stderr, "Upscaler worker %d stopped unexpectedly, starting another\n", worker->pid);
+	while (worker->requests_in_flight > 0) answer_daemon_request(daemon, mode, index, "err");
+	epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, fileno(worker->responses), NULL);
+	free_upscaler_worker(worker);
+	expandable_buffer_clear(&pool->partial_lines[index]);
+	errno = 0;
+	start_daemon_worker(daemon, mode, index);
+	dispatch_daemon_requests(daemon, mode);
+}
+
+daemon_job* find_daemon_job(upscale_daemon* daemon, const char* id_string){
+	size_t id;
+	if (id_string == NULL || sscanf(id_string, "%zu", &id) != 1 || id == 0 || id > daemon->job_count) return NULL;
+	return &daemon->jobs[id - 1];
+}
+
+// "submit\t<priority>\t<working directory>\t<input>\t<output>[\t<option>]..."
+void submit_daemon_job(upscale_daemon* daemon, daemon_connection* connection, char* line){
+	if (daemon->job_count == daemon->job_capacity){
+		daemon->job_capacity = daemon->job_capacity ? daemon->job_capacity * 2 : 16;
+		daemon->jobs = realloc(daemon->jobs, daemon->job_capacity * sizeof(daemon_job));
+	}
+	daemon_job job = { .id = daemon->job_count + 1, .state = DAEMON_JOB_QUEUED, .request = strdup(line) };
+	size_t field_count = 1;
+	char* c;
+	for (c = job.request; *c != '\0'; c++) field_count += (*c == '\t');
+	char** fields = calloc(field_count + 1, sizeof(char*));
+	size_t i = 0;
+	char* save_pointer = NULL;
+	for (c = strtok_r(job.request, "\t", &save_pointer); c != NULL; c = strtok_r(NULL, "\t", &save_pointer)) fields[i++] = c;
+	if (i < 5 || sscanf(fields[1], "%d", &job.priority) != 1){
+		daemon_reply(connection, "err\tsubmit needs a priority, a working directory, an input and an output\n");
+		free(fields);
+		free(job.request);
+		return;
+	}
+	job.working_directory = fields[2];
+	job.input_filepath = fields[3];
+	job.output_filepath = fields[4];
+	// The options are moved to the front so they end up as a NULL terminated list
+	memmove(fields, fields + 5, (i - 5) * sizeof(char*));
+	fields[i - 5] = NULL;
+	job.options = fields;
+	daemon->jobs[daemon->job_count++] = job;
+	daemon_reply(connection, "job\t%zu\n", job.id);
+}
+
+void handle_daemon_line(upscale_daemon* daemon, size_t slot, char* line){
+	daemon_connection* connection = &daemon->connections[slot];
+	if (connection->mode != -1){
+		queue_daemon_request(daemon, slot, line);
+		return;
+	}
+	// Anything but a worker connection is one request and one answer
+	connection->finished = 1;
+	if (strncmp(line, "submit\t", strlen("submit\t")) == 0){
+		submit_daemon_job(daemon, connection, line);
+		return;
+	}
+	char* save_pointer = NULL;
+	char* command = strtok_r(line, "\t", &save_pointer);
+	if (command == NULL) command = "";
+
+	if (strcmp(command, "worker") == 0){
+		const char* mode_name = strtok_r(NULL, "\t", &save_pointer);
+		int mode;
+		for (mode = 0; mode < DAEMON_MODE_COUNT; mode++){
+			if (mode_name != NULL && strcmp(mode_name, daemon_mode_names[mode]) == 0) break;
+		}
+		if (mode == DAEMON_MODE_COUNT){
+			daemon_reply(connection, "err\tunknown mode\n");
+			return;
+		}
+		// Workers are only started for modes jobs actually use
+		daemon_worker_pool* pool = &daemon->pools[mode];
+		while (pool->worker_count < daemon->worker_count){
+			pool->partial_lines[pool->worker_count] = create_expandable_buffer(DAEMON_READ_SIZE);
+			start_daemon_worker(daemon, mode, pool->worker_count++);
+		}
+		connection->mode = mode;
+		connection->finished = 0;
+	}else if (strcmp(command, "status") == 0){
+		size_t i;
+		for (i = 0; i < daemon->job_count; i++){
+			daemon_job* job = &daemon->jobs[i];
+			daemon_reply(connection, "%zu\t%s\t%d\t%s\t%s\n", job->id, daemon_job_state_names[job->state], job->priority, job->input_filepath, job->output_filepath);
+		}
+	}else if (strcmp(command, "cancel") == 0){
+		daemon_job* job = find_daemon_job(daemon, strtok_r(NULL, "\t", &save_pointer));
+		if (job == NULL){
+			daemon_reply(connection, "err\tno such job\n");
+		}else if (job->state == DAEMON_JOB_QUEUED){
+			job->state = DAEMON_JOB_CANCELLED;
+			daemon_reply(connection, "ok\n");
+		}else if (job->state == DAEMON_JOB_RUNNING){
+			// It cleans up after itself like it would for Ctrl-C
+			job->cancelled = 1;
+			kill(job->pid, SIGINT);
+			daemon_reply(connection, "ok\n");
+		}else{
+			daemon_reply(connection, "err\tjob %zu is already %s\n", job->id, daemon_job_state_names[job->state]);
+		}
+	}else if (strcmp(command, "priority") == 0){
+		daemon_job* job = find_daemon_job(daemon, strtok_r(NULL, "\t", &save_pointer));
+		const char* priority = strtok_r(NULL, "\t", &save_pointer);
+		if (job == NULL || priority == NULL || sscanf(priority, "%d", &job->priority) != 1){
+			daemon_reply(connection, "err\tpriority needs a job and a number\n");
+		}else{
+			daemon_reply(connection, "ok\n");
+		}
+	}else{
+		daemon_reply(connection, "err\tunknown request %s\n", command);
+	}
+}
+
+void accept_daemon_connection(upscale_daemon* daemon){
+	int fd;
+	while ((fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1){
+		size_t slot;
+		for (slot = 0; slot < DAEMON_MAX_CONNECTIONS && daemon->connections[slot].fd != -1; slot++);
+		if (slot == DAEMON_MAX_CONNECTIONS){
+			fprintf(stderr, "Too many connections, dropping one\n");
+			close(fd);
+			continue;
+		}
+		daemon_connection* connection = &daemon->connections[slot];
+		connection->fd = fd;
+		connection->mode = -1;
+		connection->finished = 0;
+		if (connection->partial_line.pointer == NULL) connection->partial_line = create_expandable_buffer(DAEMON_READ_SIZE);
+		upscale_daemon_add(daemon, fd, DAEMON_SOURCE_CONNECTION, slot);
+	}
+	errno = 0;
+}
+
+void read_daemon_connection(upscale_daemon* daemon, size_t slot){
+	daemon_connection* connection = &daemon->connections[slot];
+	const int closed = read_daemon_stream(connection->fd, &connection->partial_line);
+	size_t consumed = 0;
+	char* line;
+	while (!connection->finished && (line = next_daemon_line(&connection->partial_line, &consumed)) != NULL){
+		handle_daemon_line(daemon, slot, line);
+	}
+	if (closed || connection->finished) close_daemon_connection(daemon, slot);
+}
+
+// The job gets the daemon's model so the upscale cache knows what made its frames
+void start_daemon_job(upscale_daemon* daemon, daemon_job* job){
+	size_t option_count = 0;
+	while (job->options[option_count] != NULL) option_count++;
+	char model[PATH_MAX + 32];
+	char socket[PATH_MAX + 32];
+	snprintf(model, sizeof(model), "--waifu2x-model=%s", daemon->model);
+	snprintf(socket, sizeof(socket), "--daemon-socket=%s", daemon->socket_path);
+	char** command = calloc(option_count + 7, sizeof(char*));
+	size_t argument_count = 0;
+	command[argument_count++] = "/proc/self/exe";
+	memcpy(command + argument_count, job->options, option_count * sizeof(char*));
+	argument_count += option_count;
+	command[argument_count++] = model;
+	command[argument_count++] = socket;
+	command[argument_count++] = "--";
+	command[argument_count++] = job->input_filepath;
+	command[argument_count++] = job->output_filepath;
+	command[argument_count] = NULL;
+
+	// What it prints goes next to its output
+	char log_filepath[PATH_MAX];
+	snprintf(log_filepath, sizeof(log_filepath), "%s.log", job->output_filepath);
+	pipe_data log_pipe = { .files = { .read_from = -1, .write_to = open(log_filepath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) } };
+	if (log_pipe.files.write_to == -1){
+		fprintf(stderr, "Job %zu: couldn't open %s: %s\n", job->id, log_filepath, strerror(errno));
+		job->state = DAEMON_JOB_FAILED;
+		errno = 0;
+		free(command);
+		return;
+	}
+	job->pid = run_command(command, job->working_directory, NULL, &log_pipe, &log_pipe);
+	free(command);
+	if (job->pid == -1){
+		// Most likely a working directory that doesn't exist, only this job is affected
+		fprintf(stderr, "Job %zu: couldn't be started in %s\n", job->id, job->working_directory);
+		job->pid = 0;
+		job->state = DAEMON_JOB_FAILED;
+		return;
+	}
+	job->state = DAEMON_JOB_RUNNING;
+	daemon->running_jobs++;
+	fprintf(stderr, "Job %zu: started upscaling %s\n", job->id, job->input_filepath);
+}
+
+void start_queued_daemon_jobs(upscale_daemon* daemon){
+	while (!daemon->stopping && daemon->running_jobs < daemon->max_running_jobs){
+		daemon_job* next = NULL;
+		size_t i;
+		for (i = 0; i < daemon->job_count; i++){
+			daemon_job* job = &daemon->jobs[i];
+			// Earlier jobs go first out of ones with the same priority
+			if (job->state == DAEMON_JOB_QUEUED && (next == NULL || job->priority > next->priority)) next = job;
+		}
+		if (next == NULL) break;
+		start_daemon_job(daemon, next);
+	}
+}
+
+// SIGCHLDs can be merged so every running job is checked, SIGINT and SIGTERM stop the daemon once its jobs have
+void handle_daemon_signals(upscale_daemon* daemon){
+	struct signalfd_siginfo info;
+	while (read(daemon->signal_fd, &info, sizeof(info)) == sizeof(info)){
+		if (info.ssi_signo != SIGINT && info.ssi_signo != SIGTERM) continue;
+		if (!daemon->stopping) fprintf(stderr, "Stopping, running jobs are cancelled\n");
+		daemon->stopping = 1;
+	}
+	errno = 0;
+
+	size_t i;
+	for (i = 0; i < daemon->job_count; i++){
+		daemon_job* job = &daemon->jobs[i];
+		if (daemon->stopping && job->state == DAEMON_JOB_QUEUED) job->state = DAEMON_JOB_CANCELLED;
+		if (job->state != DAEMON_JOB_RUNNING) continue;
+		if (daemon->stopping && !job->cancelled){
+			job->cancelled = 1;
+			kill(job->pid, SIGINT);
+		}
+		int status;
+		if (waitpid(job->pid, &status, WNOHANG) != job->pid) continue;
+		daemon->running_jobs--;
+		job->state = job->cancelled ? DAEMON_JOB_CANCELLED
+			: (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? DAEMON_JOB_DONE : DAEMON_JOB_FAILED;
+		fprintf(stderr, "Job %zu: %s\n", job->id, daemon_job_state_names[job->state]);
+	}
+	errno = 0;
+}
+
+/*
+  Runs the daemon until SIGINT or SIGTERM.
+  The worker commands are started from working_directory, and at most max_running_jobs jobs run at once.
+*/
+int run_upscale_daemon(const char* socket_path, char** noise_worker_command, char** scale_worker_command, char* working_directory,
+					   const char* model, size_t worker_count, size_t max_running_jobs){
+	upscale_daemon* daemon = calloc(1, sizeof(upscale_daemon));
+	daemon->socket_path = socket_path;
+	daemon->working_directory = working_directory;
+	daemon->model = model;
+	daemon->worker_count = worker_count;
+	daemon->max_running_jobs = max_running_jobs;
+	daemon->pools[DAEMON_MODE_NOISE_SCALE].command = noise_worker_command;
+	daemon->pools[DAEMON_MODE_SCALE].command = scale_worker_command;
+	size_t i;
+	for (i = 0; i < DAEMON_MAX_CONNECTIONS; i++) daemon->connections[i].fd = -1;
+
+	// Jobs and workers are children, they get these unblocked again when they start
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(address.sun_path)){
+		fprintf(stderr, "The socket path %s is too long\n", socket_path);
+		return 1;
+	}
+	strcpy(address.sun_path, socket_path);
+	// A socket left over from a daemon that died is replaced, one that's still answering isn't
+	int existing = connect_upscale_daemon(socket_path);
+	if (existing != -1){
+		fprintf(stderr, "A daemon is already listening on %s\n", socket_path);
+		close(existing);
+		return 1;
+	}
+	unlink(socket_path);
+	errno = 0;
+	daemon->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (daemon->listen_fd == -1 || bind(daemon->listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(daemon->listen_fd, SOMAXCONN) != 0){
+		fprintf(stderr, "Couldn't listen on %s: %s\n", socket_path, strerror(errno));
+		return 1;
+	}
+	daemon->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	daemon->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (daemon->epoll_fd == -1 || daemon->signal_fd == -1){
+		fprintf(stderr, "Failed to set up the event loop: %s\n", strerror(errno));
+		return 1;
+	}
+	upscale_daemon_add(daemon, daemon->listen_fd, DAEMON_SOURCE_LISTENER, 0);
+	upscale_daemon_add(daemon, daemon->signal_fd, DAEMON_SOURCE_SIGNALS, 0);
+	fprintf(stderr, "Listening on %s, running %zu jobs at once\n", socket_path, max_running_jobs);
+
+	while (!daemon->stopping || daemon->running_jobs > 0){
+		start_queued_daemon_jobs(daemon);
+		struct epoll_event events[DAEMON_MAX_EVENTS];
+		int event_count = epoll_wait(daemon->epoll_fd, events, DAEMON_MAX_EVENTS, -1);
+		if (event_count < 0){
+			errno = 0;
+			continue;
+		}
+		int event;
+		for (event = 0; event < event_count; event++){
+			const uint32_t index = (uint32_t)events[event].data.u64;
+			switch (events[event].data.u64 >> 32){
+			case DAEMON_SOURCE_LISTENER:
+				accept_daemon_connection(daemon);
+				break;
+			case DAEMON_SOURCE_SIGNALS:
+				handle_daemon_signals(daemon);
+				break;
+			case DAEMON_SOURCE_CONNECTION:
+				// Closed by an earlier event this time round
+				if (daemon->connections[index].fd != -1) read_daemon_connection(daemon, index);
+				break;
+			case DAEMON_SOURCE_WORKER:
+				read_daemon_worker(daemon, index / MAX_UPSCALER_WORKERS, index % MAX_UPSCALER_WORKERS);
+				break;
+			}
+		}
+	}
+
+	close(daemon->listen_fd);
+	unlink(socket_path);
+	int mode;
+	for (mode = 0; mode < DAEMON_MODE_COUNT; mode++){
+		daemon_worker_pool* pool = &daemon->pools[mode];
+		for (i = 0; i < pool->worker_count; i++){
+			free_upscaler_worker(&pool->workers[i]);
+			free_expandable_buffer(&pool->partial_lines[i]);
+		}
+		for (i = 0; i < pool->pending_count; i++) free(pool->pending[pool->first_pending + i].input_filename);
+		free(pool->pending);
+	}
+	for (i = 0; i < DAEMON_MAX_CONNECTIONS; i++){
+		if (daemon->connections[i].fd != -1) close(daemon->connections[i].fd);
+		if (daemon->connections[i].partial_line.pointer != NULL) free_expandable_buffer(&daemon->connections[i].partial_line);
+	}
+	for (i = 0; i < daemon->job_count; i++){
+		free(daemon->jobs[i].request);
+		free(daemon->jobs[i].options);
+	}
+	free(daemon->jobs);
+	close(daemon->epoll_fd);
+	close(daemon->signal_fd);
+	free(daemon);
+	return 0;
+}
+
+// Sends one request line to the daemon and copies its answer to stdout
+// returns 1 if the daemon couldn't be reached or answered with an error
+int send_daemon_request(const char* socket_path, const char* request){
+	int fd = connect_upscale_daemon(socket_path);
+	if (fd == -1){
+		fprintf(stderr, "Couldn't connect to the upscale daemon at %s: %s\n", socket_path, strerror(errno));
+		return 1;
+	}
+	const size_t request_length = strlen(request);
+	if (send(fd, request, request_length, MSG_NOSIGNAL) != request_length || send(fd, "\n", 1, MSG_NOSIGNAL) != 1){
+		fprintf(stderr, "Couldn't send to the upscale daemon: %s\n", strerror(errno));
+		close(fd);
+		return 1;
+	}
+	char answer[DAEMON_READ_SIZE];
+	ssize_t total_read;
+	int failed = -1;
+	while ((total_read = read(fd, answer, sizeof(answer))) > 0){
+		if (failed == -1) failed = (total_read >= 4 && strncmp(answer, "err\t", 4) == 0);
+		fwrite(answer, 1, total_read, stdout);
+	}
+	close(fd);
+	errno = 0;
+	return (failed == 1) ? 1 : 0;
+}
@@ -0,0 +1,318 @@
+#define UPSCALER_RATE_CHARACTERS 32
+
+enum { UPSCALER_BACKEND_WAIFU2X, UPSCALER_BACKEND_CPU };
+static const char* const upscaler_backend_names[] = { "waifu2x", "cpu" };
+
+// How far the upscaler has got through the current round
+typedef struct {
+	size_t completed_frames;
+	size_t total_frames;
+	char rate[UPSCALER_RATE_CHARACTERS]; // Time per frame, as the upscaler reports it
+} upscaler_progress;
+
+/*
+  Something that upscales the frames of a batch, picked with --backend.
+  Each batch is submitted once per round and polled from the main thread's event loop until the round is finished,
+  after the last round every frame's buffer holds its upscaled image.
+*/
+typedef struct upscaler_backend upscaler_backend;
+struct upscaler_backend {
+	const char* name;
+	size_t rounds; // Rounds each batch goes through
+	uint64_t settings_hash; // Identifies what the backend does to frames in the upscale cache
+	void* state;
+
+	// Starts upscaling the listed frames
+	// returns 1 if they couldn't be started
+	int (*submit_batch)(upscaler_backend* backend, progress_reactor* reactor, temp_frame* frames, const size_t* frame_indices, size_t frame_count, size_t round);
+	// Waits for something to happen and fills in the progress
+	// returns 1 once the round is over
+	int (*poll_completions)(upscaler_backend* backend, progress_reactor* reactor, upscaler_progress* progress);
+	// Collects the round's results
+	// returns 1 if any frame failed
+	int (*finish_batch)(upscaler_backend* backend, progress_reactor* reactor);
+	void (*shutdown)(upscaler_backend* backend);
+};
+
+void free_upscaler_backend(upscaler_backend* backend){
+	if (backend->state == NULL) return;
+	backend->shutdown(backend);
+	free(backend->state);
+	backend->state = NULL;
+}
+
+/*
+  waifu2x, through temp files.
+  Either started once per round with the frames listed on its stdin, or with --persistent-upscaler a pool of workers per mode.
+*/
+typedef struct {
+	char** one_off_commands[2]; // Noise reduction for the first round, scaling only after
+	char* working_directory;
+	upscaler_worker_pool worker_pools[2]; // Same order, empty unless persistent
+	int persistent;
+	int raw_transport;
+	unsigned int source_width;
+	unsigned int source_height;
+	volatile _Atomic pid_t* process_slots; // Where the running processes are put so a stop signal reaches them
+	volatile sig_atomic_t* stop_signalled;
+	temp_io io; // Its ring_fd is -1 when temp files are written and read with blocking calls
+	char ppm_header[PPM_HEADER_MAX_LENGTH]; // Every source frame's, for writing them through io
+	size_t ppm_header_length;
+
+	// The round being run
+	temp_frame* frames;
+	const size_t* frame_indices;
+	size_t frame_count;
+	size_t round;
+	double start_time;
+} waifu2x_backend;
+
+// returns 1 on failure
+int waifu2x_write_temp_frame(waifu2x_backend* waifu2x, temp_frame* frame){
+	if (waifu2x->raw_transport && !frame->partial){
+		// The first round reads straight from the frame's slot
+		if (write_ppm_file(frame->file->absolute_filename, frame->source_pixels, waifu2x->source_width, waifu2x->source_height) != 0){
+			fprintf(stderr, "Error writing %s: %s\n", frame->file->absolute_filename, strerror(errno));
+			return 1;
+		}
+	}else{
+		// Write the buffers' data out
+		FILE* output_file = fopen(frame->file->absolute_filename, "wb");
+		expandable_buffer_write_to_file(&frame->buffer, output_file);
+		fflush(output_file);
+		fclose(output_file);
+	}
+	return 0;
+}
+
+int waifu2x_backend_submit_batch(upscaler_backend* backend, progress_reactor* reactor, temp_frame* frames, const size_t* frame_indices, size_t frame_count, size_t round){
+	waifu2x_backend* waifu2x = backend->state;
+	waifu2x->frames = frames;
+	waifu2x->frame_indices = frame_indices;
+	waifu2x->frame_count = frame_count;
+	waifu2x->round = round;
+	waifu2x->start_time = monotonic_seconds();
+
+	// After the first round the previous round's output has already been moved into place
+	size_t i;
+	if (round == 0){
+		const double write_start_time = monotonic_seconds();
+		const int batched = temp_io_usable(&waifu2x->io) && frame_count <= waifu2x->io.max_files;
+		// Partial frames only send what changed, cut out into their buffer
+		for (i = 0; i < frame_count && waifu2x->raw_transport; i++){
+			temp_frame* frame = &frames[frame_indices[i]];
+			if (frame->partial) crop_dirty_tiles(&frame->buffer, frame->source_pixels, waifu2x->source_width, &frame->crop);
+		}
+		if (batched){
+			temp_io_begin(&waifu2x->io, frame_count);
+			for (i = 0; i < frame_count; i++){
+				temp_frame* frame = &frames[frame_indices[i]];
+				if (waifu2x->raw_transport && !frame->partial){
+					temp_io_write(&waifu2x->io, i, frame->file->absolute_filename, (BYTE*)waifu2x->ppm_header, waifu2x->ppm_header_length,
+								  frame->source_pixels, (size_t)waifu2x->source_width * waifu2x->source_height * 3);
+				}else{
+					temp_io_write(&waifu2x->io, i, frame->file->absolute_filename, NULL, 0, frame->buffer.pointer, frame->buffer.size);
+				}
+			}
+			temp_io_flush(&waifu2x->io);
+		}
+		// Anything io_uring didn't manage is written the old way, which reports the error if it fails again
+		for (i = 0; i < frame_count; i++){
+			if ((!batched || waifu2x->io.failed[i]) && waifu2x_write_temp_frame(waifu2x, &frames[frame_indices[i]]) != 0) return 1;
+		}
+		// io_uring writes the whole batch at once, so only the batch can be timed
+		metrics_observe(HISTOGRAM_TEMP_FILE_BATCH_WRITE, monotonic_seconds() - write_start_time);
+	}
+
+	const int mode = (round == 0) ? 0 : 1;
+	if (waifu2x->persistent){
+		progress_reactor_watch_workers(reactor, waifu2x->worker_pools[mode].progress_fd);
+		if (upscaler_worker_pool_start_round(&waifu2x->worker_pools[mode], frames, frame_indices, frame_count) != 0){
+			upscaler_worker_pool_finish_round(&waifu2x->worker_pools[mode]);
+			return 1;
+		}
+		return 0;
+	}
+
+	// waifu2x reads the list of frames from stdin
+	pipe_data waifu2x_input_pipe = create_pipe_data();
+	FILE* waifu2x_input_file = fdopen(waifu2x_input_pipe.files.write_to, "wb");
+	for (i = 0; i < frame_count; i++){
+		char* str = frames[frame_indices[i]].file->absolute_filename;
+		fwrite(str, sizeof(*str), strlen(str), waifu2x_input_file);
+		fputc('\n', waifu2x_input_file);
+	}
+	fflush(waifu2x_input_file);
+	fclose(waifu2x_input_file);
+	if (errno){
+		fprintf(stderr, "prewaif err: %s\n", strerror(errno));
+		close(waifu2x_input_pipe.files.read_from);
+		return 1;
+	}
+
+	pipe_data waifu2x_progress_pipe = create_pipe_data();
+	pid_t waifu2x_pid = run_command(waifu2x->one_off_commands[mode], waifu2x->working_directory, &waifu2x_input_pipe, &waifu2x_progress_pipe, NULL);
+	if (waifu2x_pid == -1){
+		pipe_data_close(&waifu2x_progress_pipe);
+		return 1;
+	}
+	atomic_store(&waifu2x->process_slots[0], waifu2x_pid);
+	// The progress bar is parsed as it comes in, the round is over once waifu2x has exited and its output is drained
+	progress_reactor_watch_upscaler(reactor, waifu2x_progress_pipe.files.read_from, waifu2x_pid);
+	return 0;
+}
+
+int waifu2x_backend_poll_completions(upscaler_backend* backend, progress_reactor* reactor, upscaler_progress* progress){
+	waifu2x_backend* waifu2x = backend->state;
+	progress_reactor_wait(reactor);
+	if (!waifu2x->persistent){
+		progress->completed_frames = reactor->upscaled_frames;
+		progress->total_frames = reactor->upscaler_total_frames;
+		snprintf(progress->rate, sizeof(progress->rate), "%s", reactor->upscaler_step);
+		return reactor->upscaler_exited && reactor->upscaler.fd == -1;
+	}
+
+	const int finished = upscaler_worker_pool_progress(&waifu2x->worker_pools[(waifu2x->round == 0) ? 0 : 1], &progress->completed_frames);
+	const double elapsed_ms = (monotonic_seconds() - waifu2x->start_time) * 1000.0;
+	progress->total_frames = waifu2x->frame_count;
+	snprintf(progress->rate, sizeof(progress->rate), "%.0fms", progress->completed_frames ? elapsed_ms / progress->completed_frames : 0.0);
+	return finished;
+}
+
+int waifu2x_backend_finish_batch(upscaler_backend* backend, progress_reactor* reactor){
+	waifu2x_backend* waifu2x = backend->state;
+	if (waifu2x->persistent){
+		if (upscaler_worker_pool_finish_round(&waifu2x->worker_pools[(waifu2x->round == 0) ? 0 : 1]) != 0) return 1;
+	}else if (reactor->upscaler_exited){
+		atomic_store(&waifu2x->process_slots[0], 0);
+		if (*waifu2x->stop_signalled == 0 && (!WIFEXITED(reactor->upscaler_status) || WEXITSTATUS(reactor->upscaler_status) != 0)){
+			// Its outputs are missing, or left over from an earlier round
+			fprintf(stderr, "waifu2x exited with status %d\n", WIFEXITED(reactor->upscaler_status) ? WEXITSTATUS(reactor->upscaler_status) : -1);
+			return 1;
+		}
+	}
+	if (errno){
+		fprintf(stderr, "postwaif err: %s\n", strerror(errno));
+		return 1;
+	}
+
+	const int last_round = (waifu2x->round == backend->rounds - 1);
+	const int batched = temp_io_usable(&waifu2x->io) && waifu2x->frame_count <= waifu2x->io.max_files && *waifu2x->stop_signalled == 0;
+	const double read_start_time = monotonic_seconds();
+	size_t i;
+	if (batched){
+		temp_io_begin(&waifu2x->io, waifu2x->frame_count);
+		for (i = 0; i < waifu2x->frame_count; i++){
+			temp_frame* frame = &waifu2x->frames[waifu2x->frame_indices[i]];
+			if (last_round){
+				temp_io_stat(&waifu2x->io, i, frame->output_filename);
+			}else{
+				temp_io_rename(&waifu2x->io, i, frame->output_filename, frame->file->absolute_filename);
+			}
+		}
+		temp_io_flush(&waifu2x->io);
+		// Now the sizes are known the buffers can be made big enough to read each file in one go
+		for (i = 0; i < waifu2x->frame_count && last_round; i++){
+			if (waifu2x->io.failed[i]) continue;
+			temp_frame* frame = &waifu2x->frames[waifu2x->frame_indices[i]];
+			expandable_buffer_clear(&frame->buffer);
+			expandable_buffer_increase_size(&frame->buffer, waifu2x->io.stats[i].stx_size);
+			temp_io_read(&waifu2x->io, i, frame->output_filename, frame->buffer.pointer, frame->buffer.size);
+		}
+		if (last_round) temp_io_flush(&waifu2x->io);
+	}
+	for (i = 0; i < waifu2x->frame_count; i++){
+		if (*waifu2x->stop_signalled != 0) break;
+
+		temp_frame* frame = &waifu2x->frames[waifu2x->frame_indices[i]];
+		// The PNG is only checked as it's read on the old path, so at least make sure it is one
+		if (batched && !waifu2x->io.failed[i] && (waifu2x->raw_transport || !last_round
+			|| (frame->buffer.size >= 8 && memcmp(frame->buffer.pointer, "\211PNG\r\n\032\n", 8) == 0))) continue;
+		if (!last_round){
+			// The output is the next round's input, both are in the same folder so this is just a rename
+			if (rename(frame->output_filename, frame->file->absolute_filename) != 0){
+				fprintf(stderr, "Error moving %s to %s: %s\n", frame->output_filename, frame->file->absolute_filename, strerror(errno));
+				return 1;
+			}
+			continue;
+		}
+		FILE* output_file = fopen(frame->output_filename, "rb");
+		if (output_file == NULL){
+			fprintf(stderr, "err: %s\n", strerror(errno));
+			fprintf(stderr, "Error opening %s...\n", frame->output_filename);
+			return 1;
+		}
+		if (waifu2x->raw_transport){
+			if (expandable_buffer_read_file_in(&frame->buffer, output_file) != 0){
+				fprintf(stderr, "Error reading PPM from %s...\n", frame->output_filename);
+				fclose(output_file);
+				return 1;
+			}
+		}else if (expandable_buffer_read_png_in(&frame->buffer, output_file) != 0){
+			fprintf(stderr, "err: %s\n", strerror(errno));
+			fprintf(stderr, "Error reading PNG from %s...\n", frame->output_filename);
+			fclose(output_file);
+			return 1;
+		}
+		fclose(output_file);
+	}
+	if (last_round && waifu2x->frame_count != 0) metrics_observe(HISTOGRAM_OUTPUT_BATCH_READ, monotonic_seconds() - read_start_time);
+	if (errno){
+		fprintf(stderr, "postout err: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+void waifu2x_backend_shutdown(upscaler_backend* backend){
+	waifu2x_backend* waifu2x = backend->state;
+	free_upscaler_worker_pool(&waifu2x->worker_pools[0]);
+	free_upscaler_worker_pool(&waifu2x->worker_pools[1]);
+	free_temp_io(&waifu2x->io);
+}
+
+// The commands are kept, not copied. Persistent workers are started here, so the event loop has to be set up already
+// process_slots needs room for a noise and a scale process per worker, with a daemon_socket the daemon's workers are used instead
+// With use_io_uring temp files go through io_uring where the kernel allows it, source_memory is registered with it if given
+upscaler_backend create_waifu2x_backend(char** noise_command, char** scale_command, char** noise_worker_command, char** scale_worker_command,
+										char* working_directory, int persistent, const char* daemon_socket, size_t worker_count, size_t max_frames, size_t rounds,
+										int raw_transport, unsigned int source_width, unsigned int source_height,
+										int use_io_uring, BYTE* source_memory, size_t source_memory_size,
+										uint64_t settings_hash, volatile _Atomic pid_t* process_slots, volatile sig_atomic_t* stop_signalled){
+	waifu2x_backend* waifu2x = calloc(1, sizeof(waifu2x_backend));
+	waifu2x->one_off_commands[0] = noise_command;
+	waifu2x->one_off_commands[1] = scale_command;
+	waifu2x->working_directory = working_directory;
+	waifu2x->persistent = persistent;
+	waifu2x->raw_transport = raw_transport;
+	waifu2x->source_width = source_width;
+	waifu2x->source_height = source_height;
+	waifu2x->process_slots = process_slots;
+	waifu2x->stop_signalled = stop_signalled;
+	waifu2x->ppm_header_length = write_ppm_header(waifu2x->ppm_header, source_width, source_height);
+	waifu2x->io.ring_fd = -1;
+	if (use_io_uring) init_temp_io(&waifu2x->io, max_frames, source_memory, source_memory_size);
+	if (persistent){
+		size_t i;
+		waifu2x->worker_pools[0] = create_upscaler_worker_pool(noise_worker_command, working_directory, daemon_socket, "noise_scale", worker_count, max_frames);
+		for (i = 0; i < worker_count; i++)
+			atomic_store(&process_slots[i], waifu2x->worker_pools[0].workers[i].pid);
+		if (rounds > 1){
+			waifu2x->worker_pools[1] = create_upscaler_worker_pool(scale_worker_command, working_directory, daemon_socket, "scale", worker_count, max_frames);
+			for (i = 0; i < worker_count; i++)
+				atomic_store(&process_slots[MAX_UPSCALER_WORKERS + i], waifu2x->worker_pools[1].workers[i].pid);
+		}
+	}
+
+	upscaler_backend backend = {
+		.name = "waifu2x",
+		.rounds = rounds,
+		.settings_hash = settings_hash,
+		.state = waifu2x,
+		.submit_batch = waifu2x_backend_submit_batch,
+		.poll_completions = waifu2x_backend_poll_completions,
+		.finish_batch = waifu2x_backend_finish_batch,
+		.shutdown = waifu2x_backend_shutdown
+	};
+	return backend;
+}
@@ -0,0 +1,268 @@
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define WAIFU2X_WORKER_FILE "waifu2x_worker.lua"
+#define MAX_UPSCALER_WORKERS 64
+
+// A waifu2x process that stays alive for the whole job,
+// frames are requested over its stdin and completions are read from its stdout
+typedef struct {
+	pid_t pid; // 0 when it's a connection to an upscale daemon's workers
+	FILE* requests;
+	FILE* responses;
+	size_t requests_in_flight;
+
+	char* response_line;
+	size_t response_line_length;
+} upscaler_worker;
+
+upscaler_worker create_upscaler_worker(char* const command[], char* working_directory){
+	pipe_data request_pipe = create_pipe_data();
+	pipe_data response_pipe = create_pipe_data();
+
+	// One that couldn't be started has its pipes closed, so its first response fails like a worker that died
+	const pid_t pid = run_command(command, working_directory, &request_pipe, &response_pipe, NULL);
+	upscaler_worker worker = {
+		.pid = (pid == -1) ? 0 : pid,
+		.requests = fdopen(request_pipe.files.write_to, "w"),
+		.responses = fdopen(response_pipe.files.read_from, "r"),
+		.requests_in_flight = 0,
+		.response_line = NULL,
+		.response_line_length = 0
+	};
+	return worker;
+}
+
+// returns the connected socket, or -1 if nothing is listening there
+int connect_upscale_daemon(const char* socket_path){
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(address.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Borrows the daemon's warm workers of one mode, the connection is used exactly like a worker's pipes
+upscaler_worker connect_upscaler_worker(const char* socket_path, const char* mode){
+	int fd = connect_upscale_daemon(socket_path);
+	if (fd == -1){
+		fprintf(stderr, "Couldn't connect to the upscale daemon at %s: %s\n", socket_path, strerror(errno));
+		exit(1);
+	}
+	upscaler_worker worker = {
+		.pid = 0,
+		.requests = fdopen(dup(fd), "w"),
+		.responses = fdopen(fd, "r"),
+		.requests_in_flight = 0,
+		.response_line = NULL,
+		.response_line_length = 0
+	};
+	fprintf(worker.requests, "worker\t%s\n", mode);
+	fflush(worker.requests);
+	return worker;
+}
+
+// Queues one frame, the worker writes the upscaled image to output_filename
+int upscaler_worker_submit(upscaler_worker* worker, const char* input_filename, const char* output_filename){
+	if (fprintf(worker->requests, "%s\t%s\n", input_filename, output_filename) < 0) return 1;
+	if (fflush(worker->requests) != 0) return 1;
+	worker->requests_in_flight++;
+	return 0;
+}
+
+// Waits for the next completion
+// returns 1 if the worker failed the frame or died
+int upscaler_worker_wait(upscaler_worker* worker){
+	assert(worker->requests_in_flight > 0);
+	while (getline(&worker->response_line, &worker->response_line_length, worker->responses) != -1){
+		// Anything else is logging from torch
+		if (strncmp(worker->response_line, "ok\t", 3) == 0){
+			worker->requests_in_flight--;
+			return 0;
+		}
+		if (strncmp(worker->response_line, "err\t", 4) == 0){
+			worker->requests_in_flight--;
+			fprintf(stderr, "Upscaler worker failed on %s", worker->response_line + 4);
+			return 1;
+		}
+	}
+	fprintf(stderr, "Upscaler worker %d stopped unexpectedly\n", worker->pid);
+	return 1;
+}
+
+void free_upscaler_worker(upscaler_worker* worker){
+	if (worker->requests == NULL) return;
+	// Closing the request pipe makes the worker exit once it has finished its queue
+	fclose(worker->requests);
+	fclose(worker->responses);
+	if (worker->pid != 0) waitpid(worker->pid, NULL, 0);
+	free(worker->response_line);
+	worker->requests = NULL;
+	worker->pid = 0;
+}
+
+// Requests kept queued on each worker so it never sits idle waiting for us between frames
+#define WORKER_REQUESTS_IN_FLIGHT 2
+
+/*
+  Several workers of the same mode sharing a batch,
+  each worker gets a thread that feeds it frames from the work stealing queue
+*/
+typedef struct upscaler_worker_pool upscaler_worker_pool;
+typedef struct {
+	upscaler_worker_pool* pool;
+	size_t worker_index;
+} worker_dispatch;
+struct upscaler_worker_pool {
+	upscaler_worker* workers;
+	worker_dispatch* dispatches;
+	pthread_t* dispatch_threads;
+	size_t worker_count;
+	size_t started_dispatches;
+
+	work_stealing_queue queue;
+	temp_frame* frames;
+
+	size_t completed_frames;
+	size_t finished_dispatches;
+	int failed;
+	pthread_mutex_t mutex;
+	int progress_fd; // eventfd poked whenever a frame is done or a dispatcher stops
+};
+
+// With a daemon_socket the workers are connections to the daemon's workers of daemon_mode instead of processes of our own
+upscaler_worker_pool create_upscaler_worker_pool(char* const command[], char* working_directory, const char* daemon_socket, const char* daemon_mode,
+												 size_t worker_count, size_t max_frames){
+	upscaler_worker_pool pool = {
+		.workers = calloc(worker_count, sizeof(upscaler_worker)),
+		.dispatches = calloc(worker_count, sizeof(worker_dispatch)),
+		.dispatch_threads = calloc(worker_count, sizeof(pthread_t)),
+		.worker_count = worker_count,
+		.frames = NULL
+	};
+	size_t i;
+	for (i = 0; i < worker_count; i++){
+		pool.workers[i] = (daemon_socket != NULL) ? connect_upscaler_worker(daemon_socket, daemon_mode) : create_upscaler_worker(command, working_directory);
+	}
+	init_work_stealing_queue(&pool.queue, worker_count, max_frames);
+	pthread_mutex_init(&pool.mutex, NULL);
+	pool.progress_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	return pool;
+}
+
+// Wakes up whoever is watching progress_fd
+void upscaler_worker_pool_poke(upscaler_worker_pool* pool){
+	const uint64_t one = 1;
+	if (write(pool->progress_fd, &one, sizeof(one)) != sizeof(one)) errno = 0;
+}
+
+void* dispatch_frames_to_worker(void* arg){
+	worker_dispatch* dispatch = (worker_dispatch*)arg;
+	upscaler_worker_pool* pool = dispatch->pool;
+	upscaler_worker* worker = &pool->workers[dispatch->worker_index];
+
+	int out_of_frames = 0;
+	int failed = 0;
+	while (!failed){
+		while (!out_of_frames && worker->requests_in_flight < WORKER_REQUESTS_IN_FLIGHT){
+			size_t frame_index;
+			if (work_stealing_queue_take(&pool->queue, dispatch->worker_index, &frame_index) != 0){
+				out_of_frames = 1;
+				break;
+			}
+			temp_frame* frame = &pool->frames[frame_index];
+			if (upscaler_worker_submit(worker, frame->file->absolute_filename, frame->output_filename) != 0){
+				fprintf(stderr, "Failed to send frame to upscaler worker %d\n", worker->pid);
+				failed = 1;
+				break;
+			}
+		}
+		if (failed || worker->requests_in_flight == 0) break;
+
+		failed = upscaler_worker_wait(worker);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (!failed) pool->completed_frames++;
+		pthread_mutex_unlock(&pool->mutex);
+		upscaler_worker_pool_poke(pool);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (failed) pool->failed = 1;
+	pool->finished_dispatches++;
+	pthread_mutex_unlock(&pool->mutex);
+	upscaler_worker_pool_poke(pool);
+	return NULL;
+}
+
+// Starts upscaling the listed frames' temp files into their output files
+// returns 1 if not every dispatcher could be started, the round still has to be finished
+int upscaler_worker_pool_start_round(upscaler_worker_pool* pool, temp_frame* frames, const size_t* frame_indices, size_t frame_count){
+	pool->frames = frames;
+	pool->completed_frames = 0;
+	pool->finished_dispatches = 0;
+	pool->failed = 0;
+	pool->started_dispatches = 0;
+	work_stealing_queue_fill(&pool->queue, frame_indices, frame_count);
+
+	size_t i;
+	for (i = 0; i < pool->worker_count; i++){
+		pool->dispatches[i] = (worker_dispatch){ .pool = pool, .worker_index = i };
+		if (pthread_create(&pool->dispatch_threads[i], NULL, dispatch_frames_to_worker, &pool->dispatches[i]) != 0){
+			fprintf(stderr, "Failed to start upscaler dispatch thread\n");
+			// The ones already running steal the frames the rest would have had
+			pthread_mutex_lock(&pool->mutex);
+			pool->failed = 1;
+			pool->finished_dispatches += pool->worker_count - i;
+			pthread_mutex_unlock(&pool->mutex);
+			upscaler_worker_pool_poke(pool);
+			return 1;
+		}
+		pool->started_dispatches++;
+	}
+	return 0;
+}
+
+// Checks how many frames are done, wait on progress_fd for this to change
+// returns 1 once every worker has stopped taking frames
+int upscaler_worker_pool_progress(upscaler_worker_pool* pool, size_t* completed_frames){
+	pthread_mutex_lock(&pool->mutex);
+	*completed_frames = pool->completed_frames;
+	int finished = (pool->finished_dispatches == pool->worker_count);
+	pthread_mutex_unlock(&pool->mutex);
+	return finished;
+}
+
+// returns 1 if any worker failed a frame
+int upscaler_worker_pool_finish_round(upscaler_worker_pool* pool){
+	size_t i;
+	for (i = 0; i < pool->started_dispatches; i++){
+		pthread_join(pool->dispatch_threads[i], NULL);
+	}
+	pool->started_dispatches = 0;
+	return pool->failed;
+}
+
+void free_upscaler_worker_pool(upscaler_worker_pool* pool){
+	if (pool->workers == NULL) return;
+	size_t i;
+	for (i = 0; i < pool->worker_count; i++){
+		free_upscaler_worker(&pool->workers[i]);
+	}
+	free(pool->workers);
+	free(pool->dispatches);
+	free(pool->dispatch_threads);
+	free_work_stealing_queue(&pool->queue);
+	pthread_mutex_destroy(&pool->mutex);
+	close(pool->progress_fd);
+	pool->workers = NULL;
+}
@@ -0,0 +1,179 @@
+#include <dirent.h>
+
+#define VIDEO_SEGMENT_PREFIX "segment_"
+#define VIDEO_SEGMENT_PATTERN VIDEO_SEGMENT_PREFIX "%05zu"
+#define VIDEO_ENCODER_PREFIX "encoder_%02zu_" // Before the segment's name when it came from one of several result encoders
+#define VIDEO_CONCAT_LIST_FILE "concat.txt"
+
+// Segments use the output's container so ffmpeg picks the same codec for them
+const char* video_segment_extension(const char* output_filepath){
+	const char* extension = strrchr(output_filepath, '.');
+	return (extension != NULL && strchr(extension, '/') == NULL) ? extension : ".mkv";
+}
+
+// Makes the folder the segments for output_filepath are kept in
+char* create_video_segment_directory(const char* output_filepath, const char* suffix){
+	const size_t directory_length = strlen(output_filepath) + strlen(suffix) + 1;
+	char* directory = calloc(directory_length, sizeof(char));
+	snprintf(directory, directory_length, "%s%s", output_filepath, suffix);
+	if (mkdir(directory, 0700) != 0){
+		if (errno != EEXIST){
+			fprintf(stderr, "Failed to create %s: %s\n", directory, strerror(errno));
+			exit(1);
+		}
+		errno = 0;
+	}
+	return directory;
+}
+
+void video_segment_filename(const char* directory, size_t segment, const char* extension, char* filename){
+	snprintf(filename, PATH_MAX, "%s/" VIDEO_SEGMENT_PATTERN "%s", directory, segment, extension);
+}
+
+// Runs the concat, with the audio from audio_filepath unless it's NULL
+// returns 1 on failure
+int concat_video_segment_list(const char* directory, char* list_filename, char* audio_filepath, char* output_filepath){
+	char* ffmpeg_concat_command[] = { "ffmpeg", "-y",
+									  "-hide_banner", "-loglevel", "error", "-nostats", // Logging bits
+									  "-f", "concat", "-safe", "0", "-i", list_filename,
+									  "-i", audio_filepath,
+									  "-map", "0:v:0", "-map", "1:a:0",
+									  "-c", "copy",
+									  output_filepath,
+									  NULL };
+	char* ffmpeg_concat_video_only_command[] = { "ffmpeg", "-y",
+												 "-hide_banner", "-loglevel", "error", "-nostats", // Logging bits
+												 "-f", "concat", "-safe", "0", "-i", list_filename,
+												 "-map", "0:v:0",
+												 "-c", "copy",
+												 output_filepath,
+												 NULL };
+	pid_t ffmpeg_concat_pid = run_command((audio_filepath != NULL) ? ffmpeg_concat_command : ffmpeg_concat_video_only_command, NULL, NULL, NULL, NULL);
+	int exit_status = 0;
+	if (ffmpeg_concat_pid == -1 || waitpid(ffmpeg_concat_pid, &exit_status, 0) == -1 || !WIFEXITED(exit_status) || WEXITSTATUS(exit_status) != 0){
+		fprintf(stderr, "Failed to join the segments in %s\n", directory);
+		return 1;
+	}
+	return 0;
+}
+
+FILE* open_video_concat_list(const char* directory, char* list_filename){
+	snprintf(list_filename, PATH_MAX, "%s/%s", directory, VIDEO_CONCAT_LIST_FILE);
+	FILE* list = fopen(list_filename, "w");
+	if (list == NULL) fprintf(stderr, "Failed to write %s: %s\n", list_filename, strerror(errno));
+	return list;
+}
+
+// Losslessly joins the video segments and takes the audio from the original file
+// returns 1 on failure
+int concat_video_segments(const char* directory, const char* extension, size_t segment_count, char* audio_filepath, char* output_filepath){
+	char list_filename[PATH_MAX];
+	FILE* list = open_video_concat_list(directory, list_filename);
+	if (list == NULL) return 1;
+	size_t segment;
+	for (segment = 0; segment < segment_count; segment++){
+		// Relative to the list's folder
+		fprintf(list, "file '" VIDEO_SEGMENT_PATTERN "%s'\n", segment, extension);
+	}
+	fclose(list);
+	return concat_video_segment_list(directory, list_filename, audio_filepath, output_filepath);
+}
+
+// The segment muxer pattern for one of several result encoders
+void video_encoder_segment_pattern(const char* directory, size_t encoder, const char* extension, char* pattern){
+	snprintf(pattern, PATH_MAX, "%s/" VIDEO_ENCODER_PREFIX VIDEO_SEGMENT_PREFIX "%%05d%s", directory, encoder, extension);
+}
+
+// Joins chunks that the encoders took turns at, chunk N being segment N / encoder_count of encoder N % encoder_count
+// returns 1 on failure
+int concat_encoder_segments(const char* directory, const char* extension, size_t encoder_count, size_t chunk_count, char* audio_filepath, char* output_filepath){
+	char list_filename[PATH_MAX];
+	FILE* list = open_video_concat_list(directory, list_filename);
+	if (list == NULL) return 1;
+	size_t chunk;
+	for (chunk = 0; chunk < chunk_count; chunk++)
+		fprintf(list, "file '" VIDEO_ENCODER_PREFIX VIDEO_SEGMENT_PATTERN "%s'\n", chunk % encoder_count, chunk / encoder_count, extension);
+	fclose(list);
+	return concat_video_segment_list(directory, list_filename, audio_filepath, output_filepath);
+}
+
+void remove_video_segment_directory(const char* directory){
+	DIR* segment_directory = opendir(directory);
+	if (segment_directory != NULL){
+		char filename[PATH_MAX];
+		struct dirent* entry;
+		while ((entry = readdir(segment_directory)) != NULL){
+			if (entry->d_name[0] == '.') continue;
+			snprintf(filename, PATH_MAX, "%s/%s", directory, entry->d_name);
+			unlink(filename);
+		}
+		closedir(segment_directory);
+	}
+	rmdir(directory);
+}
+
+// Finds the keyframe closest to each of the segment_count - 1 evenly spaced points in the video,
+// so every segment can be decoded on its own and joined back without re-encoding
+// returns the amount of split points found, which can be fewer if keyframes are sparse
+size_t find_keyframe_split_points(char* filepath, size_t segment_count, double* split_points){
+	char* ffprobe_duration_command[] = { "ffprobe",
+										 "-v", "error",
+										 "-show_entries", "format=duration",
+										 "-of", "csv=p=0",
+										 filepath,
+										 NULL };
+	pipe_data ffprobe_duration_pipe = create_pipe_data();
+	pid_t ffprobe_duration_pid = run_command(ffprobe_duration_command, NULL, NULL, &ffprobe_duration_pipe, NULL);
+	FILE* ffprobe_duration_output = fdopen(ffprobe_duration_pipe.files.read_from, "r");
+	double duration;
+	int found_duration = fscanf(ffprobe_duration_output, "%lf", &duration) == 1;
+	fclose(ffprobe_duration_output);
+	if (ffprobe_duration_pid != -1) waitpid(ffprobe_duration_pid, NULL, 0);
+	if (!found_duration){
+		fprintf(stderr, "Error reading the duration of %s\n", filepath);
+		exit(1);
+	}
+
+	char* ffprobe_keyframe_command[] = { "ffprobe",
+										 "-v", "error",
+										 "-select_streams", "v:0",
+										 "-show_entries", "packet=pts_time,flags",
+										 "-of", "csv=p=0",
+										 filepath,
+										 NULL };
+	pipe_data ffprobe_keyframe_pipe = create_pipe_data();
+	pid_t ffprobe_keyframe_pid = run_command(ffprobe_keyframe_command, NULL, NULL, &ffprobe_keyframe_pipe, NULL);
+	FILE* ffprobe_keyframe_output = fdopen(ffprobe_keyframe_pipe.files.read_from, "r");
+
+	// Packets come out in decode order, which is close enough to presentation order for keyframes
+	size_t split_point_count = 0;
+	size_t next_split = 1;
+	double previous_keyframe = 0.0;
+	char* line = NULL;
+	size_t line_length = 0;
+	while (next_split < segment_count && getline(&line, &line_length, ffprobe_keyframe_output) != -1){
+		double time;
+		char flags[16];
+		if (sscanf(line, "%lf,%15s", &time, flags) != 2 || flags[0] != 'K') continue;
+		const double target = duration * next_split / segment_count;
+		if (time < target){
+			previous_keyframe = time;
+			continue;
+		}
+		// Take whichever keyframe either side of the target is closer
+		double split = (target - previous_keyframe < time - target) ? previous_keyframe : time;
+		if (split > 0.0 && (split_point_count == 0 || split > split_points[split_point_count - 1]))
+			split_points[split_point_count++] = split;
+		previous_keyframe = time;
+		next_split++;
+		while (next_split < segment_count && duration * next_split / segment_count <= split) next_split++;
+	}
+	free(line);
+	fclose(ffprobe_keyframe_output);
+	if (ffprobe_keyframe_pid != -1){
+		kill(ffprobe_keyframe_pid, SIGTERM);
+		waitpid(ffprobe_keyframe_pid, NULL, 0);
+	}
+	errno = 0;
+	return split_point_count;
+}
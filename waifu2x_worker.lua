@@ -0,0 +1,68 @@
+-- Long-lived waifu2x upscaler used by anime_upscaler --persistent-upscaler
+-- Must be run with th from inside the waifu2x folder so waifu2x's lib/ can be found.
+-- The model is loaded once, then every "<input path>\t<output path>" line read from stdin
+-- is upscaled and answered with "ok\t<input path>" or "err\t<input path>" on stdout.
+-- Outputs ending in .ppm are written as PPMs for --raw-transport, anything else as a PNG.
+require 'pl'
+package.path = path.join(path.currentdir(), "lib", "?.lua;") .. package.path
+require 'sys'
+require 'w2nn'
+local gm = require 'graphicsmagick'
+local iproc = require 'iproc'
+local reconstruct = require 'reconstruct'
+local image_loader = require 'image_loader'
+
+local cmd = torch.CmdLine()
+cmd:text()
+cmd:text("waifu2x worker for anime_upscaler")
+cmd:text("Options:")
+cmd:option("-model_dir", "./models/photo", 'path to model directory')
+cmd:option("-m", "noise_scale", 'method (scale|noise_scale)')
+cmd:option("-noise_level", 1, '(0|1|2|3)')
+cmd:option("-scale", 2, 'scale factor')
+cmd:option("-crop_size", 128, 'patch size per process')
+cmd:option("-batch_size", 1, 'batch_size')
+cmd:option("-depth", 8, 'bit-depth of the output image (8|16)')
+cmd:option("-force_cudnn", 0, 'use cuDNN backend (0|1)')
+cmd:option("-gpu", 1, 'Device ID')
+local opt = cmd:parse(arg)
+opt.force_cudnn = opt.force_cudnn == 1
+cutorch.setDevice(opt.gpu)
+
+local model_path
+if opt.m == "noise_scale" then
+   model_path = path.join(opt.model_dir, ("noise%d_scale%.1fx_model.t7"):format(opt.noise_level, opt.scale))
+elseif opt.m == "scale" then
+   model_path = path.join(opt.model_dir, ("scale%.1fx_model.t7"):format(opt.scale))
+else
+   error("unsupported method: " .. opt.m)
+end
+local model = w2nn.load_model(model_path, opt.force_cudnn)
+if not model then
+   error("failed to load model " .. model_path)
+end
+
+local function upscale(input, output)
+   local x, meta = image_loader.load_float(input)
+   if not x then
+      return false
+   end
+   local y = reconstruct.scale(model, opt.scale, x, opt.crop_size, opt.batch_size)
+   if output:match("%.ppm$") then
+      -- Raw transport, anime_upscaler reads the pixels straight back out of the PPM
+      gm.Image(iproc.float2byte(y), "RGB", "DHW"):save(output)
+   else
+      image_loader.save_png(output, y, tablex.update({depth = opt.depth, inplace = true}, meta))
+   end
+   return true
+end
+
+io.stdout:setvbuf("line")
+for line in io.stdin:lines() do
+   local input, output = line:match("^([^\t]+)\t([^\t]+)$")
+   if input then
+      local ok, upscaled = pcall(upscale, input, output)
+      io.stdout:write(((ok and upscaled) and "ok\t" or "err\t") .. input .. "\n")
+      collectgarbage()
+   end
+end